@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "alu.h"
+
+
+/*
+ * ALU_PLANE expands X(c, a, b) for every a and b with one carry, in
+ * alu_index order. The operand bytes are spelled by pasting a hex digit
+ * onto a 0xN prefix: ALU_NIBBLE covers sixteen values of b, ALU_ROW all
+ * of b, and ALU_RANGE sixteen values of a.
+ */
+#define ALU_NIBBLE(X, c, a, h) \
+	X(c, a, h##0) X(c, a, h##1) X(c, a, h##2) X(c, a, h##3) \
+	X(c, a, h##4) X(c, a, h##5) X(c, a, h##6) X(c, a, h##7) \
+	X(c, a, h##8) X(c, a, h##9) X(c, a, h##A) X(c, a, h##B) \
+	X(c, a, h##C) X(c, a, h##D) X(c, a, h##E) X(c, a, h##F)
+#define ALU_ROW(X, c, a) \
+	ALU_NIBBLE(X, c, a, 0x0) ALU_NIBBLE(X, c, a, 0x1) \
+	ALU_NIBBLE(X, c, a, 0x2) ALU_NIBBLE(X, c, a, 0x3) \
+	ALU_NIBBLE(X, c, a, 0x4) ALU_NIBBLE(X, c, a, 0x5) \
+	ALU_NIBBLE(X, c, a, 0x6) ALU_NIBBLE(X, c, a, 0x7) \
+	ALU_NIBBLE(X, c, a, 0x8) ALU_NIBBLE(X, c, a, 0x9) \
+	ALU_NIBBLE(X, c, a, 0xA) ALU_NIBBLE(X, c, a, 0xB) \
+	ALU_NIBBLE(X, c, a, 0xC) ALU_NIBBLE(X, c, a, 0xD) \
+	ALU_NIBBLE(X, c, a, 0xE) ALU_NIBBLE(X, c, a, 0xF)
+#define ALU_RANGE(X, c, h) \
+	ALU_ROW(X, c, h##0) ALU_ROW(X, c, h##1) ALU_ROW(X, c, h##2) \
+	ALU_ROW(X, c, h##3) ALU_ROW(X, c, h##4) ALU_ROW(X, c, h##5) \
+	ALU_ROW(X, c, h##6) ALU_ROW(X, c, h##7) ALU_ROW(X, c, h##8) \
+	ALU_ROW(X, c, h##9) ALU_ROW(X, c, h##A) ALU_ROW(X, c, h##B) \
+	ALU_ROW(X, c, h##C) ALU_ROW(X, c, h##D) ALU_ROW(X, c, h##E) \
+	ALU_ROW(X, c, h##F)
+#define ALU_PLANE(X, c) \
+	ALU_RANGE(X, c, 0x0) ALU_RANGE(X, c, 0x1) ALU_RANGE(X, c, 0x2) \
+	ALU_RANGE(X, c, 0x3) ALU_RANGE(X, c, 0x4) ALU_RANGE(X, c, 0x5) \
+	ALU_RANGE(X, c, 0x6) ALU_RANGE(X, c, 0x7) ALU_RANGE(X, c, 0x8) \
+	ALU_RANGE(X, c, 0x9) ALU_RANGE(X, c, 0xA) ALU_RANGE(X, c, 0xB) \
+	ALU_RANGE(X, c, 0xC) ALU_RANGE(X, c, 0xD) ALU_RANGE(X, c, 0xE) \
+	ALU_RANGE(X, c, 0xF)
+
+
+#define BCD_ADD_ENTRY(c, a, b)	bcd_add(a, b, c),
+constexpr alu_entry	bcd_add_table[ALU_TABLE_SIZE] = {
+	ALU_PLANE(BCD_ADD_ENTRY, 0)
+	ALU_PLANE(BCD_ADD_ENTRY, 1)
+};
+#undef BCD_ADD_ENTRY
+
+
+#define BCD_SUB_ENTRY(c, a, b)	bcd_sub(a, b, c),
+constexpr alu_entry	bcd_sub_table[ALU_TABLE_SIZE] = {
+	ALU_PLANE(BCD_SUB_ENTRY, 0)
+	ALU_PLANE(BCD_SUB_ENTRY, 1)
+};
+#undef BCD_SUB_ENTRY
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __6502_ALU_H
+#define __6502_ALU_H
+
+
+/*
+ * Decimal-mode arithmetic. The NMOS 6502 adjusts each nibble of a BCD
+ * add or subtract separately and derives some of the flags from the
+ * intermediate, unadjusted result, which takes a chain of compares to
+ * reproduce. ADC and SBC look the answer up instead, in tables built
+ * at compile time from the functions below. This header is private to
+ * the execution engines.
+ */
+
+
+#include <cstdint>
+
+#include "cpu.h"
+
+
+// An alu_entry packs the result of an operation in the low byte and
+// the N, V, Z, and C flags it produces, in their status register
+// positions, in the high byte.
+typedef uint16_t	alu_entry;
+
+
+// alu_pack builds an alu_entry from a result and its flags.
+constexpr alu_entry
+alu_pack(unsigned result, bool n, bool v, bool z, bool c)
+{
+	return (alu_entry)((result & 0xff) |
+	    ((n ? FLAG_NEGATIVE : 0) | (v ? FLAG_OVERFLOW : 0) |
+	     (z ? FLAG_ZERO : 0) | (c ? FLAG_CARRY : 0)) << 8);
+}
+
+
+// bcd_add_high finishes a decimal add: hi is the sum with the adjusted
+// low nibble, bin the binary sum. N and V come from hi before the high
+// nibble is adjusted, and Z from the binary sum.
+constexpr alu_entry
+bcd_add_high(unsigned a, unsigned b, unsigned hi, unsigned bin)
+{
+	return alu_pack(hi > 0x9f ? hi + 0x60 : hi, hi & 0x80,
+	    ~(a ^ b) & (a ^ hi) & 0x80, (bin & 0xff) == 0, hi > 0x9f);
+}
+
+
+// bcd_add adds b and the carry c to a in decimal mode.
+constexpr alu_entry
+bcd_add(unsigned a, unsigned b, unsigned c)
+{
+	return bcd_add_high(a, b, (a & 0xf0) + (b & 0xf0) +
+	    ((a & 0x0f) + (b & 0x0f) + c > 9 ?
+	     (((a & 0x0f) + (b & 0x0f) + c + 6) & 0x0f) + 0x10 :
+	     (a & 0x0f) + (b & 0x0f) + c), a + b + c);
+}
+
+
+// bcd_sub_high finishes a decimal subtract: hi is the difference with
+// the adjusted low nibble. Every flag comes from the binary difference
+// bin, as if the subtract were done in binary.
+constexpr alu_entry
+bcd_sub_high(unsigned a, unsigned b, unsigned hi, unsigned bin)
+{
+	return alu_pack((hi & 0x100) ? hi - 0x60 : hi, bin & 0x80,
+	    (a ^ b) & (a ^ bin) & 0x80, (bin & 0xff) == 0, bin < 0x100);
+}
+
+
+// bcd_sub subtracts b and the borrow (the complement of the carry c)
+// from a in decimal mode.
+constexpr alu_entry
+bcd_sub(unsigned a, unsigned b, unsigned c)
+{
+	return bcd_sub_high(a, b,
+	    (((a & 0x0f) - (b & 0x0f) + c - 1) & 0x10) ?
+	     ((((a & 0x0f) - (b & 0x0f) + c - 1 - 6) & 0x0f) |
+	      ((a & 0xf0) - (b & 0xf0) - 0x10)) :
+	     ((((a & 0x0f) - (b & 0x0f) + c - 1) & 0x0f) |
+	      ((a & 0xf0) - (b & 0xf0))),
+	    a - b + c - 1);
+}
+
+
+// The tables are indexed by alu_index(a, b, c).
+constexpr unsigned
+alu_index(uint8_t a, uint8_t b, uint8_t c)
+{
+	return ((unsigned)c << 16) | ((unsigned)a << 8) | b;
+}
+
+const unsigned	ALU_TABLE_SIZE = 2 * 256 * 256;
+
+extern const alu_entry	bcd_add_table[ALU_TABLE_SIZE];
+extern const alu_entry	bcd_sub_table[ALU_TABLE_SIZE];
+
+
+#endif
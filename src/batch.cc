@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <cstring>
+#include <thread>
+
+#include "batch.h"
+
+
+// Instance numbers are packed two to a word in the queues.
+const size_t	BATCH_MAX = UINT32_MAX;
+
+
+static inline uint64_t
+pack_range(uint64_t first, uint64_t end)
+{
+	return (first << 32) | end;
+}
+
+
+// Batch sets up count instances, each of which will get a CPU with the
+// given amount of memory running on the given engine.
+Batch::Batch(size_t instances, size_t mem, cpu_engine eng)
+{
+	if (instances > BATCH_MAX)
+		instances = BATCH_MAX;
+	this->count = instances;
+	this->memory = mem;
+	this->engine = eng;
+	this->budget = SIZE_MAX;
+	this->slice = 1000000;
+	this->nthreads = 0;
+	this->pool = 0;
+	this->results = new BatchResult[instances]();
+	this->queues = NULL;
+	this->done = NULL;
+	this->stopping = false;
+	this->setup = NULL;
+	this->finish = NULL;
+	this->arg = NULL;
+}
+
+
+Batch::~Batch()
+{
+	delete[] this->results;
+}
+
+
+void
+Batch::set_budget(size_t n)
+{
+	this->budget = n;
+}
+
+
+void
+Batch::set_slice(size_t n)
+{
+	this->slice = n > 0 ? n : 1;
+}
+
+
+void
+Batch::set_threads(size_t n)
+{
+	this->nthreads = n;
+}
+
+
+void
+Batch::stop()
+{
+	this->stopping = true;
+}
+
+
+BatchResult
+Batch::result(size_t i)
+{
+	return this->results[i];
+}
+
+
+// take pops the next instance off the front of a thread's own queue.
+bool
+Batch::take(size_t self, size_t *instance)
+{
+	std::atomic<uint64_t>	&range = this->queues[self].range;
+	uint64_t		 r = range.load();
+	uint64_t		 first, end;
+
+	do {
+		first = r >> 32;
+		end = r & UINT32_MAX;
+		if (first >= end)
+			return false;
+	} while (!range.compare_exchange_weak(r, pack_range(first + 1, end)));
+
+	*instance = first;
+	return true;
+}
+
+
+// steal moves the back half of another thread's queue into the empty
+// queue of thread self. Only the owner ever grows a queue, and only
+// when it is empty, so a thief cannot lose work to a second thief.
+bool
+Batch::steal(size_t self)
+{
+	uint64_t	r, first, end, mid;
+	size_t		i, victim;
+
+	for (i = 1; i < this->pool; ++i) {
+		victim = (self + i) % this->pool;
+		r = this->queues[victim].range.load();
+		do {
+			first = r >> 32;
+			end = r & UINT32_MAX;
+			if (first >= end)
+				break;
+			mid = first + (end - first) / 2;
+		} while (!this->queues[victim].range.compare_exchange_weak(r,
+		    pack_range(first, mid)));
+		if (first >= end)
+			continue;
+
+		this->queues[self].range.store(pack_range(mid, end));
+		return true;
+	}
+	return false;
+}
+
+
+// run_instance runs one instance to completion, or until its budget
+// runs out or the batch is stopped, and returns the instructions it
+// ran.
+size_t
+Batch::run_instance(size_t i)
+{
+	CPU		 cpu(this->memory, this->engine, &this->arena);
+	BatchResult	&res = this->results[i];
+	RunResult	 part;
+	size_t		 left = this->budget;
+
+	res.run.reason = EXIT_BUDGET;
+	res.run.steps = 0;
+	res.run.cycles = 0;
+	res.ran = true;
+	if (this->setup != NULL)
+		this->setup(cpu, i, this->arg);
+
+	while (left > 0 && !this->stopping.load(std::memory_order_relaxed)) {
+		part = cpu.run_for(left < this->slice ? left : this->slice);
+		res.run.reason = part.reason;
+		res.run.steps += part.steps;
+		res.run.cycles += part.cycles;
+		left -= part.steps;
+		if (part.reason != EXIT_BUDGET)
+			break;
+	}
+
+	res.regs = cpu.get_registers();
+	if (this->finish != NULL)
+		this->finish(cpu, i, res.run, this->arg);
+	return res.run.steps;
+}
+
+
+// work is the body of each thread in the pool: run instances from its
+// own queue, then steal more, until there is none left anywhere.
+void
+Batch::work(size_t self)
+{
+	size_t	instance, steps = 0;
+
+	while (!this->stopping.load(std::memory_order_relaxed)) {
+		if (this->take(self, &instance))
+			steps += this->run_instance(instance);
+		else if (!this->steal(self))
+			break;
+	}
+	this->done[self] = steps;
+}
+
+
+size_t
+Batch::run(batch_setup setup_fn, batch_finish finish_fn, void *ctx)
+{
+	std::thread	*threads;
+	size_t		 i, share, total = 0;
+
+	this->setup = setup_fn;
+	this->finish = finish_fn;
+	this->arg = ctx;
+	this->stopping = false;
+	for (i = 0; i < this->count; ++i)
+		this->results[i].ran = false;
+
+	this->pool = this->nthreads;
+	if (this->pool == 0)
+		this->pool = std::thread::hardware_concurrency();
+	if (this->pool == 0)
+		this->pool = 1;
+
+	this->queues = new BatchQueue[this->pool];
+	this->done = new size_t[this->pool]();
+	share = (this->count + this->pool - 1) / this->pool;
+	for (i = 0; i < this->pool; ++i) {
+		this->queues[i].range.store(pack_range(
+		    i * share < this->count ? i * share : this->count,
+		    (i + 1) * share < this->count ? (i + 1) * share :
+		    this->count));
+	}
+
+	// The calling thread is the first member of the pool.
+	threads = new std::thread[this->pool];
+	for (i = 1; i < this->pool; ++i)
+		threads[i] = std::thread(&Batch::work, this, i);
+	this->work(0);
+	for (i = 1; i < this->pool; ++i)
+		threads[i].join();
+
+	for (i = 0; i < this->pool; ++i)
+		total += this->done[i];
+	delete[] threads;
+	delete[] this->done;
+	delete[] this->queues;
+	this->done = NULL;
+	this->queues = NULL;
+	return total;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#ifndef __6502_BATCH_H
+#define __6502_BATCH_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+#include "cpu.h"
+
+
+// A batch_setup prepares an instance's freshly created CPU before it
+// runs, loading the program and that instance's input. A batch_finish
+// collects what it needs from the CPU once the instance has stopped.
+// Each is called once per instance, on the thread that runs it, with
+// the instance number and the caller's argument, so they can write to
+// per-instance storage without locking.
+typedef void	(*batch_setup)(CPU &, size_t, void *);
+typedef void	(*batch_finish)(CPU &, size_t, const RunResult &, void *);
+
+
+// BatchResult is how an instance's run ended and the registers it
+// ended with. ran is false for instances never started because the
+// batch was stopped.
+struct BatchResult {
+	RunResult	run;
+	Registers	regs;
+	bool		ran;
+};
+
+
+/*
+ * A Batch runs many independent instances of a program across a pool
+ * of threads. Every thread starts with an equal share of the instances
+ * and, once it has run out, steals half of what is left to another
+ * thread, so a few long-running instances do not leave the rest of the
+ * pool idle. An instance gets its own CPU for as long as it runs, and
+ * runs in slices of a bounded number of instructions up to an overall
+ * budget; stop is noticed between slices. The CPUs' memory comes from
+ * an arena, so each instance reuses a slab another one finished with.
+ * Results go straight into a per-instance slot, so nothing on the hot
+ * path takes a lock.
+ */
+class Batch {
+	private:
+		// A BatchQueue is a thread's share of the instances, the
+		// first and one past the last packed into one word so
+		// that the owner taking from the front and thieves
+		// taking from the back can both use compare-and-swap.
+		// Queues are padded out to a cache line each.
+		struct BatchQueue {
+			std::atomic<uint64_t>	range;
+			char			pad[56];
+		};
+
+		size_t			 count;
+		size_t			 memory;
+		cpu_engine		 engine;
+		size_t			 budget;
+		size_t			 slice;
+		size_t			 nthreads;
+		size_t			 pool;
+		BatchResult		*results;
+		BatchQueue		*queues;
+		size_t			*done;
+		std::atomic<bool>	 stopping;
+		batch_setup		 setup;
+		batch_finish		 finish;
+		void			*arg;
+		Arena			 arena;
+
+		Batch(const Batch &) = delete;
+		Batch &operator=(const Batch &) = delete;
+
+		void work(size_t);
+		bool take(size_t, size_t *);
+		bool steal(size_t);
+		size_t run_instance(size_t);
+	public:
+		Batch(size_t, size_t, cpu_engine);
+		~Batch();
+
+		// set_budget caps the instructions run by any one instance
+		// (unlimited by default); set_slice sets how many run
+		// between checks for stop. set_threads sets the size of the
+		// pool; zero, the default, uses one per hardware thread.
+		void set_budget(size_t);
+		void set_slice(size_t);
+		void set_threads(size_t);
+
+		// run runs every instance and returns the number of
+		// instructions run, over all of them.
+		size_t run(batch_setup, batch_finish, void *);
+
+		// stop asks a run in progress, from any thread, to end
+		// once the instances already running finish their slice.
+		void stop(void);
+		BatchResult result(size_t);
+};
+
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bench measures emulator throughput on a loop-heavy program, both with
+ * no trace sink attached and with a text trace sink writing to
+ * /dev/null (roughly what every build paid when tracing was hard-wired
+ * into the core), and on a loop mixing the flag-setting ALU, shift, and
+ * compare instructions. An empty counted loop shows how fast the block
+ * engines skip idle loops. It also runs a sweep of one program over many
+ * inputs, both on separate CPUs and on a Lockstep, and the same sweep
+ * as a Batch on growing thread pools to show how it scales. Finally it
+ * runs the sweep from forks of one CPU, as a search would, and times
+ * the ways of getting a clean CPU for each instance of a job.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "batch.h"
+#include "cpu.h"
+#include "lockstep.h"
+
+
+// Nested counted loops: the inner loop runs X down from 0, storing it
+// as it goes, and the outer loop counts Y up to $40. The store keeps
+// the block engines from skipping the inner loop as idle, so every
+// engine runs all of it.
+static const unsigned char	loop_program[] = {
+	0xa0, 0x00,		// LDY #$00
+	0xa2, 0x00,		// LDX #$00
+	0x86, 0x10,		// STX $10
+	0xca,			// DEX
+	0xd0, 0xfb,		// BNE -5
+	0xc8,			// INY
+	0xc0, 0x40,		// CPY #$40
+	0xd0, 0xf4,		// BNE -12
+	0x00			// BRK
+};
+
+
+// The same loops with an empty inner loop, which the block engines
+// skip through instead of running.
+static const unsigned char	idle_program[] = {
+	0xa0, 0x00,		// LDY #$00
+	0xa2, 0x00,		// LDX #$00
+	0xca,			// DEX
+	0xd0, 0xfd,		// BNE -3
+	0xc8,			// INY
+	0xc0, 0x40,		// CPY #$40
+	0xd0, 0xf6,		// BNE -10
+	0x00			// BRK
+};
+
+
+// An opcode mix: the same nested loops, with the inner loop doing
+// arithmetic and logic on the zero page. Nearly every instruction sets
+// flags that the next one overwrites.
+static const unsigned char	mix_program[] = {
+	0xa0, 0x00,		// LDY #$00
+	0xa2, 0x00,		// LDX #$00
+	0x8a,			// TXA
+	0x18,			// CLC
+	0x65, 0x10,		// ADC $10
+	0x85, 0x10,		// STA $10
+	0x29, 0x7f,		// AND #$7f
+	0x45, 0x11,		// EOR $11
+	0x09, 0x01,		// ORA #$01
+	0x85, 0x11,		// STA $11
+	0x0a,			// ASL A
+	0x26, 0x12,		// ROL $12
+	0xc9, 0x40,		// CMP #$40
+	0xa5, 0x10,		// LDA $10
+	0xe9, 0x03,		// SBC #$03
+	0x24, 0x11,		// BIT $11
+	0xca,			// DEX
+	0xd0, 0xe4,		// BNE -28
+	0xc8,			// INY
+	0xc0, 0x40,		// CPY #$40
+	0xd0, 0xdd,		// BNE -35
+	0x00			// BRK
+};
+
+
+// A sweep: the same loops, working on an input at $10 that differs
+// from one run to the next.
+static const unsigned char	sweep_program[] = {
+	0xa0, 0x00,		// LDY #$00
+	0xa2, 0x00,		// LDX #$00
+	0x8a,			// TXA
+	0x18,			// CLC
+	0x65, 0x10,		// ADC $10
+	0x85, 0x11,		// STA $11
+	0x49, 0x5a,		// EOR #$5a
+	0x29, 0x7f,		// AND #$7f
+	0x0a,			// ASL A
+	0xc9, 0x40,		// CMP #$40
+	0xca,			// DEX
+	0xd0, 0xf2,		// BNE -14
+	0xc8,			// INY
+	0xc0, 0x10,		// CPY #$10
+	0xd0, 0xeb,		// BNE -21
+	0x00			// BRK
+};
+
+static const size_t	SWEEP_LANES = 256;
+
+
+// A short job that writes to a few pages, like an instance that checks
+// one input.
+static const unsigned char	touch_program[] = {
+	0xa9, 0x01,		// LDA #$01
+	0x85, 0x10,		// STA $10
+	0x48,			// PHA
+	0x8d, 0x00, 0x02,	// STA $0200
+	0x8d, 0x00, 0x40,	// STA $4000
+	0x00			// BRK
+};
+
+
+// A Program is a benchmark program and its length.
+struct Program {
+	const unsigned char	*code;
+	size_t			 len;
+};
+
+static const Program	loop = {loop_program, sizeof(loop_program)};
+static const Program	idle = {idle_program, sizeof(idle_program)};
+static const Program	mix = {mix_program, sizeof(mix_program)};
+
+
+// The engines the opcode mix is run on.
+static const struct {
+	const char	*name;
+	cpu_engine	 engine;
+} engines[] = {
+	{"mix table", ENGINE_TABLE},
+	{"mix threaded", ENGINE_THREADED},
+	{"mix cached", ENGINE_CACHED},
+	{"mix jit", ENGINE_JIT}
+};
+static const size_t	nengines = sizeof(engines) / sizeof(engines[0]);
+
+
+static double
+run_program(const Program &prog, cpu_engine engine, TraceSink *sink,
+    int iterations, size_t *steps, size_t *cycles)
+{
+	std::chrono::steady_clock::time_point	start, stop;
+	int					i;
+
+	*steps = 0;
+	*cycles = 0;
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < iterations; ++i) {
+		CPU	cpu(0x400, engine);
+
+		cpu.load(prog.code, 0x300, prog.len);
+		cpu.set_entry(0x300);
+		cpu.set_trace(sink);
+		cpu.run(false);
+		*steps += cpu.get_steps();
+		*cycles += cpu.get_cycles();
+	}
+	stop = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double>(stop - start).count();
+}
+
+
+// run_sweep runs the sweep program once per lane, with the lane number
+// as its input, on separate CPUs or on a Lockstep.
+static double
+run_sweep(bool lockstep, cpu_engine engine, int iterations, size_t *steps,
+    size_t *cycles)
+{
+	std::chrono::steady_clock::time_point	start, stop;
+	RunResult				res;
+	size_t					i;
+	int					iter;
+
+	*steps = 0;
+	*cycles = 0;
+	start = std::chrono::steady_clock::now();
+	for (iter = 0; iter < iterations; ++iter) {
+		if (lockstep) {
+			Lockstep	group(SWEEP_LANES, 0x400);
+
+			group.load(sweep_program, 0x300, sizeof(sweep_program));
+			group.set_entry(0x300);
+			for (i = 0; i < SWEEP_LANES; ++i)
+				group.lane(i).DMA(0x10, (uint8_t)i);
+			*steps += group.run_for(SIZE_MAX);
+			for (i = 0; i < SWEEP_LANES; ++i)
+				*cycles += group.result(i).cycles;
+			continue;
+		}
+		for (i = 0; i < SWEEP_LANES; ++i) {
+			CPU	cpu(0x400, engine);
+
+			cpu.load(sweep_program, 0x300, sizeof(sweep_program));
+			cpu.set_entry(0x300);
+			cpu.DMA(0x10, (uint8_t)i);
+			res = cpu.run_for(SIZE_MAX);
+			*steps += res.steps;
+			*cycles += res.cycles;
+		}
+	}
+	stop = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double>(stop - start).count();
+}
+
+
+static void
+sweep_setup(CPU &cpu, size_t i, void *)
+{
+	cpu.load(sweep_program, 0x300, sizeof(sweep_program));
+	cpu.set_entry(0x300);
+	cpu.DMA(0x10, (uint8_t)i);
+}
+
+
+// run_batch runs the sweep over instances inputs as a Batch on a pool
+// of the given size.
+static double
+run_batch(size_t instances, size_t threads, size_t *steps)
+{
+	std::chrono::steady_clock::time_point	start, stop;
+	Batch					batch(instances, 0x400,
+						    ENGINE_CACHED);
+
+	batch.set_threads(threads);
+	start = std::chrono::steady_clock::now();
+	*steps = batch.run(sweep_setup, NULL, NULL);
+	stop = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double>(stop - start).count();
+}
+
+
+// run_forks forks a CPU set up for the sweep instances times, keeping
+// every fork alive, then runs each fork on its own input.
+static double
+run_forks(size_t instances, double *fork_secs, size_t *steps)
+{
+	std::chrono::steady_clock::time_point	start, forked, stop;
+	std::vector<CPU *>			forks(instances);
+	CPU					parent(0x400);
+	size_t					i;
+
+	sweep_setup(parent, 0, NULL);
+	*steps = 0;
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < instances; ++i)
+		forks[i] = parent.fork();
+	forked = std::chrono::steady_clock::now();
+	for (i = 0; i < instances; ++i) {
+		forks[i]->DMA(0x10, (uint8_t)i);
+		forks[i]->run(false);
+		*steps += forks[i]->get_steps();
+		delete forks[i];
+	}
+	stop = std::chrono::steady_clock::now();
+
+	*fork_secs = std::chrono::duration<double>(forked - start).count();
+	return std::chrono::duration<double>(stop - start).count();
+}
+
+
+// recycle runs a short job instances times, each time on a clean CPU
+// got the given way, and returns the time per instance in
+// microseconds. way is 0 for a new CPU, 1 for a new CPU from an arena,
+// and 2 for resetting one CPU.
+static double
+recycle(int way, size_t instances)
+{
+	std::chrono::steady_clock::time_point	start, stop;
+	Arena					arena;
+	CPU					reused(0x400);
+	CPU					*cpu;
+	size_t					i;
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < instances; ++i) {
+		if (way == 0)
+			cpu = new CPU(0x400);
+		else if (way == 1)
+			cpu = new CPU(0x400, ENGINE_TABLE, &arena);
+		else
+			cpu = &reused;
+		cpu->load(touch_program, 0x300, sizeof(touch_program));
+		cpu->set_entry(0x300);
+		cpu->run(false);
+		if (way == 2)
+			cpu->reset();
+		else
+			delete cpu;
+	}
+	stop = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double>(stop - start).count() * 1e6 /
+	    instances;
+}
+
+
+// report prints the throughput both in instructions and in emulated
+// clock rate.
+static void
+report(const char *name, double secs, size_t steps, size_t cycles)
+{
+	std::cout << name << ": " << steps << " instructions in "
+		  << secs << "s, " << (steps / secs / 1000000.0)
+		  << " MIPS, " << (cycles / secs / 1000000.0)
+		  << " emulated MHz\n";
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	std::ofstream	devnull("/dev/null");
+	TextTrace	text(devnull);
+	NullTrace	none;
+	TraceRing	ring(1 << 16, &none);
+	int		iterations = 100;
+	size_t		steps, cycles;
+	double		fast, slow, threaded, cached, jit, secs, single = 0;
+	double		forking;
+	size_t		i, threads, cores;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+
+	fast = run_program(loop, ENGINE_TABLE, NULL, iterations,
+	    &steps, &cycles);
+	report("untraced", fast, steps, cycles);
+	threaded = run_program(loop, ENGINE_THREADED, NULL, iterations,
+	    &steps, &cycles);
+	report("threaded", threaded, steps, cycles);
+	cached = run_program(loop, ENGINE_CACHED, NULL, iterations,
+	    &steps, &cycles);
+	report("cached", cached, steps, cycles);
+	jit = run_program(loop, ENGINE_JIT, NULL, iterations,
+	    &steps, &cycles);
+	report("jit", jit, steps, cycles);
+	secs = run_program(idle, ENGINE_CACHED, NULL, iterations,
+	    &steps, &cycles);
+	report("idle skip cached", secs, steps, cycles);
+	slow = run_program(loop, ENGINE_TABLE, &text, iterations,
+	    &steps, &cycles);
+	report("text trace", slow, steps, cycles);
+	secs = run_program(loop, ENGINE_TABLE, &ring, iterations,
+	    &steps, &cycles);
+	report("ring trace", secs, steps, cycles);
+	for (i = 0; i < nengines; ++i) {
+		secs = run_program(mix, engines[i].engine, NULL, iterations,
+		    &steps, &cycles);
+		report(engines[i].name, secs, steps, cycles);
+	}
+	iterations = iterations / 10 + 1;
+	secs = run_sweep(false, ENGINE_TABLE, iterations, &steps,
+	    &cycles);
+	report("sweep table", secs, steps, cycles);
+	secs = run_sweep(false, ENGINE_CACHED, iterations, &steps,
+	    &cycles);
+	report("sweep cached", secs, steps, cycles);
+	secs = run_sweep(true, ENGINE_TABLE, iterations, &steps,
+	    &cycles);
+	report("sweep lockstep", secs, steps, cycles);
+
+	// Scaling: double the pool up to the number of hardware threads.
+	cores = std::thread::hardware_concurrency();
+	if (cores == 0)
+		cores = 1;
+	for (threads = 1; ; threads *= 2) {
+		if (threads > cores)
+			threads = cores;
+		secs = run_batch(SWEEP_LANES * iterations, threads, &steps);
+		if (threads == 1)
+			single = secs;
+		std::cout << "batch " << threads << " threads: "
+			  << (steps / secs / 1000000.0) << " MIPS, "
+			  << (single / secs) << "x one thread\n";
+		if (threads == cores)
+			break;
+	}
+
+	secs = run_forks(SWEEP_LANES * iterations, &forking, &steps);
+	std::cout << "forks: " << (SWEEP_LANES * iterations) << " in "
+		  << forking << "s, " << (forking * 1e6 / (SWEEP_LANES * iterations))
+		  << "us per fork, " << (steps / secs / 1000000.0)
+		  << " MIPS including forking\n";
+	std::cout << "instance: new " << recycle(0, SWEEP_LANES * iterations)
+		  << "us, arena " << recycle(1, SWEEP_LANES * iterations)
+		  << "us, reset " << recycle(2, SWEEP_LANES * iterations)
+		  << "us\n";
+	std::cout << "speedup: " << (slow / fast) << "x\n";
+	return 0;
+}
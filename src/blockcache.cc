@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "blockcache.h"
+#include "cpu.h"
+#include "instructions.h"
+#include "opcodes.h"
+
+
+BlockCache::BlockCache()
+{
+	size_t	i;
+
+	for (i = 0; i < BLOCK_CACHE_SIZE; ++i)
+		this->blocks[i].count = 0;
+	this->invalidated = false;
+}
+
+
+// written drops every block that has code in the page.
+void
+BlockCache::written(uint8_t page)
+{
+	size_t		 i;
+	CodeBlock	*blk;
+
+	for (i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+		blk = &this->blocks[i];
+		if (blk->count == 0)
+			continue;
+		if ((blk->start >> 8) <= page && page <= (blk->end >> 8))
+			blk->count = 0;
+	}
+	this->invalidated = true;
+}
+
+
+// drop_native forgets every block's native translation.
+void
+BlockCache::drop_native()
+{
+	size_t	i;
+
+	for (i = 0; i < BLOCK_CACHE_SIZE; ++i)
+		this->blocks[i].native = NULL;
+}
+
+
+// ends_block returns true if the opcode transfers control: branches,
+// jumps, subroutine calls and returns, and BRK.
+static bool
+ends_block(uint8_t op)
+{
+	if ((op & 0x1f) == 0x10)
+		return true;
+
+	switch (op) {
+	case 0x00: // BRK
+	case 0x20: // JSR
+	case 0x40: // RTI
+	case 0x4C: // JMP abs
+	case 0x60: // RTS
+	case 0x6C: // JMP ind
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+// idle_loop returns the kind of idle loop the block is, if any. Either
+// kind has to branch back to its own start and must not write memory,
+// or change anything but the one register it counts or loads.
+static idle_kind
+idle_loop(const CodeBlock *blk)
+{
+	const DecodedInsn	*last = &blk->insns[blk->count - 1];
+	uint8_t			 i;
+
+	if ((last->op & 0x1f) != 0x10 ||
+	    (uint16_t)(blk->end + 1 + (int8_t)(last->arg & 0xff)) != blk->start)
+		return IDLE_NONE;
+
+	if (blk->count == 2) {
+		switch (blk->insns[0].op) {
+		case 0xA5: case 0xAD:	// LDA zp/abs
+		case 0xA6: case 0xAE:	// LDX zp/abs
+		case 0xA4: case 0xAC:	// LDY zp/abs
+		case 0x24: case 0x2C:	// BIT zp/abs
+			return IDLE_POLL;
+		default:
+			break;
+		}
+	}
+
+	if (last->op != 0xD0 || blk->count < 2)
+		return IDLE_NONE;
+	switch (blk->insns[blk->count - 2].op) {
+	case 0xCA: case 0x88: case 0xE8: case 0xC8:	// DEX DEY INX INY
+		break;
+	default:
+		return IDLE_NONE;
+	}
+	for (i = 0; i + 2 < blk->count; ++i) {
+		if (blk->insns[i].op != 0xEA)
+			return IDLE_NONE;
+	}
+	return IDLE_COUNTED;
+}
+
+
+// decode_block decodes the block starting at start into blk, marks the
+// instruction pairs it can fuse, and watches the pages it was read from.
+void
+CPU::decode_block(CodeBlock *blk, uint16_t start)
+{
+	DecodedInsn	*in;
+	uint32_t	 addr = start;
+	uint32_t	 page;
+	uint32_t	 insn;
+	uint8_t		 op;
+
+	blk->start = start;
+	blk->count = 0;
+	blk->hits = 0;
+	blk->native = NULL;
+	do {
+		insn = this->ram.fetch((uint16_t)addr);
+		op = insn & 0xff;
+		in = &blk->insns[blk->count++];
+		in->fn = dispatch[op];
+		in->op = op;
+		in->length = length[op];
+		in->cycles = opcode_cycles[op];
+		in->arg = (uint16_t)(insn >> 8);
+		addr += in->length;
+		if (in->fn == &CPU::ILL<MODE_IMP> || ends_block(op))
+			break;
+	} while (blk->count < BLOCK_MAX_INSNS && addr + 3 <= 0x10000);
+
+	blk->end = (uint16_t)(addr - 1);
+	blk->idle = idle_loop(blk);
+	if (blk->idle != IDLE_NONE) {
+		// Every pass takes the branch back to the start.
+		blk->loop_cycles = 1 + (((blk->start ^ addr) & 0xff00) != 0);
+		for (in = blk->insns; in < blk->insns + blk->count; ++in)
+			blk->loop_cycles += in->cycles;
+	}
+	for (in = blk->insns; in < blk->insns + blk->count; ++in) {
+		in->fused = NULL;
+		if (in + 1 < blk->insns + blk->count) {
+			in->fused = fusion(in[0].op, in[1].op);
+			if (in->fused != NULL)
+				(++in)->fused = NULL;
+		}
+	}
+	for (page = start >> 8; page <= ((addr - 1) >> 8); ++page)
+		this->ram.watch((uint8_t)page);
+}
+
+
+// fuse runs a pair of instructions, F and then G, as one handler.
+// Only instructions that never look at the PC or halt are fused as F,
+// so the PC can already point past G.
+template <bool (CPU::*F)(uint16_t), bool (CPU::*G)(uint16_t)>
+bool
+CPU::fuse(const DecodedInsn *in)
+{
+	(this->*F)(in[0].arg);
+	return (this->*G)(in[1].arg);
+}
+
+
+/*
+ * K6502_FUSIONS expands X(first opcode, instruction, mode, second
+ * opcode, instruction, mode) for each pair of instructions the decoder
+ * fuses: counted loops (DEX; BNE and INY; CPY #), compares against a
+ * constant feeding a branch, and copies (LDA; STA).
+ */
+#define K6502_FUSIONS(X) \
+	X(0xCA, DEX, IMP, 0xD0, BNE, REL) \
+	X(0x88, DEY, IMP, 0xD0, BNE, REL) \
+	X(0xE8, INX, IMP, 0xD0, BNE, REL) \
+	X(0xC8, INY, IMP, 0xD0, BNE, REL) \
+	X(0xE8, INX, IMP, 0xE0, CPX, IMM) \
+	X(0xC8, INY, IMP, 0xC0, CPY, IMM) \
+	X(0xC9, CMP, IMM, 0xD0, BNE, REL) \
+	X(0xC9, CMP, IMM, 0xF0, BEQ, REL) \
+	X(0xE0, CPX, IMM, 0xD0, BNE, REL) \
+	X(0xE0, CPX, IMM, 0xF0, BEQ, REL) \
+	X(0xC0, CPY, IMM, 0xD0, BNE, REL) \
+	X(0xC0, CPY, IMM, 0xF0, BEQ, REL) \
+	X(0xA9, LDA, IMM, 0x85, STA, ZP) \
+	X(0xA9, LDA, IMM, 0x8D, STA, ABS) \
+	X(0xA5, LDA, ZP, 0x85, STA, ZP) \
+	X(0xAD, LDA, ABS, 0x8D, STA, ABS) \
+	X(0xBD, LDA, ABSX, 0x9D, STA, ABSX) \
+	X(0xB9, LDA, ABSY, 0x99, STA, ABSY) \
+	X(0xB1, LDA, IIZPY, 0x91, STA, IIZPY)
+
+
+// fusion looks up the fused handler for an opcode pair, returning NULL
+// if the pair is not fused.
+CPU::fused_handler
+CPU::fusion(uint8_t first, uint8_t second)
+{
+	struct Fusion {
+		uint8_t		first;
+		uint8_t		second;
+		fused_handler	fn;
+	};
+#define FUSION_ENTRY(op1, insn1, mode1, op2, insn2, mode2)		\
+	{op1, op2, &CPU::fuse<&CPU::insn1<MODE_##mode1>,		\
+	    &CPU::insn2<MODE_##mode2> >},
+	static const Fusion	fusions[] = {
+		K6502_FUSIONS(FUSION_ENTRY)
+	};
+#undef FUSION_ENTRY
+	size_t	i;
+
+	for (i = 0; i < sizeof(fusions) / sizeof(fusions[0]); ++i) {
+		if (fusions[i].first == first && fusions[i].second == second)
+			return fusions[i].fn;
+	}
+	return NULL;
+}
+
+
+/*
+ * skip_idle fast-forwards through an idle loop that has just gone round
+ * once, so the PC is back at the start of the block, as if it had run
+ * up to the step limit or until the loop is on its last pass. The last
+ * pass itself is always left to the engine.
+ *
+ * A counted loop spins its counter down (or up) to zero and does
+ * nothing else, so its passes can be counted from the counter. A poll
+ * reads the same memory location every time around. Nothing else runs
+ * while the engine does, so unless the location is an I/O page it
+ * reads the same value forever, and the loop only ends with the step
+ * budget. Without a budget (a plain run, whose limit is SIZE_MAX) a
+ * poll is left to spin, since something outside the CPU may yet change
+ * the location. The passes skipped never take the cycle count past
+ * SIZE_MAX.
+ */
+void
+CPU::skip_idle(CodeBlock *blk, size_t limit)
+{
+	const DecodedInsn	*in = &blk->insns[blk->count - 2];
+	size_t			 passes = (limit - this->steps) / blk->count;
+	size_t			 left;
+	uint8_t			*reg = NULL;
+
+	if (blk->idle == IDLE_POLL) {
+		if (limit == SIZE_MAX ||
+		    this->ram.is_io(in->length == 2 ? 0 : in->arg >> 8))
+			return;
+	} else {
+		switch (in->op) {
+		case 0xCA: case 0xE8:
+			reg = &this->x;
+			break;
+		default:
+			reg = &this->y;
+			break;
+		}
+		// The counter is non-zero, since the branch was taken;
+		// this many passes are left, the last one included.
+		left = (in->op == 0xCA || in->op == 0x88) ? *reg :
+		    0x100 - *reg;
+		if (passes > left - 1)
+			passes = left - 1;
+	}
+
+	if (passes > (SIZE_MAX - this->cycles) / blk->loop_cycles)
+		passes = (SIZE_MAX - this->cycles) / blk->loop_cycles;
+	if (passes == 0)
+		return;
+	if (reg != NULL) {
+		if (in->op == 0xCA || in->op == 0x88)
+			*reg -= (uint8_t)passes;
+		else
+			*reg += (uint8_t)passes;
+		this->set_nz(*reg);
+	}
+	this->steps += passes * blk->count;
+	this->cycles += passes * blk->loop_cycles;
+}
+
+
+/*
+ * run_cached is the block-cache execution engine. It looks up the
+ * decoded block at the PC (decoding it on a miss) and runs its
+ * instructions without touching the instruction bytes again. If a
+ * store invalidates the running block, the rest of it is abandoned and
+ * decoded afresh. Like the other engines it returns false when the CPU
+ * halts and true when the step count reaches limit.
+ */
+bool
+CPU::run_cached(size_t limit)
+{
+	CodeBlock	*blk;
+	bool		 limited = false;
+
+	for (;;) {
+		blk = this->blocks->lookup(this->pc);
+		if (blk->count == 0 || blk->start != this->pc)
+			this->decode_block(blk, this->pc);
+
+		this->blocks->invalidated = false;
+		if (!this->run_block(blk, limit, &limited))
+			return false;
+		if (limited)
+			return true;
+		if (blk->idle != IDLE_NONE && this->pc == blk->start &&
+		    !this->blocks->invalidated)
+			this->skip_idle(blk, limit);
+	}
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __6502_BLOCKCACHE_H
+#define __6502_BLOCKCACHE_H
+
+
+#include "cpu.h"
+#include "jit.h"
+#include "ram.h"
+
+
+// The cache is direct-mapped on the PC of the first instruction of a
+// block.
+const size_t	BLOCK_CACHE_SIZE = 512;
+const size_t	BLOCK_MAX_INSNS = 16;
+
+
+// A DecodedInsn is an instruction with its handler looked up and its
+// operand bytes already fetched. If the instruction and the one after
+// it form a common idiom (DEX; BNE, say), fused is a handler that runs
+// both at once; it is given the first of the pair.
+struct DecodedInsn {
+	bool		(CPU::*fn)(uint16_t);
+	bool		(CPU::*fused)(const DecodedInsn *);
+	uint16_t	arg;
+	uint8_t		length;
+	uint8_t		cycles;
+	uint8_t		op;
+};
+
+
+// Kinds of idle loop a block can be; see CPU::skip_idle.
+enum idle_kind {
+	IDLE_NONE = 0,
+	IDLE_COUNTED,	// NOPs, then DEX/DEY/INX/INY; BNE to the start
+	IDLE_POLL	// LDA/LDX/LDY/BIT on one location; branch to the start
+};
+
+
+// A CodeBlock is a straight-line run of instructions ending at the
+// first branch, jump, return, or halt (or after BLOCK_MAX_INSNS).
+// The JIT engine also counts how often the block has run and keeps its
+// native translation, if any. A block that is an idle loop records its
+// kind and the cycles one pass around the loop takes.
+struct CodeBlock {
+	uint16_t	start;
+	uint16_t	end;
+	uint8_t		count;
+	idle_kind	idle;
+	uint32_t	loop_cycles;
+	uint32_t	hits;
+	NativeBlock	native;
+	DecodedInsn	insns[BLOCK_MAX_INSNS];
+};
+
+
+// A BlockCache holds decoded blocks for the cached engine. It watches
+// every page holding cached code; a write to one of those pages drops
+// all the blocks on it.
+class BlockCache : public PageWatcher {
+	private:
+		CodeBlock	blocks[BLOCK_CACHE_SIZE];
+	public:
+		// invalidated is set whenever blocks are dropped, so the
+		// engine can stop running a block that was just
+		// overwritten.
+		bool		invalidated;
+
+		BlockCache();
+
+		CodeBlock *lookup(uint16_t);
+		void written(uint8_t);
+		void drop_native(void);
+};
+
+
+// lookup returns the cache slot for a block starting at pc. The slot
+// holds that block only if its count is non-zero and its start is pc.
+inline CodeBlock *
+BlockCache::lookup(uint16_t pc)
+{
+	return &this->blocks[pc & (BLOCK_CACHE_SIZE - 1)];
+}
+
+
+// run_block runs the decoded instructions of a block, a fused pair at a
+// time where it can. It returns false if the CPU halted, and sets
+// *limited (and stops) if the step count reached limit. A pair is only
+// fused if both halves fit in the budget, so limits are exact.
+inline bool
+CPU::run_block(CodeBlock *blk, size_t limit, bool *limited)
+{
+	DecodedInsn	*in, *end;
+
+	for (in = blk->insns, end = in + blk->count; in < end; ++in) {
+		if (this->steps == limit) {
+			*limited = true;
+			return true;
+		}
+		if (in->fused != NULL && limit - this->steps >= 2) {
+			this->pc += in[0].length + in[1].length;
+			this->steps += 2;
+			this->cycles += in[0].cycles + in[1].cycles;
+			if (!(this->*in->fused)(in))
+				return false;
+			++in;
+		} else {
+			this->pc += in->length;
+			this->steps++;
+			this->cycles += in->cycles;
+			if (!(this->*in->fn)(in->arg))
+				return false;
+		}
+		if (this->blocks->invalidated)
+			break;
+	}
+	return true;
+}
+
+
+#endif
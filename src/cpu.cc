@@ -16,108 +16,132 @@
 
 #include <iomanip>
 #include <iostream>
+#include <cstdint>
 #include <cstring>
+#include "blockcache.h"
 #include "cpu.h"
+#include "instructions.h"
+#include "opcodes.h"
 #include "ram.h"
 
 
-// The aaa bits of instructions.
-static const uint8_t	aaa = (1 << 7) | (1 << 6) | (1 << 5);
+// The dispatch table maps each opcode to the handler for its
+// instruction and addressing mode.
+#define DISPATCH_ENTRY(op, insn, mode, cycles)	&CPU::insn<MODE_##mode>,
+const CPU::handler CPU::dispatch[256] = {
+	K6502_OPCODES(DISPATCH_ENTRY)
+};
+#undef DISPATCH_ENTRY
 
-// The bbb bits of instructions.
-static const uint8_t	bbb = (1 << 4) | (1 << 3) | (1 << 2);
 
-// The cc bits of instructions.
-static const uint8_t	cc = (1 << 1) | (1 << 0);
+// length holds the length in bytes of each opcode's instruction.
+#define LENGTH_ENTRY(op, insn, mode, cycles)	mode_length(MODE_##mode),
+const uint8_t CPU::length[256] = {
+	K6502_OPCODES(LENGTH_ENTRY)
+};
+#undef LENGTH_ENTRY
 
-// C01 address modes
-static const uint8_t	C01_MODE_IIZPX = 0;
-static const uint8_t	C01_MODE_ZP = 1;
-static const uint8_t	C01_MODE_IMM = 2;
-static const uint8_t	C01_MODE_ABS = 3;
-static const uint8_t	C01_MODE_IIZPY = 4;
-static const uint8_t	C01_MODE_ZPX = 5;
-static const uint8_t	C01_MODE_ABSY = 6;
-static const uint8_t	C01_MODE_ABSX = 7;
 
-// C10 address modes
-static const uint8_t	C10_MODE_IMM = 0;
-static const uint8_t	C10_MODE_ZP = 1;
-static const uint8_t	C10_MODE_ACC = 2;
-static const uint8_t	C10_MODE_ABS = 3;
-static const uint8_t	C10_MODE_ZPX = 5;
-static const uint8_t	C10_MODE_ZPY = 8;
-static const uint8_t	C10_MODE_ABSX = 7;
+// addressing maps each opcode to the address computation for its mode.
+#define ADDRESS_ENTRY(op, insn, mode, cycles)	&CPU::address<MODE_##mode>,
+const CPU::addresser CPU::addressing[256] = {
+	K6502_OPCODES(ADDRESS_ENTRY)
+};
+#undef ADDRESS_ENTRY
 
 
-// debug prints a debug string to stderr, if the global flag
-// DEBUG is defined.
+// The number of instructions run(true) shows when the run ends.
+static const size_t	RUN_TRACE_RECORDS = 64;
+
+
+// status_flags writes a binary representation of the status register,
+// for dumping registers, into status, which holds at least 9 bytes.
 static void
-debug(const char *s)
+status_flags(cpu_register8 p, char *status)
 {
-	if (DEBUG) {
-		std::cerr << "[DEBUG] " << s << "\n";
-	}
+	int	i;
+
+	for (i = 0; i < 8; ++i)
+		status[i] = (p & (0x80 >> i)) ? '1' : '0';
+	status[8] = 0;
 }
 
 
-// status_flags places a formatted binary representation of the status
-// register for use in dumping registers.
-static char *
-status_flags(cpu_register8 p)
+// CPU creates a new processor with the designated amount of memory
+// attached. Memory starts out clear and is only touched as the guest
+// uses it.
+CPU::CPU(size_t memory) : ram(memory)
 {
-	char *status = new char[9];
-	memset(status, 0x30, 8);
-	status[8] = 0;
-
-	if (p & FLAG_NEGATIVE)
-		status[0] = '1';
-	if (p & FLAG_OVERFLOW)
-		status[1] = '1';
-	if (p & FLAG_EXPANSION)
-		status[2] = '1';
-	if (p & FLAG_BREAK)
-		status[3] = '1';
-	if (p & FLAG_DECIMAL)
-		status[4] = '1';
-	if (p & FLAG_INT_DISABLE)
-		status[5] = '1';
-	if (p & FLAG_ZERO)
-		status[6] = '1';
-	if (p & FLAG_CARRY)
-		status[7] = '1';
-	return status;
+	this->init(ENGINE_TABLE);
 }
 
 
-// overflow returns true if the add/sub of the two 8-bit integers results
-// in a an overflow.
-static uint8_t
-overflow(uint8_t a, uint8_t b)
+// CPU creates a new processor with the designated amount of memory
+// attached, running on the given execution engine.
+CPU::CPU(size_t memory, cpu_engine eng) : ram(memory)
 {
-	return !((a ^ b) & 0x80);
+	this->init(eng);
 }
 
 
-// CPU creates a new processor with the designated amount of memory
-// attached.
-CPU::CPU(size_t memory)
+// CPU creates a new processor whose memory comes from the arena, for
+// cheap recycling; see Arena.
+CPU::CPU(size_t memory, cpu_engine eng, Arena *arena) : ram(memory, arena)
 {
-	debug("INIT MEMORY");
-	this->ram = RAM(memory);
-	this->reset_registers();
-	ram.reset();
+	this->init(eng);
 }
 
 
 // CPU creates a new processor with the default memory size (128k).
 CPU::CPU()
 {
-	debug("default ctor");
+	this->init(ENGINE_TABLE);
+}
+
+
+// CPU creates an empty processor to become a fork of parent.
+CPU::CPU(CPU *parent) : ram(parent->ram.size(), parent->ram.get_arena())
+{
+	this->init(parent->engine);
+}
+
+
+// init sets up the non-memory state shared by all the constructors.
+void
+CPU::init(cpu_engine eng)
+{
+	this->tracer = NULL;
+	this->profiler = NULL;
+	this->run_text = NULL;
+	this->run_ring = NULL;
+	this->steps = 0;
+	this->cycles = 0;
+	this->engine = eng;
+	this->halt_reason = EXIT_BRK;
+	this->breakpoints = NULL;
+	this->nbreakpoints = 0;
+	this->blocks = NULL;
+	this->jit = NULL;
+	if (eng == ENGINE_CACHED || eng == ENGINE_JIT) {
+		this->blocks = new BlockCache;
+		this->ram.set_watcher(this->blocks);
+	}
+	if (eng == ENGINE_JIT)
+		this->jit = new JIT;
 	this->reset_registers();
 }
 
 
+CPU::~CPU()
+{
+	delete this->run_ring;
+	delete this->run_text;
+	delete this->jit;
+	delete this->blocks;
+	delete[] this->breakpoints;
+}
+
+
 // reset_registers resets all registers to their power-on defaults. For
 // A, X, and Y, this is zero. For the status register, the expansion
 // (unused) bit is high. The stack points back to 0x1ff, and the program
@@ -125,34 +149,110 @@ CPU::CPU()
 void
 CPU::reset_registers()
 {
-	debug("RESET REGISTERS");
 	this->a = 0;
 	this->x = 0;
 	this->y = 0;
-	this->p = FLAG_EXPANSION;
+	this->set_status(FLAG_EXPANSION);
 	this->s = 0xff;
 	this->pc = 0;
 }
 
 
+// reset puts the CPU back in its power-on state: the registers and the
+// step and cycle counters are reset, and memory other than ROM is
+// cleared, which only touches pages written since the last reset.
+// Breakpoints, I/O pages, and the trace sink are kept. It allocates
+// nothing, so a CPU can be recycled instead of rebuilt.
+void
+CPU::reset()
+{
+	this->reset_registers();
+	this->steps = 0;
+	this->cycles = 0;
+	this->halt_reason = EXIT_BRK;
+	this->ram.reset();
+}
+
+
+/*
+ * fork copies the registers, the counters, the breakpoints, and memory
+ * into a new CPU, which the caller deletes. Memory is shared until
+ * either side writes to it, so a fork costs little more than the CPU
+ * object itself. The fork starts with an empty block cache and no
+ * trace sink or profiler; I/O pages go to the same handlers as in the
+ * parent.
+ */
+CPU *
+CPU::fork()
+{
+	CPU	*child = new CPU(this);
+
+	if (!child->reset(*this)) {
+		delete child;
+		return NULL;
+	}
+	return child;
+}
+
+
+// reset with a base CPU gives this one base's registers, counters,
+// breakpoints, and memory, shared copy-on-write as for fork. Nothing
+// is cleared or copied, so putting a CPU back to a saved starting point
+// costs about as much as forking it. The trace sink and profiler are
+// kept.
+bool
+CPU::reset(CPU &base)
+{
+	if (&base == this)
+		return true;
+	if (!base.ram.fork(this->ram))
+		return false;
+	this->a = base.a;
+	this->x = base.x;
+	this->y = base.y;
+	this->p = base.p;
+	this->s = base.s;
+	this->pc = base.pc;
+	this->flag_n = base.flag_n;
+	this->flag_z = base.flag_z;
+	this->flag_c = base.flag_c;
+	this->flag_v = base.flag_v;
+	this->steps = base.steps;
+	this->cycles = base.cycles;
+	this->halt_reason = base.halt_reason;
+	if (base.breakpoints != NULL && this->breakpoints == NULL)
+		this->breakpoints = new uint8_t[0x10000 / 8];
+	if (this->breakpoints != NULL) {
+		if (base.breakpoints != NULL)
+			memcpy(this->breakpoints, base.breakpoints,
+			    0x10000 / 8);
+		else
+			memset(this->breakpoints, 0, 0x10000 / 8);
+	}
+	this->nbreakpoints = base.nbreakpoints;
+	return true;
+}
+
+
 // dump registers prints out the registers to standard error.
 void
 CPU::dump_registers()
 {
 	size_t	 size = this->ram.size();
-	char	*status = status_flags(this->p);
+	uint8_t	 flags = this->status();
+	char	 status[9];
+
+	status_flags(flags, status);
 	std::cerr << "\nREGISTER DUMP\n";
 	std::cerr << "\tRAM: " << std::dec << size << " bytes\n";
 	std::cerr << "\t  A: " << std::hex << (unsigned int)(this->a) << "\n";
 	std::cerr << "\t  X: " << std::hex << (unsigned int)(this->x) << "\n";
 	std::cerr << "\t  Y: " << std::hex << (unsigned int)(this->y) << "\n";
-	std::cerr << "\t  P: " << std::hex << (unsigned int)(this->p) << "\n";
+	std::cerr << "\t  P: " << std::hex << (unsigned int)flags << "\n";
 	std::cerr << "\tFLA: " << "NV-BIDZC\n";
 	std::cerr << "\tFLA: " << status << "\n";
 	std::cerr << "\t  S: " << std::hex << (unsigned int)(this->s) << "\n";
 	std::cerr << "\t PC: " << std::hex << this->pc << "\n";
-
-	delete status;
 }
 
 
@@ -165,975 +265,415 @@ CPU::dump_memory()
 
 
 // run begins stepping the CPU, fetching and executing instructions from
-// memory. If trace is true, after each step, the memory and registers
-// will be dumped.
+// memory. If trace is true and no trace sink is attached, the last
+// instructions executed are kept in a TraceRing and shown, with the
+// registers, when the CPU halts. The ring is made by the first traced
+// run and kept for the next ones.
 void
 CPU::run(bool trace)
 {
-	while(this->step()) {
-		if (trace) {
-			this->dump_memory();
-			this->dump_registers();
+	if (trace && this->tracer == NULL) {
+		if (this->run_ring == NULL) {
+			this->run_text = new TextTrace(std::cerr);
+			this->run_ring = new TraceRing(RUN_TRACE_RECORDS,
+			    this->run_text);
 		}
+		this->tracer = this->run_ring;
+		while (this->step())
+			;
+		this->tracer = NULL;
+		this->run_ring->flush();
+		this->run_ring->wait();
+		this->dump_registers();
+		return;
 	}
-}
-
-// load is used to load a program into memory. This is effectively a memcpy
-// of the source into the CPU's attached memory.
-void
-CPU::load(const void *src, uint16_t offset, uint16_t len)
-{
-	this->ram.load(src, offset, len);
-}
-
-
-// store copies memory from the CPU's attached memory to the destination
-// buffer.
-void
-CPU::store(void *dest, uint16_t offset, uint16_t len)
-{
-	this->ram.store(dest, offset, len);
-}
-
-
-void
-CPU::step_pc()
-{
-	this->pc++;
-}
-
-
-void
-CPU::step_pc(uint8_t n)
-{
-	debug("STEP PC");
-	if (n & 0x80)
-		this->pc -= uint8_t(~n) + 1;
-	else
-		this->pc += n;
-}
-
-
-// set_entry sets the entry point for the CPU.
-void
-CPU::set_entry(uint16_t loc)
-{
-	this->pc = loc;
-}
-
-
-/*
- * Instructions. These generally take either no argument or the
- * actual op code as input (the opcode allows the emulator to
- * determine which addressing mode to use). For instructions with
- * only one addressing mode (i.e. INX), no parameter is required.
- */
-void
-CPU::ADC(uint8_t op)
-{
-	uint8_t	v = 0;
-	debug("OP: ADC");
-
-	switch ((op & bbb) >> 2) {
-	case C01_MODE_IMM:
-		debug("MODE: IMM");
-		v = this->read_immed();
-		break;
-	default:
-		v = this->ram.peek(this->read_addr1((op & bbb) >> 2));
-		break;
-	}
-
-#if DEBUG
-	std::cerr << "[DEBUG] ADC V: " << std::setw(2) << std::hex
-		  << std::setfill('0') << ((unsigned int)v&0xff) << "\n";
-#endif
-	if ((uint8_t)(this->a + v) < (this->a))
-		this->p |= FLAG_CARRY;
-	if (overflow(this->a, v))
-		this->p |= FLAG_OVERFLOW;
 
-	this->a += v;
-
-	if (this->a == 0)
-		this->p |= FLAG_ZERO;
-
-	if (this->a & 0x80)
-		this->p |= FLAG_NEGATIVE;
-
-	if (!(this->a & 0x80))
-		this->p &= ~FLAG_NEGATIVE;
-}
-
-
-void
-CPU::AND(uint8_t op)
-{
-	uint8_t	v;
-	debug("OP: AND");
-
-	switch ((op & bbb) >> 2) {
-	case C01_MODE_IMM:
-		v = this->read_immed();
-	default:
-		v = this->ram.peek(this->read_addr1((op & bbb) >> 2));
+	// The untraced loop never looks at the trace sink or the
+	// profiler, so a CPU without them pays nothing for either.
+	if (this->tracer == NULL && this->profiler == NULL) {
+		this->run_engine(SIZE_MAX);
+		return;
 	}
-	this->a &= v;
 
-	if (this->a == 0)
-		this->p |= FLAG_ZERO;
-	if (this->a & 0x80)
-		this->p |= FLAG_NEGATIVE;
+	while (this->step())
+		;
 }
 
 
-void
-CPU::CMP(uint8_t op)
-{
-	uint8_t	v = 0;
-	debug("OP: CMP");
-
-	switch ((op & bbb) >> 2) {
-	case C01_MODE_IMM:
-		v = this->read_immed();
-		break;
+// run_engine runs the CPU's execution engine until it halts (returning
+// false) or the step count reaches limit (returning true).
+bool
+CPU::run_engine(size_t limit)
+{
+	switch (this->engine) {
+	case ENGINE_THREADED:
+		return this->run_threaded(limit);
+	case ENGINE_CACHED:
+		return this->run_cached(limit);
+	case ENGINE_JIT:
+		return this->run_jit(limit);
 	default:
-		v = this->ram.peek(this->read_addr1((op & bbb) >> 2));
-	}
-	this->p &= ~(FLAG_CARRY|FLAG_ZERO|FLAG_NEGATIVE);
-	if (this->a < v) {
-		debug("LT");
-		if ((this->a - v) & 0x80)
-			this->p |= FLAG_NEGATIVE;
-	} else if (this->a == v) {
-		debug("EQ");
-		this->p |= (FLAG_CARRY|FLAG_ZERO);
-	} else if (this->a > v) {
-		debug("GT");
-		this->p |= FLAG_CARRY;
-		if ((this->a - v) & 0x80)
-			this->p |= FLAG_NEGATIVE;
+		return this->run_table(limit);
 	}
 }
 
 
-void
-CPU::CPX(uint8_t op)
+bool
+CPU::run_table(size_t limit)
 {
-	uint8_t		v;
-
-	debug("OP: CPX");
-	this->p &= ~(FLAG_CARRY|FLAG_ZERO|FLAG_NEGATIVE);
-
-	switch ((op & bbb) >> 2) {
-	case C10_MODE_IMM:
-		v = this->read_immed();
-		break;
-	default:
-		v = this->ram.peek(this->read_addr1((op & bbb) >> 2));
-	}
-
-	if (this->x < v) {
-		debug("LT");
-		if ((this->x - v) & 0x80)
-			this->p |= FLAG_NEGATIVE;
-	} else if (this->x == v) {
-		debug("EQ");
-		this->p |= (FLAG_CARRY|FLAG_ZERO);
-	} else if (this->x > v) {
-		debug("GT");
-		this->p |= FLAG_CARRY;
-		if ((this->x - v) & 0x80)
-			this->p |= FLAG_NEGATIVE;
+	while (this->steps != limit) {
+		if (!this->execute())
+			return false;
 	}
+	return true;
 }
 
 
-void
-CPU::CPY(uint8_t op)
+// run_checked is the instrumented loop used when a run has to look at
+// every instruction: for tracing, profiling, breakpoints, or a
+// predicate. A
+// breakpoint on the very first instruction is ignored, so that a run
+// stopped at a breakpoint can be resumed.
+exit_reason
+CPU::run_checked(size_t limit, run_predicate pred, void *arg)
 {
-	uint8_t		v;
-
-	debug("OP: CPY");
-	this->p &= ~(FLAG_CARRY|FLAG_ZERO|FLAG_NEGATIVE);
-
-	switch ((op & bbb) >> 2) {
-	case C10_MODE_IMM:
-		v = this->read_immed();
-		break;
-	default:
-		v = this->ram.peek(this->read_addr0((op & bbb) >> 2));
-	}
+	bool	first = true;
 
-	if (this->y < v) {
-		debug("LT");
-		if ((this->y - v) & 0x80)
-			this->p |= FLAG_NEGATIVE;
-	} else if (this->y == v) {
-		debug("EQ");
-		this->p |= (FLAG_CARRY|FLAG_ZERO);
-	} else if (this->y > v) {
-		debug("GT");
-		this->p |= FLAG_CARRY;
-		if ((this->y - v) & 0x80)
-			this->p |= FLAG_NEGATIVE;
+	while (this->steps != limit) {
+		if (!first && this->nbreakpoints > 0 &&
+		    (this->breakpoints[this->pc >> 3] & (1 << (this->pc & 7))))
+			return EXIT_BREAKPOINT;
+		if (pred != NULL && pred(*this, arg))
+			return EXIT_PREDICATE;
+		first = false;
+		if (!this->step())
+			return this->halt_reason;
 	}
+	return EXIT_BUDGET;
 }
 
 
-void
-CPU::DEX()
+// run_bounded runs at most budget instructions. The engine's own loop
+// is used unless something needs to see every instruction.
+RunResult
+CPU::run_bounded(size_t budget, run_predicate pred, void *arg)
 {
-	debug("OP: DEX");
-	this->x--;
-	if (this->x == 0)
-		this->p |= FLAG_ZERO;
-	else if (this->x == 0xFF)
-		this->p |= FLAG_CARRY;
-}
-
+	RunResult	res;
+	size_t		start = this->steps;
+	size_t		start_cycles = this->cycles;
+	size_t		limit = start + budget;
 
-void
-CPU::EOR(uint8_t op)
-{
-	debug("OP: EOR");
-	uint8_t	v;
+	if (limit < start)
+		limit = SIZE_MAX;
 
-	switch ((op & bbb) >> 2) {
-	case C10_MODE_IMM:
-		v = read_immed();
-		break;
-	default:
-		v = this->ram.peek(this->read_addr1((op & bbb) >> 2));
-	}
+	if (this->tracer != NULL || this->profiler != NULL ||
+	    this->nbreakpoints > 0 || pred != NULL)
+		res.reason = this->run_checked(limit, pred, arg);
+	else if (this->run_engine(limit))
+		res.reason = EXIT_BUDGET;
+	else
+		res.reason = this->halt_reason;
 
-	this->a ^= v;
-	if (this->a == 0)
-		this->p |= FLAG_ZERO;
-	if (this->a & 0x80)
-		this->p |= FLAG_NEGATIVE;
+	res.steps = this->steps - start;
+	res.cycles = this->cycles - start_cycles;
+	return res;
 }
 
 
-void
-CPU::INX()
+// run_for executes up to budget instructions and reports why it
+// stopped: a halt, a breakpoint, or the budget running out.
+RunResult
+CPU::run_for(size_t budget)
 {
-	debug("OP: INX");
-	this->x++;
-	if (this->x == 0)
-		this->p |= (FLAG_ZERO | FLAG_CARRY);
+	return this->run_bounded(budget, NULL, NULL);
 }
 
 
-void
-CPU::INY()
+// run_for_cycles executes instructions until at least budget cycles
+// have passed. It runs in instruction quanta that cannot overshoot (no
+// instruction takes more than seven cycles), so only the last
+// instruction can take it past the budget.
+RunResult
+CPU::run_for_cycles(size_t budget)
 {
-	debug("OP: INY");
-	this->y++;
-	if (this->y == 0)
-		this->p |= (FLAG_ZERO | FLAG_CARRY);
-}
+	RunResult	res, quantum;
+	size_t		start = this->cycles;
+	size_t		target = start + budget;
+	size_t		n;
 
-
-void
-CPU::LDA(uint8_t op)
-{
-	debug("OP: LDA");
-	switch ((op & bbb) >> 2) {
-	case C01_MODE_IMM:
-		debug("MODE: IMM");
-		this->a = this->read_immed();
-		break;
-	default:
-		this->a = this->ram.peek(this->read_addr1((op & bbb) >> 2));
+	res.reason = EXIT_BUDGET;
+	res.steps = 0;
+	while (this->cycles < target) {
+		n = (target - this->cycles) / 7;
+		quantum = this->run_bounded(n > 0 ? n : 1, NULL, NULL);
+		res.steps += quantum.steps;
+		if (quantum.reason != EXIT_BUDGET) {
+			res.reason = quantum.reason;
+			break;
+		}
 	}
-	if (this->a == 0)
-		this->p |= FLAG_ZERO;
-	if (this->a & 0x80)
-		this->p |= FLAG_NEGATIVE;
-	else
-		this->p &= ~FLAG_NEGATIVE;
-
+	res.cycles = this->cycles - start;
+	return res;
 }
 
 
-void
-CPU::LDX(uint8_t op)
+// run_until executes instructions until pred returns true, the CPU
+// halts, a breakpoint is hit, or budget instructions have run.
+RunResult
+CPU::run_until(run_predicate pred, void *arg, size_t budget)
 {
-	debug("OP: LDX");
-	switch ((op & bbb) >> 2) {
-	case C10_MODE_IMM:
-		debug("MODE: IMM");
-		this->x = this->read_immed();
-		break;
-	default:
-		debug("INVALID ADDRESSING MODE");
-	}
-	if (this->x == 0)
-		this->p |= FLAG_ZERO;
-	if (this->x & 0x80)
-		this->p |= FLAG_NEGATIVE;
-	else
-		this->p &= ~FLAG_NEGATIVE;
+	return this->run_bounded(budget, pred, arg);
 }
 
 
 void
-CPU::LDY(uint8_t op)
+CPU::set_breakpoint(uint16_t addr)
 {
-	debug("OP: LDY");
-	switch ((op & bbb) >> 2) {
-	case C10_MODE_IMM:
-		debug("MODE: IMM");
-		this->y = this->read_immed();
-		break;
-	default:
-		debug("INVALID ADDRESSING MODE");
-	}
-	if (this->y == 0)
-		this->p |= FLAG_ZERO;
-	if (this->y & 0x80)
-		this->p |= FLAG_NEGATIVE;
-	else
-		this->p &= ~FLAG_NEGATIVE;
-}
-
+	uint8_t	bit = 1 << (addr & 7);
 
-void
-CPU::ORA(uint8_t op)
-{
-	uint8_t	v;
-	debug("OP: ORA");
-
-	switch ((op & bbb) >> 2) {
-	case C01_MODE_IMM:
-		v = this->read_immed();
-	default:
-		v = this->ram.peek(this->read_addr1((op & bbb) >> 2));
+	if (this->breakpoints == NULL) {
+		this->breakpoints = new uint8_t[0x10000 / 8];
+		memset(this->breakpoints, 0, 0x10000 / 8);
 	}
-	this->a |= v;
-
-	if (this->a == 0)
-		this->p |= FLAG_ZERO;
-	if (this->a & 0x80)
-		this->p |= FLAG_NEGATIVE;
-}
-
-
-void
-CPU::STA(uint8_t op)
-{
-	debug("OP: STA");
-	switch ((op & bbb) >> 2) {
-	case C01_MODE_IMM:
-		debug("MODE: IMM");
-		this->ram.poke((uint16_t)this->read_immed() & 0xff, this->a);
-		break;
-	default:
-		this->ram.poke(this->read_addr1((op & bbb) >> 2), this->a);
-		return;
+	if (!(this->breakpoints[addr >> 3] & bit)) {
+		this->breakpoints[addr >> 3] |= bit;
+		this->nbreakpoints++;
 	}
 }
 
 
 void
-CPU::STX(uint8_t op)
+CPU::clear_breakpoint(uint16_t addr)
 {
-	debug("OP: STX");
-	switch ((op & bbb) >> 2) {
-	default:
-		this->ram.poke(this->read_addr2((op & bbb) >> 2), this->x);
-	}
-}
-
+	uint8_t	bit = 1 << (addr & 7);
 
-void
-CPU::STY(uint8_t op)
-{
-	debug("OP: STY");
-	switch ((op & bbb) >> 2) {
-	default:
-		this->ram.poke(this->read_addr0((op & bbb) >> 2), this->y);
+	if (this->breakpoints != NULL && (this->breakpoints[addr >> 3] & bit)) {
+		this->breakpoints[addr >> 3] &= ~bit;
+		this->nbreakpoints--;
 	}
 }
 
 
+// set_trace attaches a trace sink to the CPU; every instruction executed
+// afterwards is recorded to it. Passing NULL detaches the current sink.
 void
-CPU::TAX()
-{
-	debug("OP: TAX");
-	this->x = this->a;
-	if (this->a & 0x80)
-		this->p |= FLAG_NEGATIVE;
-	if (this->a == 0)
-		this->p |= FLAG_ZERO;
-}
-
-
-void
-CPU::TXA()
-{
-	debug("OP: TXA");
-	this->a = this->x;
-	if (this->x & 0x80)
-		this->p |= FLAG_NEGATIVE;
-	if (this->x == 0)
-		this->p |= FLAG_ZERO;
-}
-
-
-/*
- * CPU flag set/clear methods.
- */
-
-void
-CPU::BRK()
-{
-	debug("BRK");
-	this->p |= FLAG_BREAK;
-}
-
-
-void
-CPU::CLC()
+CPU::set_trace(TraceSink *sink)
 {
-	debug("CLC");
-	this->p &= ~FLAG_CARRY;
+	this->tracer = sink;
 }
 
 
+// set_profiler attaches a profiler to the CPU; every instruction
+// executed afterwards is counted by it. Passing NULL detaches it.
 void
-CPU::SEC()
+CPU::set_profiler(Profiler *prof)
 {
-	debug("SEC");
-	this->p |= FLAG_CARRY;
+	this->profiler = prof;
 }
 
 
+// record_trace hands the state of the CPU before the next instruction
+// to the attached trace sink. Working out the effective address of an
+// indirect mode reads its pointer, which is assumed not to be on an I/O
+// page.
 void
-CPU::CLD()
+CPU::record_trace()
 {
-	debug("CLD");
-	this->p &= ~FLAG_DECIMAL;
-}
+	TraceRecord	rec;
+	uint32_t	insn = this->ram.fetch(this->pc);
 
-
-void
-CPU::SED()
-{
-	debug("SED");
-	this->p |= FLAG_DECIMAL;
+	rec.pc = this->pc;
+	rec.op = insn & 0xff;
+	rec.arg[0] = (insn >> 8) & 0xff;
+	rec.arg[1] = insn >> 16;
+	rec.a = this->a;
+	rec.x = this->x;
+	rec.y = this->y;
+	rec.p = this->status();
+	rec.s = this->s;
+	rec.ea = (this->*addressing[rec.op])((uint16_t)(insn >> 8));
+	rec.step = this->steps;
+	rec.cycle = this->cycles;
+	this->tracer->record(rec);
 }
 
-
+// load is used to load a program into memory. This is effectively a memcpy
+// of the source into the CPU's attached memory.
 void
-CPU::CLI()
+CPU::load(const void *src, uint16_t offset, uint16_t len)
 {
-	debug("CLI");
-	this->p &= ~FLAG_INT_DISABLE;
+	this->ram.load(src, offset, len);
 }
 
 
+// store copies memory from the CPU's attached memory to the destination
+// buffer.
 void
-CPU::SEI()
+CPU::store(void *dest, uint16_t offset, uint16_t len)
 {
-	debug("SEI");
-	this->p |= FLAG_INT_DISABLE;
+	this->ram.store(dest, offset, len);
 }
 
 
+// set_entry sets the entry point for the CPU.
 void
-CPU::CLV()
+CPU::set_entry(uint16_t loc)
 {
-	debug("CLV");
-	this->p &= ~FLAG_OVERFLOW;
+	this->pc = loc;
 }
 
 
 /*
- * branching instructions
+ * Instruction processing (reading, parsing, and handling opcodes).
  */
 
 
-void
-CPU::BPL(uint8_t n)
-{
-	debug("OP: BPL");
-	if (this->p & FLAG_NEGATIVE)
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BMI(uint8_t n)
-{
-	debug("OP: BMI");
-	if (!(this->p & FLAG_NEGATIVE))
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BVC(uint8_t n)
-{
-	debug("OP: BVC");
-	if (this->p & FLAG_OVERFLOW)
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BVS(uint8_t n)
-{
-	debug("OP: BVS");
-	if (!(this->p & FLAG_OVERFLOW))
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BCC(uint8_t n)
-{
-	debug("OP: BCC");
-	if (this->p & FLAG_CARRY)
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BCS(uint8_t n)
-{
-	debug("OP: BCS");
-	if (!(this->p & FLAG_CARRY))
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BNE(uint8_t n)
-{
-	debug("OP: BNE");
-	if (this->p & FLAG_ZERO)
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::BEQ(uint8_t n)
-{
-	debug("OP: BEQ");
-	if (!(this->p & FLAG_ZERO))
-		return;
-	debug("BRANCH");
-	this->step_pc(n);
-}
-
-
-void
-CPU::JMP()
+size_t
+CPU::get_steps()
 {
-	debug("OP: JMP");
-	uint16_t	addr = this->read_addr1(C01_MODE_ABS);
-#if DEBUG
-	std::cerr << "[DEBUG] JMP ADDR: " << std::setw(4)
-		  << std::hex << std::setfill('0')
-		  << addr << std::endl;
-#endif
-	this->pc = addr;
+	return this->steps;
 }
 
 
-static uint16_t
-stack_addr(uint8_t sp)
+// get_cycles returns the number of clock cycles the instructions
+// executed so far would have taken on an NMOS 6502.
+size_t
+CPU::get_cycles()
 {
-	return (1 << 8) + sp;
+	return this->cycles;
 }
 
 
-void
-CPU::JSR()
+// get_registers returns a copy of the CPU's registers.
+Registers
+CPU::get_registers()
 {
-	debug("OP: JSR");
-	uint16_t	jaddr = this->read_addr1(C01_MODE_ABS);
-	uint16_t	addr = this->pc-1;
+	Registers	regs;
 
-	this->ram.poke(stack_addr(this->s--), (uint8_t)(addr >> 8));
-	this->ram.poke(stack_addr(this->s--), (uint8_t)(addr << 8 >> 8));
-	this->pc = jaddr;
+	regs.a = this->a;
+	regs.x = this->x;
+	regs.y = this->y;
+	regs.p = this->status();
+	regs.s = this->s;
+	regs.pc = this->pc;
+	return regs;
 }
 
 
-void
-CPU::RTS()
+// step executes a single instruction, recording it to the trace sink
+// and the profiler if they are attached. It returns false if the CPU
+// halted; the trace sink is told if it halted on an illegal opcode.
+bool
+CPU::step()
 {
-	debug("OP: RTS");
-	uint16_t	addr;
-	addr = this->ram.peek(stack_addr(++this->s));
-	addr += (this->ram.peek(stack_addr(++this->s)) << 8);
-	this->pc = addr+1;
-}
-
-
-/*
- * Stack instructions.
- */
+	bool	running;
 
+	if (this->tracer == NULL) {
+		if (this->profiler != NULL)
+			return this->profile_step();
+		return this->execute();
+	}
 
-void
-CPU::PHA()
-{
-	debug("OP: PHA");
-	this->ram.poke((0x01 << 8) + this->s, this->a);
-	this->s--;
+	this->record_trace();
+	if (this->profiler != NULL)
+		running = this->profile_step();
+	else
+		running = this->execute();
+	if (!running && this->halt_reason == EXIT_ILLEGAL)
+		this->tracer->fault();
+	return running;
 }
 
 
-void
-CPU::PLA()
+// profile_step executes a single instruction and hands it to the
+// profiler with the cycles it took.
+bool
+CPU::profile_step()
 {
-	debug("OP: PLA");
-	this->s++;
-	this->a = this->ram.peek((0x01 << 8) + this->s);
-}
-
+	uint16_t	addr = this->pc;
+	uint8_t		op = this->ram.fetch(addr) & 0xff;
+	size_t		start = this->cycles;
+	bool		running;
 
-/*
- * Instruction processing (reading, parsing, and handling opcodes).
- */
-
-
-size_t
-CPU::get_steps()
-{
-	return this->steps;
+	running = this->execute();
+	this->profiler->record(addr, op, this->cycles - start, this->pc);
+	return running;
 }
 
 
+// execute fetches the opcode and its operand bytes, moves the PC past
+// the instruction, and jumps straight to the opcode's handler.
 bool
-CPU::step()
+CPU::execute()
 {
+	uint32_t	insn;
 	uint8_t		op;
+	uint16_t	arg;
 
-	debug("STEP");
-	op = this->ram.peek(this->pc);
-	this->step_pc();
+	insn = this->ram.fetch(this->pc);
+	op = insn & 0xff;
+	arg = insn >> 8;
+	this->pc += length[op];
 	this->steps++;
+	this->cycles += opcode_cycles[op];
 
-	// Scan single-byte opcodes first
-	switch (op) {
-	case 0x00: // BRK
-		this->BRK();
-		return false;
-	case 0x10: // BPL
-		this->BPL(this->read_immed());
-		return true;
-	case 0x18: // CLC
-		this->CLC();
-		return true;
-	case 0x20: // JSR
-		this->JSR();
-		return true;
-	case 0x30: // BMI
-		this->BMI(this->read_immed());
-		return true;
-	case 0x48: // PHA
-		this->PHA();
-		return true;
-	case 0x4C: // JMP
-		this->JMP();
-		return true;
-	case 0x50: // BVC
-		this->BVC(this->read_immed());
-		return true;
-	case 0x60: // RTS
-		this->RTS();
-		return true;
-	case 0x68: // PLA
-		this->PLA();
-		return true;
-	case 0x70: // BVS
-		this->BVS(this->read_immed());
-		return true;
-	case 0x8a: // TXA
-		this->TXA();
-		return true;
-	case 0x90: // BCC
-		this->BCC(this->read_immed());
-		return true;
-	case 0xB0: // BCC
-		this->BCS(this->read_immed());
-		return true;
-	case 0xC8: // INY
-		this->INY();
-		return true;
-	case 0xCA: // DEX
-		this->DEX();
-		return true;
-	case 0xD0: // BNE
-		this->BNE(this->read_immed());
-		return true;
-	case 0xE8: // INX
-		this->INX();
-		return true;
-	}
-
-	switch (op & cc) {
-	case 0x00:
-		this->instrc00(op);
-		return true;
-	case 0x01:
-		this->instrc01(op);
-		return true;
-	case 0x02:
-		this->instrc10(op);
-		return true;
-	default:
-#if DEBUG
-		std::cerr << "[DEBUG] ILLEGAL INSTRUCTION (cc): "
-			  << std::setw(2) << std::hex << std::setfill('0')
-			  << (unsigned int)(op&0xff) << std::endl;
-		this->dump_registers();
-#endif
-		break;
-	}
-	return false;
+	return (this->*dispatch[op])(arg);
 }
 
 
-void
-CPU::instrc01(uint8_t op)
+// map_rom maps a ROM image file read-only into memory at addr. The
+// part of it that lines up with host pages is mapped rather than
+// copied, so many CPUs can share one ROM. It returns false, with errno
+// set, if the file cannot be read.
+bool
+CPU::map_rom(const char *path, uint16_t addr)
 {
-	switch (op >> 5) {
-	case 0x0: // ORA
-		this->ORA(op);
-		break;
-	case 0x1: // AND
-		this->AND(op);
-		break;
-	case 0x3: // ADC
-		this->ADC(op);
-		return;
-	case 0x4: // STA
-		this->STA(op);
-		return;
-	case 0x5: // LDA
-		this->LDA(op);
-		return;
-	case 0x6: // CMP
-		this->CMP(op);
-		return;
-	default:
-#if DEBUG
-		std::cerr << "[DEBUG] ILLEGAL INSTRUCTION (01): "
-			  << std::setw(2) << std::hex << std::setfill('0')
-			  << (unsigned int)(op&0xff) << std::endl;
-		std::cerr << "[DEBUG] OP = " << (unsigned int)op << "\n";
-#endif
-		break;
-	}
+	return this->ram.map_rom(path, addr);
 }
 
 
-void
-CPU::instrc10(uint8_t op)
-{
-	switch (op >> 5) {
-	case 0x04:
-		this->STX(op);
-		break;
-	case 0x05:	// LDX / TAX
-		if (((op & bbb) >> 2) == C10_MODE_ACC)
-			this->TAX();
-		else
-			this->LDX(op);
-		break;
-	case 0x06:
-		break;
-	default:
-#if DEBUG
-		std::cerr << "[DEBUG] ILLEGAL INSTRUCTION (INVALID 10): "
-			  << std::setw(2) << std::hex << std::setfill('0')
-			  << (unsigned int)(op>>5)
-			  << " " << (unsigned int)op << std::endl;
-#endif
-		break;
-	}
-}
-
-
-void
-CPU::instrc00(uint8_t op)
+// map_rom maps a shared ROM image into memory at addr, which must
+// start a page. The image's pages are not copied, so a ROM mapped into
+// many CPUs takes memory only once.
+bool
+CPU::map_rom(RomImage &rom, uint16_t addr)
 {
-	switch (op >> 5) {
-	case 0x04:
-		this->STY(op);
-		break;
-	case 0x05:
-		this->LDY(op);
-		break;
-	case 0x06:
-		this->CPY(op);
-		break;
-	case 0x07:
-		this->CPX(op);
-		break;
-	default:
-		this->dump_registers();
-#if DEBUG
-		std::cerr << "[DEBUG] ILLEGAL INSTRUCTION (INVALID 00): "
-			  << std::setw(2) << std::hex
-			  << std::setfill('0')
-			  << (unsigned int)(op>>5)
-			  << " " << (unsigned int)op << std::endl;
-#endif
-	}
+	return this->ram.map_rom(rom, addr);
 }
 
 
-uint8_t
-CPU::read_immed()
+// map_image maps a memory image file into memory at addr like map_rom,
+// but the guest can write to it. The file itself is never changed.
+bool
+CPU::map_image(const char *path, uint16_t addr)
 {
-	uint8_t	v;
-#if DEBUG
-	std::cerr << "[DEBUG] PEEK $" << std::hex << std::setfill('0')
-		  << std::setw(4) << this->pc;
-#endif
-	v = this->ram.peek(this->pc);
-	this->step_pc();
-#if DEBUG
-	std::cerr << ": " << std::setw(2) << ((unsigned int)v & 0xff) << "\n";
-#endif
-	return v;
+	return this->ram.map_image(path, addr);
 }
 
 
-uint16_t
-CPU::read_addr1(uint8_t mode)
+// map_ram backs the CPU's memory with a file, so that guest memory
+// persists in it. Map ROMs and images afterwards.
+bool
+CPU::map_ram(const char *path)
 {
-	uint16_t	addr;
-
-	switch (mode) {
-	case C01_MODE_IIZPX:
-		addr = this->read_immed();
-		addr += this->x;
-		addr = this->ram.peek(addr) + (this->ram.peek(addr+1)<<8);
-		break;
-	case C01_MODE_ZP:
-		addr = this->read_immed();
-		break;
-	case C01_MODE_ABS:
-		addr = this->read_immed();
-		addr += ((uint16_t)this->read_immed() << 8);
-		break;
-	case C01_MODE_IIZPY:
-		addr = this->read_immed();
-		addr = this->ram.peek(addr) + (this->ram.peek(addr+1)<<8);
-		addr += this->y;
-		break;
-	case C01_MODE_ZPX:
-		addr = (uint8_t)(this->read_immed() + this->x);
-		break;
-	case C01_MODE_ABSY:
-		addr = this->read_immed();
-		addr += ((uint16_t)this->read_immed() << 8);
-		addr += this->y;
-		break;
-	case C01_MODE_ABSX:
-		addr = this->read_immed();
-		addr += ((uint16_t)this->read_immed() << 8);
-		addr += this->x;
-		break;
-	default:
-		debug("INVALID ADDRESSING MODE");
-#if DEBUG
-		std::cerr << "[DEBUG] MODE: " << std::setw(1)<< std::hex
-			  << mode << std::endl;
-#endif
-		addr = 0;
-	}
-
-#if DEBUG
-	std::cerr << "[DEBUG] ADDR: $" << std::setw(4) << std::setfill('0')
-		  << std::hex << addr << std::endl;
-#endif
-	return addr;
+	return this->ram.map_ram(path);
 }
 
 
-uint16_t
-CPU::read_addr2(uint8_t mode)
+// map_io routes guest data accesses to the page through the handlers,
+// for memory-mapped devices.
+void
+CPU::map_io(uint8_t page, io_read r, io_write w, void *ctx)
 {
-	uint16_t	addr;
-
-	switch (mode) {
-	case C10_MODE_ZP:
-		addr = this->read_immed();
-		break;
-	case C10_MODE_ABS:
-		addr = this->read_immed();
-		addr += ((uint16_t)this->read_immed() << 8);
-		break;
-	case C10_MODE_ZPX:
-		addr = (uint8_t)(this->read_immed() + this->x);
-		break;
-	case C10_MODE_ZPY:
-		addr = (uint8_t)(this->read_immed() + this->y);
-		break;
-	case C10_MODE_ABSX:
-		addr = this->read_immed();
-		addr += ((uint16_t)this->read_immed() << 8);
-		addr += this->x;
-		break;
-	default:
-		debug("INVALID ADDRESSING MODE");
-		addr = 0;
-	}
-
-#if DEBUG
-	std::cerr << "[DEBUG] ADDR: $" << std::setw(4) << std::setfill('0')
-		  << std::hex << addr << std::endl;
-#endif
-	return addr;
+	this->ram.map_io(page, r, w, ctx);
 }
 
 
-uint16_t
-CPU::read_addr0(uint8_t mode)
+// unmap_io gives an I/O page back to memory.
+void
+CPU::unmap_io(uint8_t page)
 {
-	uint16_t	addr;
-
-	switch (mode) {
-	case C10_MODE_ZP:
-		addr = this->read_immed();
-		break;
-	case C10_MODE_ABS:
-		addr = this->read_immed();
-		addr += ((uint16_t)this->read_immed() << 8);
-		break;
-	default:
-		debug("INVALID ADDRESSING MODE");
-		addr = 0;
-	}
-
-#if DEBUG
-	std::cerr << "[DEBUG] ADDR: $" << std::setw(4) << std::setfill('0')
-		  << std::hex << addr << std::endl;
-#endif
-	return addr;
+	this->ram.unmap_io(page);
 }
 
 
@@ -19,12 +19,14 @@
 #define __6502_CPU_H
 
 
-#define DEBUG	1
-
-
 #include <cstdlib>
+#include <istream>
+#include <ostream>
 
+#include "jit.h"
+#include "profile.h"
 #include "ram.h"
+#include "trace.h"
 
 
 const uint8_t	FLAG_CARRY = 1 << 0;
@@ -41,98 +43,379 @@ typedef uint8_t		cpu_register8;
 typedef uint16_t	cpu_register16;
 
 
+// Addressing modes. Every opcode is bound to exactly one of these in
+// opcodes.h; the instruction handlers are instantiated per mode.
+enum addr_mode {
+	MODE_IMP = 0,	// implied
+	MODE_ACC,	// accumulator
+	MODE_IMM,	// #$nn
+	MODE_ZP,	// $nn
+	MODE_ZPX,	// $nn,X
+	MODE_ZPY,	// $nn,Y
+	MODE_ABS,	// $nnnn
+	MODE_ABSX,	// $nnnn,X
+	MODE_ABSY,	// $nnnn,Y
+	MODE_IND,	// ($nnnn)
+	MODE_IIZPX,	// ($nn,X)
+	MODE_IIZPY,	// ($nn),Y
+	MODE_REL	// branch offset
+};
+
+
+// mode_length returns the length in bytes of an instruction using the
+// addressing mode, including the opcode.
+constexpr uint8_t
+mode_length(addr_mode mode)
+{
+	return (mode == MODE_IMP || mode == MODE_ACC) ? 1 :
+	    (mode == MODE_ABS || mode == MODE_ABSX || mode == MODE_ABSY ||
+	     mode == MODE_IND) ? 3 : 2;
+}
+
+
+// Execution engines, chosen when the CPU is created. ENGINE_TABLE runs
+// every instruction through the dispatch table from one loop.
+// ENGINE_THREADED gives each opcode its own copy of the dispatch code
+// (GCC/Clang labels-as-values), which predicts far better on long
+// loops; other compilers fall back to the table loop. ENGINE_CACHED
+// keeps a cache of predecoded basic blocks so hot code is never
+// decoded twice; writes to cached code invalidate it. ENGINE_JIT
+// builds on the block cache and compiles hot blocks to native x86-64
+// code, running everything else (and non-x86-64 hosts) as ENGINE_CACHED.
+enum cpu_engine {
+	ENGINE_TABLE = 0,
+	ENGINE_THREADED,
+	ENGINE_CACHED,
+	ENGINE_JIT
+};
+
+
+// Reasons for run_for and run_until to return.
+enum exit_reason {
+	EXIT_BRK = 0,		// a BRK instruction halted the CPU
+	EXIT_ILLEGAL,		// an undocumented opcode halted the CPU
+	EXIT_BUDGET,		// the instruction budget ran out
+	EXIT_BREAKPOINT,	// the PC reached a breakpoint
+	EXIT_PREDICATE		// the run_until predicate returned true
+};
+
+
+// RunResult says why a bounded run stopped and how much it did.
+struct RunResult {
+	exit_reason	reason;
+	size_t		steps;
+	size_t		cycles;
+};
+
+
+// Snapshots hold either all of memory or only the pages written since
+// the previous snapshot; see snapshot.cc for the format.
+enum snapshot_kind {
+	SNAPSHOT_FULL = 0,
+	SNAPSHOT_DELTA
+};
+
+const uint16_t	SNAPSHOT_VERSION = 1;
+
+
+class CPU;
+
+// A run_predicate is called before every instruction by run_until with
+// the CPU and the caller's argument; returning true stops the run.
+typedef bool	(*run_predicate)(CPU &, void *);
+
+
+// Registers holds a copy of the programmer-visible registers.
+struct Registers {
+	cpu_register8	a;
+	cpu_register8	x;
+	cpu_register8	y;
+	cpu_register8	p;
+	cpu_register8	s;
+	cpu_register16	pc;
+};
+
+
+class BlockCache;
+class JIT;
+class Lockstep;
+struct CodeBlock;
+struct DecodedInsn;
+
+
 class CPU {
 	private:
+		// A Lockstep drives its lanes' CPUs directly.
+		friend class Lockstep;
+
+		// A handler executes one opcode. It receives the (up to
+		// two) operand bytes following the opcode as a
+		// little-endian word, with the PC already pointing at
+		// the next instruction. It returns false if the CPU
+		// should halt.
+		typedef bool (CPU::*handler)(uint16_t);
+		static const handler	dispatch[256];
+		static const uint8_t	length[256];
+
+		// An addresser works out an opcode's effective address,
+		// for the trace, before the instruction runs.
+		typedef uint16_t (CPU::*addresser)(uint16_t);
+		static const addresser	addressing[256];
+
+		// A thunk runs a handler from compiled code; it takes the
+		// operand word and the address of the next instruction.
+		typedef bool (*thunk)(CPU *, uint16_t, uint16_t);
+		static const thunk	thunks[256];
+		template <bool (CPU::*F)(uint16_t)>
+		static bool	jit_call(CPU *, uint16_t, uint16_t);
+
 		cpu_register8	a;
 		cpu_register8	x;
 		cpu_register8	y;
 		cpu_register8	p;
 		cpu_register8	s;
 		cpu_register16	pc;
+
+		// N, Z, C, and V are kept apart from p as the values they
+		// come from and only folded into it by status: N is bit 7
+		// of flag_n, Z is set when flag_z is zero, C is flag_c (0
+		// or 1), and V is bit 7 of flag_v. The ALU instructions
+		// just store their result instead of masking bits in and
+		// out of p, and most of those stores are overwritten
+		// before anything looks at them.
+		uint8_t		flag_n;
+		uint8_t		flag_z;
+		uint8_t		flag_c;
+		uint8_t		flag_v;
 		RAM		ram;
 		size_t		steps;
+		size_t		cycles;
+		TraceSink	*tracer;
+		Profiler	*profiler;
+
+		// The ring run(true) keeps the last instructions in, set
+		// up by the first traced run.
+		TextTrace	*run_text;
+		TraceRing	*run_ring;
+		cpu_engine	engine;
+		exit_reason	halt_reason;
+		uint8_t		*breakpoints;
+		size_t		nbreakpoints;
+		BlockCache	*blocks;
+		JIT		*jit;
 
 		// CPU control
+		CPU(CPU *);
+		void		init(cpu_engine);
 		void		reset_registers(void);
-		void		instrc01(uint8_t);
-		void		instrc10(uint8_t);
-		void		instrc00(uint8_t);
-		uint8_t		read_immed();
-		uint16_t	read_addr0(uint8_t); // cc = 00
-		uint16_t	read_addr1(uint8_t); // cc = 01
-		uint16_t	read_addr2(uint8_t); // cc = 10
-
-		// PC instructions
-		void step_pc(void);
-		void step_pc(uint8_t);
-
-		// status register
-		void BRK(void);
-		void CLC(void);
-		void CLD(void);
-		void CLI(void);
-		void CLV(void);
-		void SEC(void);
-		void SED(void);
-		void SEI(void);
-
-		// Instructions
-		void ADC(uint8_t);
-		void AND(uint8_t);
-		void CMP(uint8_t);
-		void CPX(uint8_t);
-		void CPY(uint8_t);
-		void DEX(void);
-		void EOR(uint8_t);
-		void INX(void);
-		void INY(void);
-		void LDA(uint8_t);
-		void LDX(uint8_t);
-		void LDY(uint8_t);
-		void ORA(uint8_t);
-		void STA(uint8_t);
-		void STX(uint8_t);
-		void STY(uint8_t);
-		void TAX(void);
-		void TXA(void);
+		bool		execute(void);
+		bool		run_engine(size_t);
+		bool		run_table(size_t);
+		bool		run_threaded(size_t);
+		bool		run_cached(size_t);
+		void		decode_block(CodeBlock *, uint16_t);
+		bool		run_block(CodeBlock *, size_t, bool *);
+		void		skip_idle(CodeBlock *, size_t);
+
+		// A fused handler runs a pair of decoded instructions
+		// as one; see blockcache.cc.
+		typedef bool (CPU::*fused_handler)(const DecodedInsn *);
+		static fused_handler	fusion(uint8_t, uint8_t);
+		template <bool (CPU::*F)(uint16_t), bool (CPU::*G)(uint16_t)>
+		bool		fuse(const DecodedInsn *);
+		bool		run_jit(size_t);
+		exit_reason	run_checked(size_t, run_predicate, void *);
+		RunResult	run_bounded(size_t, run_predicate, void *);
+		NativeBlock	jit_compile(CodeBlock *);
+		void		record_trace(void);
+		bool		profile_step(void);
+		bool		snapshot_page(uint8_t, snapshot_kind);
+
+		// Operand access
+		template <addr_mode M> uint16_t address(uint16_t);
+		template <addr_mode M> uint16_t read_address(uint16_t);
+		template <addr_mode M> uint8_t operand(uint16_t);
+		uint16_t	zp_pointer(uint8_t);
+		uint8_t		status(void);
+		void		set_status(uint8_t);
+		void		set_flags(uint8_t);
+		void		set_nz(uint8_t);
+		void		add(uint8_t);
+		void		add_decimal(const uint16_t *, uint8_t);
+		void		compare(uint8_t, uint8_t);
+		void		branch(uint16_t);
+		void		push(uint8_t);
+		uint8_t		pull(void);
+
+		// Load / store
+		template <addr_mode M> bool LDA(uint16_t);
+		template <addr_mode M> bool LDX(uint16_t);
+		template <addr_mode M> bool LDY(uint16_t);
+		template <addr_mode M> bool STA(uint16_t);
+		template <addr_mode M> bool STX(uint16_t);
+		template <addr_mode M> bool STY(uint16_t);
+
+		// Register transfers
+		template <addr_mode M> bool TAX(uint16_t);
+		template <addr_mode M> bool TAY(uint16_t);
+		template <addr_mode M> bool TSX(uint16_t);
+		template <addr_mode M> bool TXA(uint16_t);
+		template <addr_mode M> bool TXS(uint16_t);
+		template <addr_mode M> bool TYA(uint16_t);
+
+		// Arithmetic and logic
+		template <addr_mode M> bool ADC(uint16_t);
+		template <addr_mode M> bool AND(uint16_t);
+		template <addr_mode M> bool ASL(uint16_t);
+		template <addr_mode M> bool BIT(uint16_t);
+		template <addr_mode M> bool CMP(uint16_t);
+		template <addr_mode M> bool CPX(uint16_t);
+		template <addr_mode M> bool CPY(uint16_t);
+		template <addr_mode M> bool DEC(uint16_t);
+		template <addr_mode M> bool DEX(uint16_t);
+		template <addr_mode M> bool DEY(uint16_t);
+		template <addr_mode M> bool EOR(uint16_t);
+		template <addr_mode M> bool INC(uint16_t);
+		template <addr_mode M> bool INX(uint16_t);
+		template <addr_mode M> bool INY(uint16_t);
+		template <addr_mode M> bool LSR(uint16_t);
+		template <addr_mode M> bool ORA(uint16_t);
+		template <addr_mode M> bool ROL(uint16_t);
+		template <addr_mode M> bool ROR(uint16_t);
+		template <addr_mode M> bool SBC(uint16_t);
+
+		// Status register
+		template <addr_mode M> bool CLC(uint16_t);
+		template <addr_mode M> bool CLD(uint16_t);
+		template <addr_mode M> bool CLI(uint16_t);
+		template <addr_mode M> bool CLV(uint16_t);
+		template <addr_mode M> bool SEC(uint16_t);
+		template <addr_mode M> bool SED(uint16_t);
+		template <addr_mode M> bool SEI(uint16_t);
 
 		// Branching / jumping
-		void BPL(uint8_t);
-		void BMI(uint8_t);
-		void BVC(uint8_t);
-		void BVS(uint8_t);
-		void BCC(uint8_t);
-		void BCS(uint8_t);
-		void BNE(uint8_t);
-		void BEQ(uint8_t);
-		void JMP(void);
-		void JSR(void);
-		void RTS(void);
+		template <addr_mode M> bool BCC(uint16_t);
+		template <addr_mode M> bool BCS(uint16_t);
+		template <addr_mode M> bool BEQ(uint16_t);
+		template <addr_mode M> bool BMI(uint16_t);
+		template <addr_mode M> bool BNE(uint16_t);
+		template <addr_mode M> bool BPL(uint16_t);
+		template <addr_mode M> bool BVC(uint16_t);
+		template <addr_mode M> bool BVS(uint16_t);
+		template <addr_mode M> bool JMP(uint16_t);
+		template <addr_mode M> bool JSR(uint16_t);
+		template <addr_mode M> bool RTI(uint16_t);
+		template <addr_mode M> bool RTS(uint16_t);
 
 		// Stack
-		void PHA(void);
-		void PLA(void);
+		template <addr_mode M> bool PHA(uint16_t);
+		template <addr_mode M> bool PHP(uint16_t);
+		template <addr_mode M> bool PLA(uint16_t);
+		template <addr_mode M> bool PLP(uint16_t);
+
+		// Control
+		template <addr_mode M> bool BRK(uint16_t);
+		template <addr_mode M> bool NOP(uint16_t);
+		template <addr_mode M> bool ILL(uint16_t);
 	public:
 		CPU();
 		CPU(size_t);
+		CPU(size_t, cpu_engine);
+		CPU(size_t, cpu_engine, Arena *);
+		~CPU();
 
 		void dump_registers(void);
 		void dump_memory(void);
+		void reset(void);
 		void run(bool);
 		bool step(void);
+
+		// Bounded execution: run at most the given number of
+		// instructions, or until the predicate returns true.
+		// run_for_cycles runs until at least the given number of
+		// cycles have passed; the last instruction may overshoot.
+		RunResult run_for(size_t);
+		RunResult run_for_cycles(size_t);
+		RunResult run_until(run_predicate, void *, size_t);
+
+		// Breakpoints stop run_for and run_until before the
+		// instruction at the address is executed.
+		void set_breakpoint(uint16_t);
+		void clear_breakpoint(uint16_t);
 		void set_entry(uint16_t);
+		void set_trace(TraceSink *);
+		void set_profiler(Profiler *);
 
 		// Memory access; use this to load a memory image or
 		// write a memory image out.
 		void load(const void *, uint16_t, uint16_t);
 		void store(void *, uint16_t, uint16_t);
 
+		// Save states: save writes the registers, the counters,
+		// and memory (all of it or just what changed since the
+		// last save); restore reads them back.
+		bool save(std::ostream &, snapshot_kind);
+		bool restore(std::istream &);
+
+		// fork returns a new CPU in the same state, sharing memory
+		// with this one copy-on-write; see RAM::fork. It returns
+		// NULL, with errno set, if the memory cannot be shared.
+		// reset with a CPU puts this one in that one's state the
+		// same way, returning false if it cannot.
+		CPU *fork(void);
+		bool reset(CPU &);
+
+		// File-backed memory; see RAM::map_rom and friends.
+		bool map_rom(const char *, uint16_t);
+		bool map_rom(RomImage &, uint16_t);
+		bool map_image(const char *, uint16_t);
+		bool map_ram(const char *);
+
+		// Memory-mapped I/O; see RAM::map_io.
+		void map_io(uint8_t, io_read, io_write, void *);
+		void unmap_io(uint8_t);
+
 		uint8_t DMA(uint16_t);
 		void DMA(uint16_t, uint8_t);
 
 		size_t get_steps(void);
+		size_t get_cycles(void);
+		Registers get_registers(void);
 
 };
 
 
+// status assembles the status register from p and the flag fields.
+inline uint8_t
+CPU::status()
+{
+	return (this->p & ~(FLAG_NEGATIVE|FLAG_OVERFLOW|FLAG_ZERO|FLAG_CARRY)) |
+	    (this->flag_n & FLAG_NEGATIVE) |
+	    ((this->flag_v >> 1) & FLAG_OVERFLOW) |
+	    (this->flag_z == 0 ? FLAG_ZERO : 0) |
+	    (this->flag_c & FLAG_CARRY);
+}
+
+
+// set_status loads the status register, splitting it into p and the
+// flag fields.
+inline void
+CPU::set_status(uint8_t v)
+{
+	this->p = v;
+	this->set_flags(v);
+}
+
+
+// set_flags loads N, Z, C, and V from their bits in v.
+inline void
+CPU::set_flags(uint8_t v)
+{
+	this->flag_n = v;
+	this->flag_v = (uint8_t)(v << 1);
+	this->flag_z = (v & FLAG_ZERO) ^ FLAG_ZERO;
+	this->flag_c = v & FLAG_CARRY;
+}
+
+
 #endif
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdio>
+#include "cpu.h"
+#include "disasm.h"
+#include "opcodes.h"
+
+
+// operand_text formats the operand of an instruction in addressing mode
+// M. Like the instruction handlers, it is instantiated once per mode
+// from the opcode table, so the switch is resolved at compile time.
+template <addr_mode M>
+static int
+operand_text(char *buf, size_t len, uint16_t arg, uint16_t next)
+{
+	switch (M) {
+	case MODE_ACC:
+		return snprintf(buf, len, " A");
+	case MODE_IMM:
+		return snprintf(buf, len, " #$%02X", arg & 0xff);
+	case MODE_ZP:
+		return snprintf(buf, len, " $%02X", arg & 0xff);
+	case MODE_ZPX:
+		return snprintf(buf, len, " $%02X,X", arg & 0xff);
+	case MODE_ZPY:
+		return snprintf(buf, len, " $%02X,Y", arg & 0xff);
+	case MODE_ABS:
+		return snprintf(buf, len, " $%04X", arg);
+	case MODE_ABSX:
+		return snprintf(buf, len, " $%04X,X", arg);
+	case MODE_ABSY:
+		return snprintf(buf, len, " $%04X,Y", arg);
+	case MODE_IND:
+		return snprintf(buf, len, " ($%04X)", arg);
+	case MODE_IIZPX:
+		return snprintf(buf, len, " ($%02X,X)", arg & 0xff);
+	case MODE_IIZPY:
+		return snprintf(buf, len, " ($%02X),Y", arg & 0xff);
+	case MODE_REL:
+		return snprintf(buf, len, " $%04X",
+		    (uint16_t)(next + (int8_t)(arg & 0xff)));
+	default:
+		return 0;
+	}
+}
+
+
+typedef int	(*operand_formatter)(char *, size_t, uint16_t, uint16_t);
+
+// DisasmEntry holds the mnemonic and operand formatter for an opcode.
+struct DisasmEntry {
+	char			mnemonic[4];
+	uint8_t			length;
+	operand_formatter	operand;
+};
+
+#define DISASM_ENTRY(op, insn, mode, cycles)	\
+	{#insn, mode_length(MODE_##mode), operand_text<MODE_##mode>},
+static const DisasmEntry	disasm_table[256] = {
+	K6502_OPCODES(DISASM_ENTRY)
+};
+#undef DISASM_ENTRY
+
+
+size_t
+disassemble(uint16_t pc, const uint8_t *insn, char *buf, size_t len)
+{
+	const DisasmEntry	&ent = disasm_table[insn[0]];
+	uint16_t		 arg = 0;
+	int			 n;
+
+	if (ent.length > 1)
+		arg = insn[1];
+	if (ent.length > 2)
+		arg |= insn[2] << 8;
+
+	n = snprintf(buf, len, "%s", ent.mnemonic);
+	if (n > 0 && (size_t)n < len)
+		ent.operand(buf + n, len - n, arg, (uint16_t)(pc + ent.length));
+	return ent.length;
+}
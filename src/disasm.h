@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __6502_DISASM_H
+#define __6502_DISASM_H
+
+
+#include <cstdint>
+#include <cstdlib>
+
+
+// Longest line disassemble produces, including the terminating NUL.
+const size_t	DISASM_MAX = 16;
+
+
+// disassemble writes the instruction at pc, whose bytes (the opcode and
+// up to two operand bytes) are in insn, to buf in assembler syntax, as
+// in "LDA ($10),Y" or "BNE $0302". Branch targets are resolved against
+// pc. It returns the length of the instruction in bytes.
+size_t	disassemble(uint16_t pc, const uint8_t *insn, char *buf, size_t len);
+
+
+#endif
@@ -25,13 +25,61 @@
  * uses a starting PC of $0600.
  */
 
-#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
 using namespace std;
 
+#include "batch.h"
 #include "cpu.h"
+#include "disasm.h"
+#include "lockstep.h"
+#include "opcodes.h"
+#include "programs.h"
+
+
+// The execution engines every program is checked against.
+static const cpu_engine	engines[] = {
+        ENGINE_TABLE,
+        ENGINE_THREADED,
+        ENGINE_CACHED,
+        ENGINE_JIT
+};
+static const size_t	nengines = sizeof(engines) / sizeof(engines[0]);
+
+static int		failures = 0;
+
+
+// Every heap allocation in the program goes through these, so tests can
+// check that the core does not allocate.
+static size_t		allocations = 0;
+
+void *
+operator new(size_t n)
+{
+        void    *p = malloc(n > 0 ? n : 1);
+
+        if (p == NULL)
+                throw std::bad_alloc();
+        allocations++;
+        return p;
+}
+
+
+void
+operator delete(void *p) noexcept
+{
+        free(p);
+}
 
 
 void	test1(void);
@@ -45,6 +93,26 @@ void	test8(void);
 void	test9(void);
 void	test10(void);
 void	test11(void);
+void	test12(void);
+void	test13(void);
+void	test14(void);
+void	test15(void);
+void	test16(void);
+void	test17(void);
+void	test18(void);
+void	test19(void);
+void	test20(void);
+void	test21(void);
+void	test22(void);
+void	test23(void);
+void	test24(void);
+void	test25(void);
+void	test26(void);
+void	test27(void);
+void	test28(void);
+void	test29(void);
+void	test30(void);
+void	test31(void);
 
 
 static void
@@ -70,12 +138,79 @@ dump_program(const unsigned char *program, size_t len)
 }
 
 
+// read_memory copies the first span bytes of the CPU's memory into buf.
+static void
+read_memory(CPU &cpu, unsigned char *buf, size_t span)
+{
+        size_t  i;
+
+        for (i = 0; i < span; ++i)
+                buf[i] = cpu.DMA((uint16_t)i);
+}
+
+
+// check_engines runs the program on every execution engine and checks
+// that each one leaves the registers, step and cycle counts, and memory
+// exactly as the table engine does. If slice is non-zero, the other
+// engines run in slices of that many instructions with run_for. It
+// returns false on any difference.
+static bool
+check_engines(const unsigned char *program, size_t size, size_t memory,
+              uint16_t entry, size_t slice)
+{
+        size_t          span = memory < 0x10000 ? memory : 0x10000;
+        unsigned char   *want = new unsigned char[span];
+        unsigned char   *got = new unsigned char[span];
+        Registers       want_regs, got_regs;
+        size_t          want_steps = 0, want_cycles = 0;
+        size_t          i;
+        bool            ok = true;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(memory, engines[i]);
+
+                cpu.load(program, entry, size);
+                cpu.set_entry(entry);
+                if (i == 0 || slice == 0) {
+                        cpu.run(false);
+                } else {
+                        while (cpu.run_for(slice).reason == EXIT_BUDGET)
+                                ;
+                }
+
+                if (i == 0) {
+                        want_regs = cpu.get_registers();
+                        want_steps = cpu.get_steps();
+                        want_cycles = cpu.get_cycles();
+                        read_memory(cpu, want, span);
+                        continue;
+                }
+
+                got_regs = cpu.get_registers();
+                read_memory(cpu, got, span);
+                if (got_regs.a != want_regs.a || got_regs.x != want_regs.x ||
+                    got_regs.y != want_regs.y || got_regs.p != want_regs.p ||
+                    got_regs.s != want_regs.s || got_regs.pc != want_regs.pc ||
+                    cpu.get_steps() != want_steps ||
+                    cpu.get_cycles() != want_cycles ||
+                    memcmp(want, got, span) != 0) {
+                        std::cerr << "ENGINE " << std::dec << engines[i]
+                                  << " DIFFERS FROM TABLE ENGINE\n";
+                        failures++;
+                        ok = false;
+                }
+        }
+
+        delete[] want;
+        delete[] got;
+        return ok;
+}
+
+
 static void
 run(const unsigned char *program, size_t size, bool trace)
 {
         CPU	cpu(0x400);
-        struct timeval tv_start;
-        struct timeval tv_stop;
 
         std::cerr << "\nPROGRAM:\n";
         dump_program(program, size);
@@ -84,19 +219,12 @@ run(const unsigned char *program, size_t size, bool trace)
         cpu.load(program, 0x300, size);
         cpu.set_entry(0x300);
 
-        if (gettimeofday(&tv_start, NULL) != 0)
-                std::cerr << "failed to get time of day\n";
         cpu.run(trace);
-        if (gettimeofday(&tv_stop, NULL) != 0)
-                std::cerr << "failed to get time of day\n";
 
         cpu.dump_memory();
         cpu.dump_registers();
 
-        size_t usec = (tv_stop.tv_sec * 1000000) -
-                      (tv_start.tv_sec * 1000000);
-        usec += (tv_stop.tv_usec - tv_start.tv_usec);
-        std::cerr << "Run time: " << std::dec << usec << "usec\n";
+        check_engines(program, size, 0x400, 0x300, 0);
 
 }
 
@@ -107,9 +235,7 @@ test1()
         std::cerr << "\nStarting test 1\n";
         std::cerr << "\t(First compiled program)\n";
 
-        // test1, compiled as opcodes
-        unsigned char	program[] = {0xA9, 0x01, 0x8D, 0x01, 0x00};
-        run(program, 5, false);
+        run(easy_first, sizeof(easy_first), false);
 }
 
 
@@ -119,11 +245,7 @@ test2()
         std::cerr << "\nStarting test 2\n";
         std::cerr << "\t(First full compiled easy6502 program)\n";
 
-        unsigned char	program[] = {
-                0xa9, 0x01, 0x8d, 0x00, 0x02, 0xa9, 0x05, 0x8d,
-                0x01, 0x02, 0xa9, 0x08, 0x8d, 0x02, 0x02, 0x00
-        };
-        run(program, 15, false);
+        run(easy_store, sizeof(easy_store), false);
 }
 
 
@@ -133,11 +255,7 @@ test3()
         std::cerr << "\nStarting test 3\n";
         std::cerr << "\t(Second full compiled easy6502 program)\n";
 
-        unsigned char	program[] = {
-                0xa9, 0xc0, 0xaa, 0xe8, 0x69, 0xc4, 0x00
-        };
-
-        run(program, 7, false);
+        run(easy_add, sizeof(easy_add), false);
 }
 
 
@@ -147,11 +265,7 @@ test4()
         std::cerr << "\nStarting test 4\n";
         std::cerr << "\t(Third full compiled easy6502 program)\n";
 
-        unsigned char	program[] = {
-                0xa9, 0x80, 0x85, 0x01, 0x65, 0x01
-        };
-
-        run(program, 6, false);
+        run(easy_carry, sizeof(easy_carry), false);
 }
 
 
@@ -161,11 +275,7 @@ test5()
         std::cerr << "\nStarting test 5\n";
         std::cerr << "\t(First branching easy6502 program)\n";
 
-        unsigned char	program[] = {
-                0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 0x03,
-                0xd0, 0xf8, 0x8e, 0x01, 0x02, 0x00
-        };
-        run(program, 14, false);
+        run(easy_branch, sizeof(easy_branch), false);
 }
 
 
@@ -175,12 +285,7 @@ test6()
         std::cerr << "\nStarting test 6\n";
         std::cerr << "\t(Indexed indirect addressing)\n";
 
-        unsigned char	program[] = {
-                0xa2, 0x01, 0xa9, 0x05, 0x85, 0x01, 0xa9, 0x03,
-                0x85, 0x02, 0xa0, 0x0a, 0x8c, 0x05, 0x03, 0xa1,
-                0x00
-        };
-        run(program, 17, false);
+        run(easy_indexed_indirect, sizeof(easy_indexed_indirect), false);
 }
 
 
@@ -190,12 +295,7 @@ test7()
         std::cerr << "\nStarting test 7\n";
         std::cerr << "\t(Indirect indexed addressing)\n";
 
-        unsigned char	program[] = {
-                0xa0, 0x01, 0xa9, 0x03, 0x85, 0x01, 0xa9, 0x01,
-                0x85, 0x02, 0xa2, 0x0a, 0x8e, 0x04, 0x01, 0xb1,
-                0x01, 0x00
-        };
-        run(program, 18, false);
+        run(easy_indirect_indexed, sizeof(easy_indirect_indexed), false);
 }
 
 
@@ -205,13 +305,7 @@ test8()
         std::cerr << "\nStarting test 8\n";
         std::cerr << "\t(Stack manipulation 1)\n";
 
-        unsigned char	program[] = {
-                0xa2, 0x00, 0xa0, 0x00, 0x8a, 0x99, 0x00, 0x02,
-                0x48, 0xe8, 0xc8, 0xc0, 0x10, 0xd0, 0xf5, 0x68,
-                0x99, 0x00, 0x02, 0xc8, 0xc0, 0x20, 0xd0, 0xf7,
-                0x00
-        };
-        run(program, 25, false);
+        run(easy_stack, sizeof(easy_stack), false);
 }
 
 
@@ -221,11 +315,7 @@ test9()
         std::cerr << "\nStarting test 9\n";
         std::cerr << "\t(jump)\n";
 
-        unsigned char	program[] = {
-                0xa9, 0x03, 0x4c, 0x08, 0x03, 0x00, 0x00, 0x00,
-                0x8d, 0x00, 0x02, 0x00
-        };
-        run(program, 12, false);
+        run(easy_jump, sizeof(easy_jump), false);
 }
 
 
@@ -235,12 +325,7 @@ test10()
         std::cerr << "\nStarting test 10\n";
         std::cerr << "\t(JSR/RTS)\n";
 
-        unsigned char	program[] = {
-                0x20, 0x09, 0x03, 0x20, 0x0c, 0x03, 0x20, 0x12,
-                0x03, 0xa2, 0x00, 0x60, 0xe8, 0xe0, 0x05, 0xd0,
-                0xfb, 0x60, 0x00, 0x00
-        };
-        run(program, 20, false);
+        run(easy_jsr, sizeof(easy_jsr), false);
 }
 
 
@@ -307,18 +392,1944 @@ test11()
 }
 
 
-int
-main(void)
+void
+test12()
 {
-        test1();
-        test2();
-        test3();
-        test4();
-        test5();
-        test6();
-        test7();
-        test8();
-        test9();
-        test10();
-        //test11();
+        std::cerr << "\nStarting test 12\n";
+        std::cerr << "\t(Self-modifying code)\n";
+
+        // The loop patches the operand of its own LDA #imm each
+        // time around, so A should end up as 3.
+        unsigned char	program[] = {
+                0xa2, 0x03, 0xa9, 0x00, 0x18, 0x69, 0x01, 0x8d,
+                0x03, 0x03, 0xca, 0xd0, 0xf5, 0x00
+        };
+        run(program, 14, false);
+}
+
+
+// Opcode metadata for the random program generator.
+struct opinfo {
+        const char      *insn;
+        addr_mode        mode;
+};
+
+#define OPINFO(op, insn, mode, cycles)  { #insn, MODE_##mode },
+static const opinfo     opcodes[256] = {
+        K6502_OPCODES(OPINFO)
+};
+#undef OPINFO
+
+
+static uint32_t rng_state;
+
+
+static uint32_t
+rng(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 17;
+        rng_state ^= rng_state << 5;
+        return rng_state;
+}
+
+
+// usable returns true if the opcode can appear in a random program:
+// control transfers other than forward branches are out, and so are
+// stores through pointers, which could land anywhere. writes is set
+// for instructions that store to memory.
+static bool
+usable(uint8_t op, bool *writes)
+{
+        const opinfo    &info = opcodes[op];
+        static const char       *banned[] = {
+                "ILL", "BRK", "JMP", "JSR", "RTS", "RTI", NULL
+        };
+        static const char       *writers[] = {
+                "STA", "STX", "STY", "INC", "DEC", "ASL", "LSR", "ROL",
+                "ROR", NULL
+        };
+        int     i;
+
+        for (i = 0; banned[i] != NULL; ++i) {
+                if (strcmp(info.insn, banned[i]) == 0)
+                        return false;
+        }
+
+        *writes = false;
+        for (i = 0; writers[i] != NULL; ++i) {
+                if (strcmp(info.insn, writers[i]) == 0)
+                        *writes = info.mode != MODE_ACC;
+        }
+
+        return !(*writes && (info.mode == MODE_IIZPX ||
+                             info.mode == MODE_IIZPY));
+}
+
+
+// random_program writes a random program for $0400 into buf and returns
+// its length. The body is straight-line code with forward branches only;
+// stores go to the zero page, the stack, or $0200-$03FF. The body runs
+// in a loop counted down in $C000, so blocks get hot enough to be
+// compiled.
+static size_t
+random_program(unsigned char *buf, size_t ninsns, uint8_t iterations)
+{
+        size_t          starts[64];
+        size_t          len = 0, body, i, j, after, ncand;
+        size_t          cand[64];
+        uint8_t         op;
+        uint16_t        addr;
+        bool            writes;
+
+        buf[len++] = 0xa9;                      // LDA #iterations
+        buf[len++] = iterations;
+        buf[len++] = 0x8d;                      // STA $C000
+        buf[len++] = 0x00;
+        buf[len++] = 0xc0;
+        body = len;
+
+        for (i = 0; i < ninsns; ++i) {
+                do {
+                        op = (uint8_t)rng();
+                } while (!usable(op, &writes));
+
+                starts[i] = len;
+                buf[len++] = op;
+                switch (opcodes[op].mode) {
+                case MODE_IMP:
+                case MODE_ACC:
+                        break;
+                case MODE_ABS:
+                case MODE_ABSX:
+                case MODE_ABSY:
+                        if (writes)
+                                addr = 0x0200 + (rng() & 0xff);
+                        else
+                                addr = rng() % 0xc000;
+                        buf[len++] = addr & 0xff;
+                        buf[len++] = addr >> 8;
+                        break;
+                default:
+                        buf[len++] = (uint8_t)rng();
+                        break;
+                }
+        }
+        starts[ninsns] = len;
+
+        // Point each branch at a later instruction (or the loop tail).
+        for (i = 0; i < ninsns; ++i) {
+                if (opcodes[buf[starts[i]]].mode != MODE_REL)
+                        continue;
+                after = starts[i] + 2;
+                ncand = 0;
+                for (j = i + 1; j <= ninsns; ++j) {
+                        if (starts[j] - after <= 127)
+                                cand[ncand++] = j;
+                }
+                j = cand[rng() % ncand];
+                buf[starts[i] + 1] = (uint8_t)(starts[j] - after);
+        }
+
+        buf[len++] = 0xce;                      // DEC $C000
+        buf[len++] = 0x00;
+        buf[len++] = 0xc0;
+        buf[len++] = 0xf0;                      // BEQ +3
+        buf[len++] = 0x03;
+        buf[len++] = 0x4c;                      // JMP body
+        buf[len++] = (0x400 + body) & 0xff;
+        buf[len++] = (0x400 + body) >> 8;
+        buf[len++] = 0x00;                      // BRK
+        return len;
+}
+
+
+void
+test13()
+{
+        unsigned char   program[256];
+        size_t          size;
+        uint32_t        seed;
+        int             i, bad = 0;
+
+        std::cerr << "\nStarting test 13\n";
+        std::cerr << "\t(Randomized differential test of all engines)\n";
+
+        for (i = 0; i < 200; ++i) {
+                seed = 0x6502 + i;
+                rng_state = seed;
+                size = random_program(program, 40, 40);
+                if (!check_engines(program, size, 0x10000, 0x400, 0) ||
+                    !check_engines(program, size, 0x10000, 0x400,
+                                   1 + i % 23)) {
+                        std::cerr << "\tSEED " << std::hex << seed
+                                  << " FAILED\n";
+                        dump_program(program, size);
+                        bad++;
+                }
+        }
+        std::cerr << "\t" << std::dec << i << " programs, " << bad
+                  << " failed\n";
+}
+
+
+// check_exit runs the program with run_for on every engine and checks
+// the exit reason and the number of instructions executed.
+static void
+check_exit(const char *what, const unsigned char *program, size_t size,
+           size_t budget, exit_reason reason, size_t steps)
+{
+        RunResult       res;
+        size_t          i;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x400, engines[i]);
+
+                cpu.load(program, 0x300, size);
+                cpu.set_entry(0x300);
+                res = cpu.run_for(budget);
+                if (res.reason != reason || res.steps != steps) {
+                        std::cerr << "\t" << what << ": ENGINE " << std::dec
+                                  << engines[i] << " EXITED WITH "
+                                  << res.reason << " AFTER " << res.steps
+                                  << " STEPS\n";
+                        failures++;
+                }
+        }
+}
+
+
+// stop_at_x5 is a run_until predicate that fires once X reaches 5.
+static bool
+stop_at_x5(CPU &cpu, void *)
+{
+        return cpu.get_registers().x == 5;
+}
+
+
+void
+test14()
+{
+        std::cerr << "\nStarting test 14\n";
+        std::cerr << "\t(Bounded execution)\n";
+
+        unsigned char   spin[] = {0x4c, 0x00, 0x03};    // JMP $0300
+        unsigned char   brk[] = {0xe8, 0xe8, 0x00};     // INX; INX; BRK
+        unsigned char   ill[] = {0xe8, 0x02};           // INX; (illegal)
+        unsigned char   count[] = {                     // INX; JMP $0300
+                0xe8, 0x4c, 0x00, 0x03
+        };
+        RunResult       res;
+
+        check_exit("spin", spin, sizeof(spin), 1000, EXIT_BUDGET, 1000);
+        check_exit("brk", brk, sizeof(brk), 1000, EXIT_BRK, 3);
+        check_exit("illegal", ill, sizeof(ill), 1000, EXIT_ILLEGAL, 2);
+        check_exit("zero budget", spin, sizeof(spin), 0, EXIT_BUDGET, 0);
+
+        CPU     cpu(0x400);
+        cpu.load(count, 0x300, sizeof(count));
+        cpu.set_entry(0x300);
+        cpu.set_breakpoint(0x301);
+        res = cpu.run_for(1000);
+        if (res.reason != EXIT_BREAKPOINT || res.steps != 1) {
+                std::cerr << "\tBREAKPOINT NOT HIT\n";
+                failures++;
+        }
+        res = cpu.run_for(1000);
+        if (res.reason != EXIT_BREAKPOINT || res.steps != 2) {
+                std::cerr << "\tBREAKPOINT NOT RESUMED\n";
+                failures++;
+        }
+        cpu.clear_breakpoint(0x301);
+        res = cpu.run_until(stop_at_x5, NULL, 1000);
+        if (res.reason != EXIT_PREDICATE || cpu.get_registers().x != 5) {
+                std::cerr << "\tPREDICATE NOT HONOURED\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// check_cycles runs the program on every engine and checks the number
+// of cycles it took.
+static void
+check_cycles(const char *what, const unsigned char *program, size_t size,
+             size_t memory, uint16_t entry, size_t cycles)
+{
+        size_t          i;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(memory, engines[i]);
+
+                cpu.load(program, entry, size);
+                cpu.set_entry(entry);
+                cpu.run(false);
+                if (cpu.get_cycles() != cycles) {
+                        std::cerr << "\t" << what << ": ENGINE " << std::dec
+                                  << engines[i] << " TOOK "
+                                  << cpu.get_cycles() << " CYCLES\n";
+                        failures++;
+                }
+        }
+}
+
+
+void
+test15()
+{
+        std::cerr << "\nStarting test 15\n";
+        std::cerr << "\t(Cycle counting)\n";
+
+        unsigned char   loop[] = {                      // LDX #0; DEX; BNE -3
+                0xa2, 0x00, 0xca, 0xd0, 0xfd, 0x00
+        };
+        unsigned char   cross[] = {
+                0xa2, 0xff,             // LDX #$ff
+                0xbd, 0x01, 0x02,       // LDA $0201,X
+                0x9d, 0x01, 0x02,       // STA $0201,X
+                0xa0, 0x01,             // LDY #$01
+                0xa9, 0xff,             // LDA #$ff
+                0x85, 0x10,             // STA $10
+                0xa9, 0x02,             // LDA #$02
+                0x85, 0x11,             // STA $11
+                0xb1, 0x10,             // LDA ($10),Y
+                0x00
+        };
+        unsigned char   far[] = {                       // at $03fc
+                0xa2, 0x00,             // LDX #$00
+                0xca,                   // DEX
+                0xd0, 0xfd,             // BNE $03fe, from the next page
+                0x00
+        };
+        RunResult       res;
+
+        check_cycles("loop", loop, sizeof(loop), 0x400, 0x300,
+                     2 + 256 * 2 + 255 * 3 + 2 + 7);
+        check_cycles("page cross", cross, sizeof(cross), 0x400, 0x300,
+                     2 + 5 + 5 + 2 + 2 + 3 + 2 + 3 + 6 + 7);
+        check_cycles("far branch", far, sizeof(far), 0x10000, 0x3fc,
+                     2 + 256 * 2 + 255 * 4 + 2 + 7);
+
+        CPU     cpu(0x400);
+        cpu.load(loop, 0x300, sizeof(loop));
+        cpu.set_entry(0x300);
+        res = cpu.run_for_cycles(100);
+        if (res.reason != EXIT_BUDGET || res.cycles < 100 || res.cycles > 106 ||
+            res.cycles != cpu.get_cycles()) {
+                std::cerr << "\tCYCLE BUDGET NOT HONOURED\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// A Latch is a test device: reads count up, writes are latched.
+struct Latch {
+        size_t  reads;
+        uint8_t value;
+};
+
+
+static uint8_t
+latch_read(void *ctx, uint16_t)
+{
+        return (uint8_t)++((Latch *)ctx)->reads;
+}
+
+
+static void
+latch_write(void *ctx, uint16_t, uint8_t val)
+{
+        ((Latch *)ctx)->value = val;
+}
+
+
+void
+test16()
+{
+        std::cerr << "\nStarting test 16\n";
+        std::cerr << "\t(Memory-mapped I/O)\n";
+
+        unsigned char   program[] = {
+                0xa2, 0x64,             // LDX #$64
+                0xad, 0x01, 0xc0,       // LDA $C001
+                0xca,                   // DEX
+                0xd0, 0xfa,             // BNE -6
+                0xa9, 0x2a,             // LDA #$2a
+                0x8d, 0x00, 0xc0,       // STA $C000
+                0xad, 0x00, 0x80,       // LDA $8000, past the 1K
+                0x00
+        };
+        size_t          i;
+
+        for (i = 0; i < nengines; ++i) {
+                Latch   latch = {0, 0};
+                CPU     cpu(0x400, engines[i]);
+
+                cpu.map_io(0xc0, latch_read, latch_write, &latch);
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run(false);
+                if (latch.reads != 100 || latch.value != 0x2a ||
+                    cpu.get_registers().a != 0) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " SAW " << latch.reads << " READS\n";
+                        failures++;
+                }
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// temp_file writes len bytes to a new temporary file and returns its
+// name in path, which must hold at least 32 bytes.
+static bool
+temp_file(char *path, const unsigned char *buf, size_t len)
+{
+        int     fd;
+        bool    ok;
+
+        strcpy(path, "/tmp/k6502-test-XXXXXX");
+        fd = mkstemp(path);
+        if (fd == -1)
+                return false;
+        ok = write(fd, buf, len) == (ssize_t)len;
+        close(fd);
+        return ok;
+}
+
+
+void
+test17()
+{
+        std::cerr << "\nStarting test 17\n";
+        std::cerr << "\t(File-backed memory)\n";
+
+        // A 4K+256 byte ROM for $E000: the first 4K is mapped, the rest
+        // is read in.
+        static unsigned char    rom[0x1100];
+        unsigned char           program[] = {
+                0xa9, 0x2a,             // LDA #$2a
+                0x8d, 0x00, 0xe1,       // STA $E100
+                0xad, 0x00, 0xe1,       // LDA $E100
+                0x85, 0x10,             // STA $10
+                0xad, 0x50, 0xf0,       // LDA $F050
+                0x85, 0x11,             // STA $11
+                0x8d, 0x00, 0x02,       // STA $0200
+                0x00
+        };
+        char            rom_path[32], ram_path[32];
+        unsigned char   byte = 0;
+        size_t          i;
+        int             fd;
+
+        memcpy(rom, program, sizeof(program));
+        rom[0x100] = 0x55;
+        rom[0x1050] = 0x66;
+        if (!temp_file(rom_path, rom, sizeof(rom))) {
+                std::cerr << "\tCANNOT WRITE ROM FILE\n";
+                failures++;
+                return;
+        }
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x10000, engines[i]);
+
+                if (!cpu.map_rom(rom_path, 0xe000)) {
+                        std::cerr << "\tmap_rom FAILED\n";
+                        failures++;
+                        break;
+                }
+                cpu.set_entry(0xe000);
+                cpu.run(false);
+                if (cpu.DMA(0x10) != 0x55 || cpu.DMA(0x11) != 0x66 ||
+                    cpu.DMA(0xe100) != 0x55) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " WROTE TO ROM\n";
+                        failures++;
+                }
+        }
+
+        CPU     image(0x10000);
+        image.map_image(rom_path, 0xe000);
+        image.set_entry(0xe000);
+        image.run(false);
+        fd = open(rom_path, O_RDONLY);
+        if (fd != -1) {
+                if (pread(fd, &byte, 1, 0x100) != 1)
+                        byte = 0;
+                close(fd);
+        }
+        if (image.DMA(0x10) != 0x2a || byte != 0x55) {
+                std::cerr << "\tIMAGE NOT COPY-ON-WRITE\n";
+                failures++;
+        }
+
+        strcpy(ram_path, "/tmp/k6502-test-XXXXXX");
+        fd = mkstemp(ram_path);
+        if (fd != -1) {
+                close(fd);
+                CPU     cpu(0x10000);
+
+                if (!cpu.map_ram(ram_path) ||
+                    !cpu.map_rom(rom_path, 0xe000)) {
+                        std::cerr << "\tmap_ram FAILED\n";
+                        failures++;
+                } else {
+                        cpu.set_entry(0xe000);
+                        cpu.run(false);
+                }
+                fd = open(ram_path, O_RDONLY);
+                byte = 0;
+                if (fd != -1) {
+                        if (pread(fd, &byte, 1, 0x200) != 1)
+                                byte = 0;
+                        close(fd);
+                }
+                if (byte != 0x66) {
+                        std::cerr << "\tRAM FILE NOT WRITTEN\n";
+                        failures++;
+                }
+                unlink(ram_path);
+        }
+        unlink(rom_path);
+        std::cerr << "\tdone\n";
+}
+
+
+// same_registers returns true if both register sets match.
+static bool
+same_registers(const Registers &r1, const Registers &r2)
+{
+        return r1.a == r2.a && r1.x == r2.x && r1.y == r2.y &&
+            r1.p == r2.p && r1.s == r2.s && r1.pc == r2.pc;
+}
+
+
+void
+test18()
+{
+        std::cerr << "\nStarting test 18\n";
+        std::cerr << "\t(Snapshots)\n";
+
+        unsigned char   program[] = {
+                0xa2, 0x00,             // LDX #$00
+                0x8a,                   // TXA
+                0x9d, 0x00, 0x04,       // STA $0400,X
+                0xe8,                   // INX
+                0xd0, 0xf9,             // BNE -7
+                0x8a,                   // TXA
+                0x49, 0xff,             // EOR #$ff
+                0x9d, 0x00, 0x05,       // STA $0500,X
+                0xe8,                   // INX
+                0xd0, 0xf7,             // BNE -9
+                0x00
+        };
+        unsigned char   saved[0x800], now[0x800];
+        size_t          i, steps, cycles;
+        Registers       regs;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU                     cpu(0x10000, engines[i]);
+                std::stringstream       full, delta;
+
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run_for(500);
+                cpu.save(full, SNAPSHOT_FULL);
+                cpu.run_for(1000);
+                cpu.save(delta, SNAPSHOT_DELTA);
+                regs = cpu.get_registers();
+                steps = cpu.get_steps();
+                cycles = cpu.get_cycles();
+                cpu.store(saved, 0, sizeof(saved));
+
+                // Only $0400 and $0500 were written in between.
+                if (delta.str().size() >= 4 * (PAGE_SIZE + 1) ||
+                    full.str().size() <= delta.str().size()) {
+                        std::cerr << "\tDELTA HOLDS "
+                                  << delta.str().size() << " BYTES\n";
+                        failures++;
+                }
+
+                cpu.run(false);
+                if (!cpu.restore(full) || !cpu.restore(delta)) {
+                        std::cerr << "\tRESTORE FAILED\n";
+                        failures++;
+                        continue;
+                }
+                cpu.store(now, 0, sizeof(now));
+                if (!same_registers(regs, cpu.get_registers()) ||
+                    steps != cpu.get_steps() ||
+                    cycles != cpu.get_cycles() ||
+                    memcmp(saved, now, sizeof(saved)) != 0) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " RESTORED THE WRONG STATE\n";
+                        failures++;
+                }
+
+                // The restored CPU finishes the program as before.
+                cpu.run(false);
+                if (cpu.DMA(0x4ff) != 0xff || cpu.DMA(0x5ff) != 0x00 ||
+                    cpu.DMA(0x500) != 0xff) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " DID NOT RESUME\n";
+                        failures++;
+                }
+        }
+
+        std::stringstream       bad("K65X not a snapshot");
+        CPU                     cpu;
+        if (cpu.restore(bad)) {
+                std::cerr << "\tRESTORED A BAD SNAPSHOT\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+void
+test19()
+{
+        std::cerr << "\nStarting test 19\n";
+        std::cerr << "\t(Status register)\n";
+
+        unsigned char   program[] = {
+                0xa9, 0x7f,             // LDA #$7f
+                0x18,                   // CLC
+                0x69, 0x01,             // ADC #$01
+                0x08,                   // PHP
+                0x68,                   // PLA
+                0x85, 0x10,             // STA $10
+                0xa9, 0xff,             // LDA #$ff
+                0x18,                   // CLC
+                0x69, 0x01,             // ADC #$01
+                0x08,                   // PHP
+                0x68,                   // PLA
+                0x85, 0x11,             // STA $11
+                0xa9, 0xc3,             // LDA #$c3
+                0x48,                   // PHA
+                0x28,                   // PLP
+                0x08,                   // PHP
+                0x68,                   // PLA
+                0x85, 0x12,             // STA $12
+                0xa9, 0xc3,             // LDA #$c3
+                0x48,                   // PHA
+                0x28,                   // PLP
+                0x00
+        };
+        size_t          i;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x400, engines[i]);
+
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run(false);
+                if (cpu.DMA(0x10) != 0xf0 || cpu.DMA(0x11) != 0x33 ||
+                    cpu.DMA(0x12) != 0xf3 ||
+                    cpu.get_registers().p != 0xf3) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " HAS THE WRONG FLAGS\n";
+                        failures++;
+                }
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// reference_adc adds b and carry c to a the way the 6502.org decimal
+// mode tutorial (appendix A) describes the NMOS 6502 doing it, and
+// returns the result in the low byte and N, V, Z, and C above it.
+static unsigned
+reference_adc(int a, int b, int c, bool decimal)
+{
+        int     bin = a + b + c;
+        int     al, sum, signed_sum;
+        int     n, v, z, carry;
+
+        z = (bin & 0xff) == 0;
+        if (!decimal) {
+                signed_sum = (int8_t)a + (int8_t)b + c;
+                n = (bin >> 7) & 1;
+                v = signed_sum < -128 || signed_sum > 127;
+                carry = bin > 0xff;
+                sum = bin;
+        } else {
+                al = (a & 0x0f) + (b & 0x0f) + c;
+                if (al >= 0x0a)
+                        al = ((al + 0x06) & 0x0f) + 0x10;
+                sum = (a & 0xf0) + (b & 0xf0) + al;
+                signed_sum = (int8_t)(a & 0xf0) + (int8_t)(b & 0xf0) + al;
+                n = (sum >> 7) & 1;
+                v = signed_sum < -128 || signed_sum > 127;
+                if (sum >= 0xa0)
+                        sum += 0x60;
+                carry = sum >= 0x100;
+        }
+        return (sum & 0xff) | (n << 15) | (v << 14) | (z << 9) | (carry << 8);
+}
+
+
+// reference_sbc subtracts b and the borrow from a as the tutorial
+// describes; all the flags come out as in binary mode.
+static unsigned
+reference_sbc(int a, int b, int c, bool decimal)
+{
+        int     bin = a - b + c - 1;
+        int     signed_diff = (int8_t)a - (int8_t)b + c - 1;
+        int     al, diff;
+        int     n, v, z, carry;
+
+        n = (bin >> 7) & 1;
+        v = signed_diff < -128 || signed_diff > 127;
+        z = (bin & 0xff) == 0;
+        carry = bin >= 0;
+        diff = bin;
+        if (decimal) {
+                al = (a & 0x0f) - (b & 0x0f) + c - 1;
+                if (al < 0)
+                        al = ((al - 0x06) & 0x0f) - 0x10;
+                diff = (a & 0xf0) - (b & 0xf0) + al;
+                if (diff < 0)
+                        diff -= 0x60;
+        }
+        return (diff & 0xff) | (n << 15) | (v << 14) | (z << 9) | (carry << 8);
+}
+
+
+void
+test20()
+{
+        std::cerr << "\nStarting test 20\n";
+        std::cerr << "\t(ADC and SBC, binary and decimal)\n";
+
+        // The status byte, A, and the operand are patched in for each
+        // case.
+        unsigned char   program[] = {
+                0xa9, 0x00,             // LDA #status
+                0x48,                   // PHA
+                0x28,                   // PLP
+                0xa9, 0x00,             // LDA #a
+                0x69, 0x00,             // ADC #b (or SBC #b)
+                0x00
+        };
+        const uint8_t   nvzc = FLAG_NEGATIVE | FLAG_OVERFLOW | FLAG_ZERO |
+                               FLAG_CARRY;
+        CPU             cpu(0x400);
+        Registers       regs;
+        unsigned        want, got;
+        int             mode, op, d, c, a, b;
+        size_t          bad = 0;
+
+        cpu.load(program, 0x300, sizeof(program));
+        for (mode = 0; mode < 8; ++mode) {
+                op = mode >> 2;
+                d = (mode >> 1) & 1;
+                c = mode & 1;
+                cpu.DMA(0x301, (uint8_t)((d ? FLAG_DECIMAL : 0) | c));
+                cpu.DMA(0x306, op ? 0xe9 : 0x69);
+                for (a = 0; a < 256; ++a) {
+                        cpu.DMA(0x305, (uint8_t)a);
+                        for (b = 0; b < 256; ++b) {
+                                cpu.DMA(0x307, (uint8_t)b);
+                                cpu.set_entry(0x300);
+                                cpu.run(false);
+                                regs = cpu.get_registers();
+                                got = regs.a | (regs.p & nvzc) << 8;
+                                want = op ? reference_sbc(a, b, c, d) :
+                                            reference_adc(a, b, c, d);
+                                if (got == want || bad++ >= 8)
+                                        continue;
+                                std::cerr << "\t" << (op ? "SBC" : "ADC")
+                                          << std::hex << " D=" << d
+                                          << " C=" << c << " " << a << ","
+                                          << b << ": got " << got
+                                          << ", want " << want << "\n";
+                        }
+                }
+        }
+        if (bad > 0) {
+                std::cerr << "\t" << std::dec << bad << " WRONG RESULTS\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+void
+test21()
+{
+        std::cerr << "\nStarting test 21\n";
+        std::cerr << "\t(Disassembler)\n";
+
+        // One instruction in each addressing mode, starting at $0300.
+        unsigned char   program[] = {
+                0xea,                   // NOP
+                0x0a,                   // ASL A
+                0xa9, 0x01,             // LDA #$01
+                0xa5, 0x10,             // LDA $10
+                0xb5, 0x10,             // LDA $10,X
+                0xb6, 0x10,             // LDX $10,Y
+                0xad, 0x34, 0x12,       // LDA $1234
+                0xbd, 0x34, 0x12,       // LDA $1234,X
+                0xb9, 0x34, 0x12,       // LDA $1234,Y
+                0x6c, 0xfe, 0x02,       // JMP ($02FE)
+                0xa1, 0x20,             // LDA ($20,X)
+                0xb1, 0x20,             // LDA ($20),Y
+                0xd0, 0xec,             // BNE -20
+                0x02                    // illegal
+        };
+        static const char       *want[] = {
+                "NOP", "ASL A", "LDA #$01", "LDA $10", "LDA $10,X",
+                "LDX $10,Y", "LDA $1234", "LDA $1234,X", "LDA $1234,Y",
+                "JMP ($02FE)", "LDA ($20,X)", "LDA ($20),Y", "BNE $0308",
+                "ILL", NULL
+        };
+        char            text[DISASM_MAX];
+        size_t          off = 0, n;
+        int             i;
+
+        for (i = 0; want[i] != NULL; ++i) {
+                n = disassemble((uint16_t)(0x300 + off), program + off,
+                                text, sizeof(text));
+                if (strcmp(text, want[i]) != 0) {
+                        std::cerr << "\tGOT \"" << text << "\", WANT \""
+                                  << want[i] << "\"\n";
+                        failures++;
+                }
+                off += n;
+        }
+        if (off != sizeof(program)) {
+                std::cerr << "\tLENGTHS DO NOT ADD UP\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+void
+test22()
+{
+        std::cerr << "\nStarting test 22\n";
+        std::cerr << "\t(No allocations while running)\n";
+
+        unsigned char   program[] = {
+                0xa2, 0x00,             // LDX #$00
+                0x20, 0x0c, 0x03,       // JSR $030C
+                0x9d, 0x00, 0x02,       // STA $0200,X
+                0xe8,                   // INX
+                0xd0, 0xf7,             // BNE -9
+                0x00,                   // BRK
+                0x8a,                   // TXA
+                0x0a,                   // ASL A
+                0x69, 0x03,             // ADC #$03
+                0x60                    // RTS
+        };
+        size_t          i, before;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x10000, engines[i]);
+
+                // A breakpoint that is never reached, so that the
+                // bounded runs check for breakpoints. The first traced
+                // run sets up its trace ring; later ones reuse it.
+                cpu.set_breakpoint(0x0400);
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run(true);
+                cpu.reset();
+                before = allocations;
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run(false);
+                cpu.reset();
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run_for(100);
+                cpu.run_for_cycles(100);
+                cpu.step();
+                cpu.run_until(stop_at_x5, NULL, 100000);
+                cpu.run(false);
+                cpu.reset();
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.run(true);
+                cpu.reset();
+                if (allocations != before) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " ALLOCATED " << allocations - before
+                                  << " TIMES\n";
+                        failures++;
+                }
+                if (cpu.get_steps() != 0 || cpu.DMA(0x300) != 0) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " DID NOT RESET\n";
+                        failures++;
+                }
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+void
+test23()
+{
+        std::cerr << "\nStarting test 23\n";
+        std::cerr << "\t(Fused instruction pairs)\n";
+
+        // Every kind of pair the block decoder fuses, and a copy that
+        // overwrites the instruction after it.
+        unsigned char   program[] = {
+                0xa0, 0x00,             // LDY #$00
+                0xb9, 0x00, 0x03,       // LDA $0300,Y
+                0x99, 0x00, 0x02,       // STA $0200,Y
+                0xc8,                   // INY
+                0xc0, 0x20,             // CPY #$20
+                0xd0, 0xf5,             // BNE -11
+                0xa2, 0x10,             // LDX #$10
+                0xa9, 0x33,             // LDA #$33
+                0x85, 0x10,             // STA $10
+                0xa5, 0x10,             // LDA $10
+                0x85, 0x11,             // STA $11
+                0xc9, 0x33,             // CMP #$33
+                0xf0, 0x00,             // BEQ +0
+                0xe0, 0x08,             // CPX #$08
+                0xd0, 0x02,             // BNE +2
+                0xe6, 0x12,             // INC $12
+                0xca,                   // DEX
+                0xd0, 0xeb,             // BNE -21
+                0xa9, 0xea,             // LDA #$ea
+                0x8d, 0x29, 0x03,       // STA $0329
+                0xe8,                   // INX (becomes NOP)
+                0x86, 0x13,             // STX $13
+                0x00
+        };
+        static const size_t     slices[] = {0, 1, 2, 3, 5};
+        size_t                  i;
+
+        for (i = 0; i < sizeof(slices) / sizeof(slices[0]); ++i)
+                check_engines(program, sizeof(program), 0x400, 0x300,
+                              slices[i]);
+
+        CPU     cpu(0x400, ENGINE_CACHED);
+        cpu.load(program, 0x300, sizeof(program));
+        cpu.set_entry(0x300);
+        cpu.run(false);
+        if (cpu.DMA(0x21f) != program[0x1f] || cpu.DMA(0x11) != 0x33 ||
+            cpu.DMA(0x12) != 1 || cpu.DMA(0x13) != 0) {
+                std::cerr << "\tWRONG RESULTS\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// run_polls runs a program that ends in an endless poll on every engine
+// in slices of the given size, up to budget instructions, and checks
+// that they all end up in the same state as the table engine. The
+// Latch on page $C0 counts the reads each engine makes.
+static void
+run_polls(const unsigned char *program, size_t size, size_t slice,
+          size_t budget)
+{
+        Registers       want_regs = {0, 0, 0, 0, 0, 0}, got_regs;
+        size_t          want_steps = 0, want_cycles = 0, want_reads = 0;
+        size_t          i, done;
+
+        for (i = 0; i < nengines; ++i) {
+                Latch   latch = {0, 0};
+                CPU     cpu(0x400, engines[i]);
+
+                cpu.map_io(0xc0, latch_read, latch_write, &latch);
+                cpu.load(program, 0x300, size);
+                cpu.set_entry(0x300);
+                for (done = 0; done < budget; done += slice)
+                        cpu.run_for(slice);
+
+                got_regs = cpu.get_registers();
+                if (i == 0) {
+                        want_regs = got_regs;
+                        want_steps = cpu.get_steps();
+                        want_cycles = cpu.get_cycles();
+                        want_reads = latch.reads;
+                        continue;
+                }
+                if (!same_registers(want_regs, got_regs) ||
+                    cpu.get_steps() != want_steps ||
+                    cpu.get_cycles() != want_cycles ||
+                    latch.reads != want_reads) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " DIFFERS IN A POLL LOOP\n";
+                        failures++;
+                }
+        }
+}
+
+
+// poke_later is the watch for watch_poll: after a while it writes the
+// location the poll is waiting on, from another thread.
+static void
+poke_later(CPU *cpu)
+{
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        cpu->DMA(0x10, 1);
+}
+
+
+// watch_poll runs a poll on memory with a plain run, which has no
+// budget, on every engine, until another thread writes the location.
+// The engines must wait for it rather than skip to the largest step
+// count there is. How long they spin varies, so only the registers are
+// compared.
+static void
+watch_poll(void)
+{
+        static const unsigned char      program[] = {
+                0xa9, 0x00,             // LDA #$00
+                0x85, 0x10,             // STA $10
+                0xa5, 0x10,             // LDA $10
+                0xf0, 0xfc,             // BEQ -4
+                0x00                    // BRK
+        };
+        Registers                       regs;
+        size_t                          i;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x400, engines[i]);
+
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                std::thread     watch(poke_later, &cpu);
+                cpu.run(false);
+                watch.join();
+                regs = cpu.get_registers();
+                if (regs.a != 1 || regs.pc != 0x309 ||
+                    cpu.get_steps() < 5 ||
+                    cpu.get_cycles() < 2 * cpu.get_steps()) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " SKIPPED AN UNBOUNDED POLL\n";
+                        failures++;
+                }
+        }
+}
+
+
+void
+test24()
+{
+        std::cerr << "\nStarting test 24\n";
+        std::cerr << "\t(Idle loops)\n";
+
+        // The spinwheels delay loop from test 11, counted loops in
+        // both directions, and one whose branch crosses a page.
+        unsigned char   counted[0x110] = {
+                0xa2, 0x00,             // LDX #$00
+                0xea,                   // NOP
+                0xea,                   // NOP
+                0xca,                   // DEX
+                0xd0, 0xfb,             // BNE -5
+                0xa0, 0xf0,             // LDY #$f0
+                0xc8,                   // INY
+                0xd0, 0xfd,             // BNE -3
+                0xa2, 0x05,             // LDX #$05
+                0x18,                   // CLC
+                0xe8,                   // INX
+                0xd0, 0xfd,             // BNE -3
+                0x4c, 0xfd, 0x03,       // JMP $03FD
+        };
+        static const size_t     slices[] = {0, 1, 3, 50};
+        size_t                  i;
+
+        counted[0xfd] = 0x88;           // $03FD: DEY
+        counted[0xfe] = 0xd0;           // BNE -3, back across the page
+        counted[0xff] = 0xfd;
+        counted[0x100] = 0x00;          // BRK
+        for (i = 0; i < sizeof(slices) / sizeof(slices[0]); ++i)
+                check_engines(counted, sizeof(counted), 0x800, 0x300,
+                              slices[i]);
+
+        // Polls on memory that never changes, and on an I/O page whose
+        // reads count up, which must not be skipped.
+        unsigned char   poll[] = {
+                0xa9, 0x01,             // LDA #$01
+                0x85, 0x10,             // STA $10
+                0x24, 0x10,             // BIT $10
+                0xd0, 0xfc,             // BNE -4
+                0x00
+        };
+        unsigned char   io_poll[] = {
+                0xad, 0x01, 0xc0,       // LDA $C001
+                0xd0, 0xfb,             // BNE -5
+                0x00
+        };
+        run_polls(poll, sizeof(poll), 1000, 100000);
+        run_polls(poll, sizeof(poll), 7, 1000);
+        run_polls(io_poll, sizeof(io_poll), 1001, 10010);
+
+        CPU     cpu(0x400, ENGINE_CACHED);
+        cpu.load(poll, 0x300, sizeof(poll));
+        cpu.set_entry(0x300);
+        if (cpu.run_for(1000000).steps != 1000000 ||
+            cpu.get_registers().pc != 0x304) {
+                std::cerr << "\tPOLL DID NOT USE ITS BUDGET\n";
+                failures++;
+        }
+        watch_poll();
+        std::cerr << "\tdone\n";
+}
+
+
+// lockstep_input gives each lane of test 25 its own inputs.
+static void
+lockstep_input(CPU &cpu, size_t lane)
+{
+        cpu.DMA(0x10, (uint8_t)(lane * 7));
+        cpu.DMA(0x11, (uint8_t)(lane * 13));
+}
+
+
+// check_lockstep runs program on a Lockstep in slices of the given
+// size, enough of them to run it to the end, and checks every lane
+// against a CPU run the same way on its own.
+static void
+check_lockstep(const unsigned char *program, size_t size, size_t lanes,
+               size_t slice)
+{
+        Lockstep        group(lanes, 0x800);
+        unsigned char   want[0x800], got[0x800];
+        RunResult       res = {EXIT_BUDGET, 0, 0};
+        size_t          i, run, runs = 300 / slice + 1;
+
+        group.load(program, 0x300, size);
+        group.set_entry(0x300);
+        for (i = 0; i < lanes; ++i)
+                lockstep_input(group.lane(i), i);
+        for (run = 0; run < runs; ++run)
+                group.run_for(slice);
+
+        for (i = 0; i < lanes; ++i) {
+                CPU     cpu(0x800);
+
+                cpu.load(program, 0x300, size);
+                cpu.set_entry(0x300);
+                lockstep_input(cpu, i);
+                for (run = 0; run < runs; ++run)
+                        res = cpu.run_for(slice);
+
+                read_memory(cpu, want, sizeof(want));
+                read_memory(group.lane(i), got, sizeof(got));
+                if (!same_registers(cpu.get_registers(),
+                                    group.lane(i).get_registers()) ||
+                    cpu.get_steps() != group.lane(i).get_steps() ||
+                    cpu.get_cycles() != group.lane(i).get_cycles() ||
+                    res.reason != group.result(i).reason ||
+                    memcmp(want, got, sizeof(want)) != 0) {
+                        std::cerr << "\tLANE " << std::dec << i
+                                  << " DIFFERS (slice " << slice << ")\n";
+                        failures++;
+                        return;
+                }
+        }
+}
+
+
+void
+test25()
+{
+        std::cerr << "\nStarting test 25\n";
+        std::cerr << "\t(Lockstep lanes)\n";
+
+        // A loop whose trip count and branches depend on the input,
+        // code that patches itself differently in each lane, decimal
+        // mode, and a subroutine call.
+        unsigned char   program[] = {
+                0xa5, 0x10,             // LDA $10
+                0x29, 0x0f,             // AND #$0f
+                0xaa,                   // TAX
+                0xa0, 0x00,             // LDY #$00
+                0x98,                   // TYA
+                0x18,                   // CLC
+                0x65, 0x10,             // ADC $10
+                0xa8,                   // TAY
+                0x4a,                   // LSR A
+                0x90, 0x01,             // BCC +1
+                0xc8,                   // INY
+                0xca,                   // DEX
+                0x10, 0xf4,             // BPL -12
+                0x84, 0x20,             // STY $20
+                0xa5, 0x11,             // LDA $11
+                0x8d, 0x1b, 0x03,       // STA $031B
+                0xa2, 0x00,             // LDX #$00 (patched)
+                0x86, 0x21,             // STX $21
+                0xf8,                   // SED
+                0xa5, 0x10,             // LDA $10
+                0x69, 0x19,             // ADC #$19
+                0xd8,                   // CLD
+                0x85, 0x22,             // STA $22
+                0x20, 0x2a, 0x03,       // JSR $032A
+                0x00,                   // BRK
+                0xe6, 0x23,             // INC $23
+                0x60                    // RTS
+        };
+        static const size_t     slices[] = {1, 2, 7, 1000};
+        size_t                  i;
+
+        for (i = 0; i < sizeof(slices) / sizeof(slices[0]); ++i) {
+                check_lockstep(program, sizeof(program), 37, slices[i]);
+                check_lockstep(program, sizeof(program), 1, slices[i]);
+        }
+
+        // Straight-line code with the same control flow in every lane
+        // runs together all the way to the BRK.
+        unsigned char   straight[] = {
+                0xa5, 0x10,             // LDA $10
+                0x0a,                   // ASL A
+                0x65, 0x11,             // ADC $11
+                0xc9, 0x80,             // CMP #$80
+                0xa6, 0x11,             // LDX $11
+                0xe8,                   // INX
+                0x8a,                   // TXA
+                0x49, 0x55,             // EOR #$55
+                0x85, 0x12,             // STA $12
+                0x00                    // BRK
+        };
+        Lockstep        group(64, 0x800);
+
+        group.load(straight, 0x300, sizeof(straight));
+        group.set_entry(0x300);
+        for (i = 0; i < group.lanes(); ++i)
+                lockstep_input(group.lane(i), i);
+        if (group.run_for(100) != 64 * 10 ||
+            group.get_lockstep_steps() != 64 * 9) {
+                std::cerr << "\tLANES DID NOT RUN TOGETHER\n";
+                failures++;
+        }
+        for (i = 0; i < group.lanes(); ++i) {
+                if (group.lane(i).DMA(0x12) !=
+                    (uint8_t)((uint8_t)(i * 13 + 1) ^ 0x55) ||
+                    group.result(i).reason != EXIT_BRK) {
+                        std::cerr << "\tLANE " << i << " WRONG\n";
+                        failures++;
+                        break;
+                }
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// Test 26's instances multiply their input at $10 by itself, by
+// repeated addition, leaving the low byte at $11. The first quarter of
+// them spin forever instead, so that the threads given those run out
+// of budget long after the others have finished and start stealing.
+static const unsigned char      square_program[] = {
+        0xa6, 0x10,             // LDX $10
+        0xa9, 0x00,             // LDA #$00
+        0x18,                   // CLC
+        0x65, 0x10,             // ADC $10
+        0xca,                   // DEX
+        0xd0, 0xfa,             // BNE -6
+        0x85, 0x11,             // STA $11
+        0x00                    // BRK
+};
+static const unsigned char      spin_program[] = {
+        0x4c, 0x00, 0x03        // JMP $0300
+};
+
+
+static void
+batch_setup_square(CPU &cpu, size_t i, void *)
+{
+        if (i < 500)
+                cpu.load(spin_program, 0x300, sizeof(spin_program));
+        else
+                cpu.load(square_program, 0x300, sizeof(square_program));
+        cpu.set_entry(0x300);
+        cpu.DMA(0x10, (uint8_t)i);
+}
+
+
+static void
+batch_finish_square(CPU &cpu, size_t i, const RunResult &, void *arg)
+{
+        ((uint8_t *)arg)[i] = cpu.DMA(0x11);
+}
+
+
+void
+test26()
+{
+        std::cerr << "\nStarting test 26\n";
+        std::cerr << "\t(Batch runs)\n";
+
+        static const size_t     pools[] = {1, 3, 8};
+        static const size_t     count = 2000;
+        uint8_t                 out[count];
+        BatchResult             res;
+        size_t                  i, p, total, want, iters;
+        bool                    ok;
+
+        for (p = 0; p < sizeof(pools) / sizeof(pools[0]); ++p) {
+                Batch   batch(count, 0x400, ENGINE_CACHED);
+
+                batch.set_threads(pools[p]);
+                batch.set_budget(5000);
+                batch.set_slice(300);
+                memset(out, 0xff, sizeof(out));
+                total = batch.run(batch_setup_square, batch_finish_square,
+                                  out);
+
+                ok = true;
+                want = 0;
+                for (i = 0; i < count && ok; ++i) {
+                        res = batch.result(i);
+                        want += res.run.steps;
+                        if (!res.ran) {
+                                ok = false;
+                        } else if (i < 500) {
+                                ok = res.run.reason == EXIT_BUDGET &&
+                                    res.run.steps == 5000;
+                        } else {
+                                iters = (i & 0xff) ? (i & 0xff) : 256;
+                                ok = res.run.reason == EXIT_BRK &&
+                                    res.run.steps == 4 + 4 * iters &&
+                                    out[i] == (uint8_t)(i * i) &&
+                                    res.regs.a == out[i];
+                        }
+                }
+                if (!ok || total != want) {
+                        std::cerr << "\tINSTANCE " << std::dec << (i - 1)
+                                  << " WRONG WITH " << pools[p]
+                                  << " THREADS\n";
+                        failures++;
+                }
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// fork_matches runs the CPU to the end of the square program with
+// factor at $10 and checks it against a CPU that was never forked,
+// run the same way.
+static bool
+fork_matches(CPU &cpu, cpu_engine engine, uint8_t factor)
+{
+        CPU             ref(0x400, engine);
+        unsigned char   got[0x400], want[0x400];
+
+        ref.load(square_program, 0x300, sizeof(square_program));
+        ref.set_entry(0x300);
+        ref.DMA(0x10, 7);
+        ref.run_for(10);
+        ref.DMA(0x10, factor);
+        ref.run(false);
+        cpu.DMA(0x10, factor);
+        cpu.run(false);
+        cpu.store(got, 0, sizeof(got));
+        ref.store(want, 0, sizeof(want));
+        return same_registers(cpu.get_registers(), ref.get_registers()) &&
+            cpu.get_steps() == ref.get_steps() &&
+            cpu.get_cycles() == ref.get_cycles() &&
+            memcmp(got, want, sizeof(got)) == 0;
+}
+
+
+void
+test27()
+{
+        std::cerr << "\nStarting test 27\n";
+        std::cerr << "\t(Forks)\n";
+
+        static const size_t     nforks = 8;
+        CPU                     *forks[nforks];
+        CPU                     *parent, *grandchild;
+        char                    ram_path[32];
+        size_t                  i, k;
+        int                     fd;
+
+        for (i = 0; i < nengines; ++i) {
+                parent = new CPU(0x400, engines[i]);
+                parent->load(square_program, 0x300, sizeof(square_program));
+                parent->set_entry(0x300);
+                parent->DMA(0x10, 7);
+                parent->run_for(10);
+                for (k = 0; k < nforks; ++k)
+                        forks[k] = parent->fork();
+
+                // Writes on either side stay on that side.
+                parent->DMA(0x20, 0xaa);
+                forks[0]->DMA(0x30, 0xbb);
+                if (forks[1]->DMA(0x20) != 0 || parent->DMA(0x30) != 0 ||
+                    forks[1]->DMA(0x30) != 0 || forks[0]->DMA(0x20) != 0) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " FORKS SHARE WRITES\n";
+                        failures++;
+                }
+                forks[0]->DMA(0x30, 0);
+                parent->DMA(0x20, 0);
+
+                grandchild = forks[nforks - 1]->fork();
+                if (!fork_matches(*parent, engines[i], 3)) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " PARENT WRONG AFTER FORK\n";
+                        failures++;
+                }
+                delete parent;
+                for (k = 0; k < nforks; ++k) {
+                        if (!fork_matches(*forks[k], engines[i],
+                                          (uint8_t)(k + 1))) {
+                                std::cerr << "\tENGINE " << std::dec
+                                          << engines[i] << " FORK " << k
+                                          << " WRONG\n";
+                                failures++;
+                        }
+                        delete forks[k];
+                }
+                if (!fork_matches(*grandchild, engines[i], 200)) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " GRANDCHILD WRONG\n";
+                        failures++;
+                }
+                delete grandchild;
+        }
+
+        strcpy(ram_path, "/tmp/k6502-test-XXXXXX");
+        fd = mkstemp(ram_path);
+        if (fd != -1) {
+                close(fd);
+                CPU     cpu(0x10000);
+
+                if (!cpu.map_ram(ram_path) || cpu.fork() != NULL) {
+                        std::cerr << "\tFORKED FILE-BACKED MEMORY\n";
+                        failures++;
+                }
+                unlink(ram_path);
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// Test 28 calls a routine in a shared ROM at $C100 that tries to store
+// to the ROM and reads the byte back.
+static const unsigned char      rom_caller[] = {
+        0x20, 0x00, 0xc1,       // JSR $C100
+        0x85, 0x10,             // STA $10
+        0x00                    // BRK
+};
+static const unsigned char      rom_routine[] = {
+        0xa9, 0x11,             // LDA #$11
+        0x8d, 0xf0, 0xc1,       // STA $C1F0
+        0xad, 0xf0, 0xc1,       // LDA $C1F0
+        0x60                    // RTS
+};
+
+
+void
+test28()
+{
+        std::cerr << "\nStarting test 28\n";
+        std::cerr << "\t(Shared ROM images)\n";
+
+        static const size_t     ncpus = 3;
+        static unsigned char    image[0x3f00];
+        RomImage                *rom;
+        RomImage                tail, file;
+        CPU                     *cpus[ncpus];
+        CPU                     *child;
+        char                    rom_path[32];
+        size_t                  i, k;
+        int                     fd;
+
+        memset(image, 0xea, sizeof(image));
+        memcpy(image, rom_routine, sizeof(rom_routine));
+        image[0xf0] = 0x5a;
+        image[sizeof(image) - 1] = 0xc3;
+
+        for (i = 0; i < nengines; ++i) {
+                rom = new RomImage;
+                rom->load(image, sizeof(image));
+                for (k = 0; k < ncpus; ++k) {
+                        cpus[k] = new CPU(0x400, engines[i]);
+                        if (!cpus[k]->map_rom(*rom, 0xc100)) {
+                                std::cerr << "\tmap_rom FAILED\n";
+                                failures++;
+                        }
+                        cpus[k]->load(rom_caller, 0x300, sizeof(rom_caller));
+                        cpus[k]->set_entry(0x300);
+                }
+
+                // The CPUs keep the image's memory alive.
+                delete rom;
+                for (k = 0; k < ncpus; ++k) {
+                        cpus[k]->run(false);
+                        child = cpus[k]->fork();
+                        if (cpus[k]->DMA(0x10) != 0x5a ||
+                            cpus[k]->DMA(0xc1f0) != 0x5a ||
+                            cpus[k]->DMA(0xffff) != 0xc3 ||
+                            child->DMA(0xc1f0) != 0x5a) {
+                                std::cerr << "\tENGINE " << std::dec
+                                          << engines[i]
+                                          << " SHARED ROM WRONG\n";
+                                failures++;
+                        }
+                        delete child;
+                        delete cpus[k];
+                }
+        }
+
+        // A partial last page is copied, keeping the rest of it, and
+        // the whole page becomes ROM.
+        CPU     cpu(0x400);
+
+        cpu.DMA(0x990, 0x77);
+        if (!tail.load(image, 0x180) || tail.load(image, 0x180) ||
+            cpu.map_rom(tail, 0x880) || !cpu.map_rom(tail, 0x800) ||
+            cpu.DMA(0x97f) != image[0x17f] || cpu.DMA(0x990) != 0x77) {
+                std::cerr << "\tPARTIAL ROM PAGE WRONG\n";
+                failures++;
+        }
+        cpu.DMA(0x97f, 0);
+        cpu.DMA(0x990, 0);
+        if (cpu.DMA(0x97f) != image[0x17f] || cpu.DMA(0x990) != 0x77) {
+                std::cerr << "\tPARTIAL ROM PAGE NOT READ-ONLY\n";
+                failures++;
+        }
+
+        strcpy(rom_path, "/tmp/k6502-test-XXXXXX");
+        fd = mkstemp(rom_path);
+        if (fd != -1) {
+                if (write(fd, image, sizeof(image)) != sizeof(image))
+                        std::cerr << "\tWRITE FAILED\n";
+                close(fd);
+                if (!file.load(rom_path) || file.size() != sizeof(image) ||
+                    !cpu.map_rom(file, 0xc100) ||
+                    cpu.DMA(0xc1f0) != 0x5a || cpu.DMA(0xffff) != 0xc3) {
+                        std::cerr << "\tROM FILE IMAGE WRONG\n";
+                        failures++;
+                }
+                unlink(rom_path);
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// all_clear returns true if memory outside [skip, skip + len) is zero.
+static bool
+all_clear(CPU &cpu, size_t skip, size_t len)
+{
+        static unsigned char    mem[0x10000];
+        size_t                  i;
+
+        cpu.store(mem, 0, 0xffff);
+        mem[0xffff] = cpu.DMA(0xffff);
+        for (i = 0; i < sizeof(mem); ++i) {
+                if (mem[i] != 0 && (i < skip || i >= skip + len))
+                        return false;
+        }
+        return true;
+}
+
+
+void
+test29()
+{
+        std::cerr << "\nStarting test 29\n";
+        std::cerr << "\t(Arenas and fast resets)\n";
+
+        static const size_t     ncpus = 40;
+        static unsigned char    image[0x100];
+        CPU                     *cpus[ncpus];
+        CPU                     *child;
+        RomImage                rom;
+        char                    rom_path[32];
+        size_t                  i, k, mapped;
+        bool                    clear;
+        int                     fd;
+
+        for (k = 0; k < 2; ++k) {
+                Arena   arena(k == 1);
+
+                for (i = 0; i < ncpus; ++i) {
+                        cpus[i] = new CPU(0x400, ENGINE_CACHED, &arena);
+                        batch_setup_square(*cpus[i], 500 + i, NULL);
+                        cpus[i]->DMA((uint16_t)(0x1000 * (i % 16) + 0x42),
+                                     0xff);
+                        cpus[i]->run(false);
+                }
+                child = cpus[0]->fork();
+                child->DMA(0x2000, 1);
+                for (i = 0; i < ncpus; ++i)
+                        delete cpus[i];
+                delete child;
+
+                // Every slab comes back, and comes back clear.
+                mapped = arena.mapped();
+                clear = true;
+                for (i = 0; i < ncpus; ++i)
+                        cpus[i] = new CPU(0x400, ENGINE_CACHED, &arena);
+                child = cpus[0]->fork();
+                for (i = 0; i < ncpus; ++i) {
+                        clear = clear && all_clear(*cpus[i], 0, 0);
+                        delete cpus[i];
+                }
+                clear = clear && all_clear(*child, 0, 0);
+                delete child;
+                if (!clear || arena.mapped() != mapped || mapped == 0) {
+                        std::cerr << "\tARENA SLABS NOT RECYCLED\n";
+                        failures++;
+                }
+        }
+
+        // reset clears what was written and keeps ROM, and the engines
+        // notice that the program is gone.
+        memset(image, 0xee, sizeof(image));
+        rom.load(image, sizeof(image));
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x400, engines[i]);
+
+                cpu.map_rom(rom, 0x8000);
+                batch_setup_square(cpu, 600, NULL);
+                cpu.DMA(0x7ff0, 0x12);
+                cpu.run(false);
+                cpu.reset();
+                clear = all_clear(cpu, 0x8000, sizeof(image)) &&
+                    cpu.DMA(0x8080) == 0xee;
+                cpu.set_entry(0x300);
+                cpu.run(false);
+                if (!clear || cpu.get_steps() != 1 ||
+                    cpu.get_registers().a != 0) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " RESET WRONG\n";
+                        failures++;
+                }
+        }
+
+        // reset from a base CPU restores its state without copying.
+        CPU     base(0x400, ENGINE_JIT);
+        CPU     cpu(0x400, ENGINE_JIT);
+
+        batch_setup_square(base, 700, NULL);
+        base.set_breakpoint(0x30a);
+        for (i = 0; i < 3; ++i) {
+                if (!cpu.reset(base)) {
+                        std::cerr << "\tRESET FROM BASE FAILED\n";
+                        failures++;
+                        break;
+                }
+                cpu.DMA(0x10, (uint8_t)(i + 5));
+                if (cpu.run_for(100000).reason != EXIT_BREAKPOINT ||
+                    cpu.get_registers().a != (uint8_t)((i + 5) * (i + 5)) ||
+                    base.DMA(0x10) != (uint8_t)700) {
+                        std::cerr << "\tRESET FROM BASE WRONG\n";
+                        failures++;
+                }
+        }
+
+        // A CPU with a ROM file mapped into it can be reset from a base
+        // and then written where the ROM was. The file is big enough
+        // to be mapped rather than copied.
+        strcpy(rom_path, "/tmp/k6502-test-XXXXXX");
+        fd = mkstemp(rom_path);
+        if (fd != -1) {
+                for (i = 0; i < 0x20; ++i) {
+                        if (write(fd, image, sizeof(image)) != sizeof(image))
+                                std::cerr << "\tWRITE FAILED\n";
+                }
+                close(fd);
+                for (k = 0; k < 2; ++k) {
+                        Arena   arena;
+                        CPU     target(0x10000, ENGINE_CACHED,
+                                       k == 1 ? &arena : NULL);
+
+                        if (!target.map_rom(rom_path, 0xe000) ||
+                            target.DMA(0xe080) != 0xee ||
+                            !target.reset(base)) {
+                                std::cerr << "\tRESET OVER ROM FILE FAILED\n";
+                                failures++;
+                                continue;
+                        }
+                        target.DMA(0xe000, 1);
+                        target.DMA(0x10, 2);
+                        if (target.DMA(0xe000) != 1 || target.DMA(0x10) != 2 ||
+                            base.DMA(0xe000) != 0 ||
+                            base.DMA(0x10) != (uint8_t)700) {
+                                std::cerr << "\tRESET OVER ROM FILE WRONG\n";
+                                failures++;
+                        }
+                }
+                unlink(rom_path);
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+
+void
+test30()
+{
+        std::cerr << "\nStarting test 30\n";
+        std::cerr << "\t(Guest profiler)\n";
+
+        // Calls $0310 three times, which calls $0320, and then calls
+        // $0320 directly.
+        static const unsigned char      program[] = {
+                0xa2, 0x03,             // LDX #$03
+                0x20, 0x10, 0x03,       // JSR $0310
+                0xca,                   // DEX
+                0xd0, 0xfa,             // BNE $0302
+                0x20, 0x20, 0x03,       // JSR $0320
+                0x00                    // BRK
+        };
+        static const unsigned char      outer[] = {
+                0x20, 0x20, 0x03,       // JSR $0320
+                0x60                    // RTS
+        };
+        static const unsigned char      inner[] = {
+                0xa9, 0x01,             // LDA #$01
+                0x60                    // RTS
+        };
+        static const char               collapsed[] =
+                "$0300 47\n"
+                "$0300;$0310 36\n"
+                "$0300;$0310;$0320 24\n"
+                "$0300;$0320 8\n";
+        Profiler                        prof;
+        std::ostringstream              out;
+        size_t                          i;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU     cpu(0x400, engines[i]);
+
+                prof.clear();
+                out.str("");
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.load(outer, 0x310, sizeof(outer));
+                cpu.load(inner, 0x320, sizeof(inner));
+                cpu.set_entry(0x300);
+                cpu.set_profiler(&prof);
+                cpu.run(false);
+                prof.write_collapsed(out);
+                if (prof.opcode_count(0x20) != 7 ||
+                    prof.opcode_count(0x60) != 7 ||
+                    prof.pc_count(0x320) != 4 || prof.pc_count(0x305) != 3 ||
+                    prof.pc_count(0x30b) != 1 || prof.pc_count(0x321) != 0 ||
+                    prof.routine_calls(0x320) != 4 ||
+                    prof.routine_cycles(0x320) != 32 ||
+                    prof.routine_cycles(0x300) + prof.routine_cycles(0x310) +
+                    prof.routine_cycles(0x320) != cpu.get_cycles() ||
+                    out.str() != collapsed) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " PROFILE WRONG\n" << out.str();
+                        failures++;
+                }
+
+                // Detached, the profiler sees nothing more.
+                cpu.set_profiler(NULL);
+                cpu.set_entry(0x300);
+                cpu.run_for(1000);
+                if (prof.pc_count(0x300) != 1) {
+                        std::cerr << "\tDETACHED PROFILER STILL COUNTING\n";
+                        failures++;
+                }
+        }
+
+        // The profiler follows bounded runs, and its flat profile lists
+        // the busiest routine first.
+        CPU     cpu(0x400);
+
+        prof.clear();
+        out.str("");
+        cpu.load(program, 0x300, sizeof(program));
+        cpu.load(outer, 0x310, sizeof(outer));
+        cpu.load(inner, 0x320, sizeof(inner));
+        cpu.set_entry(0x300);
+        cpu.set_profiler(&prof);
+        cpu.run_for(4);
+        cpu.run_for(1000);
+        prof.write_flat(out);
+        if (prof.pc_count(0x300) != 1 || out.str() !=
+            "$0300\t1\t47\n$0310\t3\t36\n$0320\t4\t32\n") {
+                std::cerr << "\tFLAT PROFILE WRONG\n" << out.str();
+                failures++;
+        }
+
+        // Recursion deeper than the call tree goes: $0310 calls itself
+        // from $0310 and returns from $0313. Once it unwinds, the code
+        // at $0303 is charged to the root again.
+        const size_t    depth = PROFILE_MAX_DEPTH + 72;
+
+        prof.clear();
+        prof.record(0x300, 0x20, 6, 0x310);
+        for (i = 1; i < depth; ++i)
+                prof.record(0x310, 0x20, 6, 0x310);
+        for (i = 0; i < depth; ++i)
+                prof.record(0x313, 0x60, 6, 0x303);
+        prof.record(0x303, 0xea, 2, 0x304);
+        prof.record(0x304, 0x20, 6, 0x320);
+        prof.record(0x320, 0x60, 6, 0x307);
+        if (prof.routine_cycles(0x300) != 14 ||
+            prof.routine_calls(0x310) != PROFILE_MAX_DEPTH ||
+            prof.routine_cycles(0x310) != (2 * depth - 1) * 6 ||
+            prof.routine_calls(0x320) != 1 ||
+            prof.routine_cycles(0x320) != 6) {
+                std::cerr << "\tDEEP RECURSION PROFILE WRONG\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+
+// A TraceCollector keeps every record it is given.
+class TraceCollector : public TraceSink {
+        public:
+                std::vector<TraceRecord>        records;
+
+                void record(const TraceRecord &rec)
+                {
+                        this->records.push_back(rec);
+                }
+};
+
+
+void
+test31()
+{
+        std::cerr << "\nStarting test 31\n";
+        std::cerr << "\t(Trace ring)\n";
+
+        unsigned char   program[] = {
+                0xa2, 0x02,             // LDX #$02
+                0xbd, 0x00, 0x02,       // LDA $0200,X
+                0x85, 0x10,             // STA $10
+                0xca,                   // DEX
+                0xd0, 0xf8,             // BNE $0302
+                0x00                    // BRK
+        };
+        TraceCollector  collector;
+        std::string     packed;
+        size_t          i, k;
+        bool            ok;
+
+        for (i = 0; i < nengines; ++i) {
+                CPU             cpu(0x400, engines[i]);
+                TraceRing       ring(8, &collector);
+
+                // Nothing is passed on until the ring is flushed, and
+                // then only the last eight instructions.
+                collector.records.clear();
+                program[10] = 0x00;
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                cpu.set_trace(&ring);
+                cpu.run(false);
+                ring.wait();
+                ok = collector.records.empty();
+                ring.flush();
+                ring.flush();
+                ring.wait();
+                ok = ok && collector.records.size() == 8;
+                for (k = 0; ok && k < 8; ++k)
+                        ok = collector.records[k].step == k + 2;
+                ok = ok && collector.records[0].op == 0x85 &&
+                    collector.records[0].ea == 0x10 &&
+                    collector.records[0].cycle == 6 &&
+                    collector.records[3].op == 0xbd &&
+                    collector.records[3].ea == 0x201 &&
+                    collector.records[3].x == 1 &&
+                    collector.records[7].op == 0x00;
+                if (!ok) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " TRACE RING WRONG\n";
+                        failures++;
+                }
+
+                // An illegal opcode flushes the ring by itself.
+                collector.records.clear();
+                cpu.reset();
+                program[10] = 0x02;
+                cpu.load(program, 0x300, sizeof(program));
+                cpu.set_entry(0x300);
+                ok = cpu.run_for(100).reason == EXIT_ILLEGAL;
+                ring.wait();
+                if (!ok || collector.records.size() != 8 ||
+                    collector.records[7].op != 0x02 ||
+                    collector.records[7].pc != 0x30a) {
+                        std::cerr << "\tENGINE " << std::dec << engines[i]
+                                  << " TRACE RING NOT FLUSHED ON FAULT\n";
+                        failures++;
+                }
+        }
+
+        // Binary records carry the effective address and cycle count.
+        std::ostringstream      out;
+        BinaryTrace             binary(out);
+        CPU                     cpu(0x400);
+
+        program[10] = 0x00;
+        cpu.load(program, 0x300, sizeof(program));
+        cpu.set_entry(0x300);
+        cpu.set_trace(&binary);
+        cpu.run(false);
+        packed = out.str();
+        if (packed.size() != 10 * TRACE_RECORD_SIZE ||
+            (uint8_t)packed[TRACE_RECORD_SIZE + 10] != 0x02 ||
+            (uint8_t)packed[TRACE_RECORD_SIZE + 11] != 0x02 ||
+            (uint8_t)packed[2 * TRACE_RECORD_SIZE + 18] != 6) {
+                std::cerr << "\tBINARY TRACE WRONG\n";
+                failures++;
+        }
+
+        // run(true) shows the end of the run, not a dump per step.
+        cpu.set_trace(NULL);
+        cpu.reset();
+        cpu.load(program, 0x300, sizeof(program));
+        cpu.set_entry(0x300);
+        cpu.run(true);
+        if (cpu.get_steps() != 10) {
+                std::cerr << "\tTRACED RUN WRONG\n";
+                failures++;
+        }
+        std::cerr << "\tdone\n";
+}
+
+int
+main(void)
+{
+        test1();
+        test2();
+        test3();
+        test4();
+        test5();
+        test6();
+        test7();
+        test8();
+        test9();
+        test10();
+        //test11();
+        test12();
+        test13();
+        test14();
+        test15();
+        test16();
+        test17();
+        test18();
+        test19();
+        test20();
+        test21();
+        test22();
+        test23();
+        test24();
+        test25();
+        test26();
+        test27();
+        test28();
+        test29();
+        test30();
+        test31();
+
+        if (failures > 0) {
+                std::cerr << std::dec << failures << " FAILURE(S)\n";
+                return 1;
+        }
+        return 0;
 }
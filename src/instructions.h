@@ -0,0 +1,874 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __6502_INSTRUCTIONS_H
+#define __6502_INSTRUCTIONS_H
+
+
+/*
+ * Instruction handlers. These are templates over the addressing mode,
+ * so each opcode gets its own copy with the operand access folded in at
+ * compile time. This header is private to the execution engines.
+ */
+
+
+#include "alu.h"
+#include "cpu.h"
+
+
+// stack_addr returns the address of the stack slot for the stack
+// pointer sp.
+inline uint16_t
+stack_addr(uint8_t sp)
+{
+	return (1 << 8) + sp;
+}
+
+
+// address computes the effective address for the addressing mode from
+// the instruction's operand bytes.
+template <addr_mode M>
+inline uint16_t
+CPU::address(uint16_t arg)
+{
+	uint16_t	ptr;
+
+	switch (M) {
+	case MODE_ZP:
+		return arg & 0xff;
+	case MODE_ZPX:
+		return (arg + this->x) & 0xff;
+	case MODE_ZPY:
+		return (arg + this->y) & 0xff;
+	case MODE_ABS:
+		return arg;
+	case MODE_ABSX:
+		return (uint16_t)(arg + this->x);
+	case MODE_ABSY:
+		return (uint16_t)(arg + this->y);
+	case MODE_IND:
+		// The NMOS 6502 does not carry into the high byte when
+		// fetching the pointer, so JMP ($xxFF) wraps in-page.
+		ptr = (arg & 0xff00) | ((arg + 1) & 0xff);
+		return this->ram.peek(arg) + (this->ram.peek(ptr) << 8);
+	case MODE_IIZPX:
+		return this->zp_pointer((uint8_t)(arg + this->x));
+	case MODE_IIZPY:
+		return (uint16_t)(this->zp_pointer((uint8_t)arg) + this->y);
+	default:
+		return 0;
+	}
+}
+
+
+// zp_pointer reads a pointer from the zero page; the high byte wraps
+// around within the zero page.
+inline uint16_t
+CPU::zp_pointer(uint8_t zp)
+{
+	return this->ram.peek(zp) + (this->ram.peek((uint8_t)(zp + 1)) << 8);
+}
+
+
+// read_address is address for instructions that only read their
+// operand. Those take an extra cycle when indexing crosses a page.
+template <addr_mode M>
+inline uint16_t
+CPU::read_address(uint16_t arg)
+{
+	uint16_t	base;
+	uint8_t		index;
+
+	switch (M) {
+	case MODE_ABSX:
+		base = arg;
+		index = this->x;
+		break;
+	case MODE_ABSY:
+		base = arg;
+		index = this->y;
+		break;
+	case MODE_IIZPY:
+		base = this->zp_pointer((uint8_t)arg);
+		index = this->y;
+		break;
+	default:
+		return this->address<M>(arg);
+	}
+
+	this->cycles += ((base & 0xff) + index) >> 8;
+	return (uint16_t)(base + index);
+}
+
+
+// operand returns the value an instruction operates on.
+template <addr_mode M>
+inline uint8_t
+CPU::operand(uint16_t arg)
+{
+	if (M == MODE_IMM)
+		return arg & 0xff;
+	if (M == MODE_ACC)
+		return this->a;
+	return this->ram.peek(this->read_address<M>(arg));
+}
+
+
+// set_nz sets the negative and zero flags from v.
+inline void
+CPU::set_nz(uint8_t v)
+{
+	this->flag_n = v;
+	this->flag_z = v;
+}
+
+
+// add adds v and the carry flag to the accumulator.
+inline void
+CPU::add(uint8_t v)
+{
+	uint16_t	sum = this->a + v + this->flag_c;
+
+	this->flag_c = (uint8_t)(sum >> 8);
+	this->flag_v = (uint8_t)(~(this->a ^ v) & (this->a ^ sum));
+	this->a = (uint8_t)sum;
+	this->set_nz(this->a);
+}
+
+
+// add_decimal adds v to the accumulator in decimal mode, looking the
+// result and flags up in table (bcd_add_table or bcd_sub_table).
+inline void
+CPU::add_decimal(const uint16_t *table, uint8_t v)
+{
+	alu_entry	r = table[alu_index(this->a, v, this->flag_c)];
+
+	this->a = (uint8_t)r;
+	this->set_flags((uint8_t)(r >> 8));
+}
+
+
+// compare sets the carry, zero, and negative flags as if v were
+// subtracted from reg.
+inline void
+CPU::compare(uint8_t reg, uint8_t v)
+{
+	this->flag_c = reg >= v;
+	this->set_nz((uint8_t)(reg - v));
+}
+
+
+// branch moves the PC by the signed offset in the low byte of arg. A
+// taken branch costs one extra cycle, two if it lands in another page.
+inline void
+CPU::branch(uint16_t arg)
+{
+	uint16_t	target = this->pc + (int8_t)(arg & 0xff);
+
+	this->cycles += 1 + ((target ^ this->pc) >> 8 != 0);
+	this->pc = target;
+}
+
+
+inline void
+CPU::push(uint8_t v)
+{
+	this->ram.poke(stack_addr(this->s--), v);
+}
+
+
+inline uint8_t
+CPU::pull()
+{
+	return this->ram.peek(stack_addr(++this->s));
+}
+
+
+/*
+ * Load / store.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::LDA(uint16_t arg)
+{
+	this->a = this->operand<M>(arg);
+	this->set_nz(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::LDX(uint16_t arg)
+{
+	this->x = this->operand<M>(arg);
+	this->set_nz(this->x);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::LDY(uint16_t arg)
+{
+	this->y = this->operand<M>(arg);
+	this->set_nz(this->y);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::STA(uint16_t arg)
+{
+	this->ram.poke(this->address<M>(arg), this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::STX(uint16_t arg)
+{
+	this->ram.poke(this->address<M>(arg), this->x);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::STY(uint16_t arg)
+{
+	this->ram.poke(this->address<M>(arg), this->y);
+	return true;
+}
+
+
+/*
+ * Register transfers.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::TAX(uint16_t)
+{
+	this->x = this->a;
+	this->set_nz(this->x);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::TAY(uint16_t)
+{
+	this->y = this->a;
+	this->set_nz(this->y);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::TSX(uint16_t)
+{
+	this->x = this->s;
+	this->set_nz(this->x);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::TXA(uint16_t)
+{
+	this->a = this->x;
+	this->set_nz(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::TXS(uint16_t)
+{
+	this->s = this->x;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::TYA(uint16_t)
+{
+	this->a = this->y;
+	this->set_nz(this->a);
+	return true;
+}
+
+
+/*
+ * Arithmetic and logic.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::ADC(uint16_t arg)
+{
+	uint8_t	v = this->operand<M>(arg);
+
+	if (this->p & FLAG_DECIMAL)
+		this->add_decimal(bcd_add_table, v);
+	else
+		this->add(v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::SBC(uint16_t arg)
+{
+	uint8_t	v = this->operand<M>(arg);
+
+	if (this->p & FLAG_DECIMAL)
+		this->add_decimal(bcd_sub_table, v);
+	else
+		this->add(~v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::AND(uint16_t arg)
+{
+	this->a &= this->operand<M>(arg);
+	this->set_nz(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::EOR(uint16_t arg)
+{
+	this->a ^= this->operand<M>(arg);
+	this->set_nz(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::ORA(uint16_t arg)
+{
+	this->a |= this->operand<M>(arg);
+	this->set_nz(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BIT(uint16_t arg)
+{
+	uint8_t	v = this->operand<M>(arg);
+
+	this->flag_n = v;
+	this->flag_v = (uint8_t)(v << 1);
+	this->flag_z = this->a & v;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::CMP(uint16_t arg)
+{
+	this->compare(this->a, this->operand<M>(arg));
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::CPX(uint16_t arg)
+{
+	this->compare(this->x, this->operand<M>(arg));
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::CPY(uint16_t arg)
+{
+	this->compare(this->y, this->operand<M>(arg));
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::DEC(uint16_t arg)
+{
+	uint16_t	addr = this->address<M>(arg);
+	uint8_t		v = this->ram.peek(addr) - 1;
+
+	this->ram.poke(addr, v);
+	this->set_nz(v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::INC(uint16_t arg)
+{
+	uint16_t	addr = this->address<M>(arg);
+	uint8_t		v = this->ram.peek(addr) + 1;
+
+	this->ram.poke(addr, v);
+	this->set_nz(v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::DEX(uint16_t)
+{
+	this->set_nz(--this->x);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::DEY(uint16_t)
+{
+	this->set_nz(--this->y);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::INX(uint16_t)
+{
+	this->set_nz(++this->x);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::INY(uint16_t)
+{
+	this->set_nz(++this->y);
+	return true;
+}
+
+
+/*
+ * Shifts and rotates operate either on the accumulator or on memory,
+ * depending on the addressing mode.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::ASL(uint16_t arg)
+{
+	uint16_t	addr = 0;
+	uint8_t		v = this->a;
+
+	if (M != MODE_ACC) {
+		addr = this->address<M>(arg);
+		v = this->ram.peek(addr);
+	}
+
+	this->flag_c = v >> 7;
+	v <<= 1;
+	this->set_nz(v);
+	if (M == MODE_ACC)
+		this->a = v;
+	else
+		this->ram.poke(addr, v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::LSR(uint16_t arg)
+{
+	uint16_t	addr = 0;
+	uint8_t		v = this->a;
+
+	if (M != MODE_ACC) {
+		addr = this->address<M>(arg);
+		v = this->ram.peek(addr);
+	}
+
+	this->flag_c = v & 1;
+	v >>= 1;
+	this->set_nz(v);
+	if (M == MODE_ACC)
+		this->a = v;
+	else
+		this->ram.poke(addr, v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::ROL(uint16_t arg)
+{
+	uint16_t	addr = 0;
+	uint8_t		v = this->a;
+	uint8_t		carry = this->flag_c;
+
+	if (M != MODE_ACC) {
+		addr = this->address<M>(arg);
+		v = this->ram.peek(addr);
+	}
+
+	this->flag_c = v >> 7;
+	v = (v << 1) | carry;
+	this->set_nz(v);
+	if (M == MODE_ACC)
+		this->a = v;
+	else
+		this->ram.poke(addr, v);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::ROR(uint16_t arg)
+{
+	uint16_t	addr = 0;
+	uint8_t		v = this->a;
+	uint8_t		carry = this->flag_c;
+
+	if (M != MODE_ACC) {
+		addr = this->address<M>(arg);
+		v = this->ram.peek(addr);
+	}
+
+	this->flag_c = v & 1;
+	v = (v >> 1) | (carry << 7);
+	this->set_nz(v);
+	if (M == MODE_ACC)
+		this->a = v;
+	else
+		this->ram.poke(addr, v);
+	return true;
+}
+
+
+/*
+ * Status register.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::CLC(uint16_t)
+{
+	this->flag_c = 0;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::CLD(uint16_t)
+{
+	this->p &= ~FLAG_DECIMAL;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::CLI(uint16_t)
+{
+	this->p &= ~FLAG_INT_DISABLE;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::CLV(uint16_t)
+{
+	this->flag_v = 0;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::SEC(uint16_t)
+{
+	this->flag_c = 1;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::SED(uint16_t)
+{
+	this->p |= FLAG_DECIMAL;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::SEI(uint16_t)
+{
+	this->p |= FLAG_INT_DISABLE;
+	return true;
+}
+
+
+/*
+ * Branching / jumping.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::BCC(uint16_t arg)
+{
+	if (!this->flag_c)
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BCS(uint16_t arg)
+{
+	if (this->flag_c)
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BEQ(uint16_t arg)
+{
+	if (this->flag_z == 0)
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BMI(uint16_t arg)
+{
+	if (this->flag_n & 0x80)
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BNE(uint16_t arg)
+{
+	if (this->flag_z != 0)
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BPL(uint16_t arg)
+{
+	if (!(this->flag_n & 0x80))
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BVC(uint16_t arg)
+{
+	if (!(this->flag_v & 0x80))
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::BVS(uint16_t arg)
+{
+	if (this->flag_v & 0x80)
+		this->branch(arg);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::JMP(uint16_t arg)
+{
+	this->pc = this->address<M>(arg);
+	return true;
+}
+
+
+// JSR pushes the address of the last byte of the JSR instruction.
+template <addr_mode M>
+inline bool
+CPU::JSR(uint16_t arg)
+{
+	uint16_t	ret = this->pc - 1;
+
+	this->push((uint8_t)(ret >> 8));
+	this->push((uint8_t)(ret & 0xff));
+	this->pc = arg;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::RTS(uint16_t)
+{
+	uint16_t	addr;
+
+	addr = this->pull();
+	addr += this->pull() << 8;
+	this->pc = addr + 1;
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::RTI(uint16_t)
+{
+	uint16_t	addr;
+
+	this->set_status((this->pull() & ~FLAG_BREAK) | FLAG_EXPANSION);
+	addr = this->pull();
+	addr += this->pull() << 8;
+	this->pc = addr;
+	return true;
+}
+
+
+/*
+ * Stack.
+ */
+
+
+template <addr_mode M>
+inline bool
+CPU::PHA(uint16_t)
+{
+	this->push(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::PHP(uint16_t)
+{
+	this->push(this->status() | FLAG_BREAK | FLAG_EXPANSION);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::PLA(uint16_t)
+{
+	this->a = this->pull();
+	this->set_nz(this->a);
+	return true;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::PLP(uint16_t)
+{
+	this->set_status((this->pull() & ~FLAG_BREAK) | FLAG_EXPANSION);
+	return true;
+}
+
+
+/*
+ * Control.
+ */
+
+
+// BRK halts the CPU with the break flag set; there is no interrupt
+// vector to go through in this emulator.
+template <addr_mode M>
+inline bool
+CPU::BRK(uint16_t)
+{
+	this->p |= FLAG_BREAK;
+	this->halt_reason = EXIT_BRK;
+	return false;
+}
+
+
+template <addr_mode M>
+inline bool
+CPU::NOP(uint16_t)
+{
+	return true;
+}
+
+
+// ILL handles every undocumented opcode: the CPU halts with the PC left
+// on the offending opcode.
+template <addr_mode M>
+inline bool
+CPU::ILL(uint16_t)
+{
+	this->pc--;
+	this->halt_reason = EXIT_ILLEGAL;
+	return false;
+}
+
+
+#endif
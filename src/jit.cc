@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <cstring>
+
+#include "blockcache.h"
+#include "cpu.h"
+#include "instructions.h"
+#include "jit.h"
+#include "opcodes.h"
+
+
+JIT::JIT()
+{
+	void	*p;
+
+	this->arena = NULL;
+	this->used = 0;
+#if defined(__x86_64__)
+	p = mmap(NULL, JIT_ARENA_SIZE, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+		this->arena = (uint8_t *)p;
+#else
+	(void)p;
+#endif
+}
+
+
+JIT::~JIT()
+{
+	if (this->arena != NULL)
+		munmap(this->arena, JIT_ARENA_SIZE);
+}
+
+
+// available returns true if native code can be generated on this host.
+bool
+JIT::available()
+{
+	return this->arena != NULL;
+}
+
+
+// begin returns a writable pointer with room for at least JIT_MAX_BLOCK
+// bytes of code, or NULL if the arena is full (or the host is not
+// supported).
+uint8_t *
+JIT::begin()
+{
+	if (this->arena == NULL || this->used + JIT_MAX_BLOCK > JIT_ARENA_SIZE)
+		return NULL;
+	if (mprotect(this->arena, JIT_ARENA_SIZE, PROT_READ|PROT_WRITE) != 0)
+		return NULL;
+	return this->arena + this->used;
+}
+
+
+// commit makes the len bytes of code at start executable and returns
+// them as a callable block.
+NativeBlock
+JIT::commit(uint8_t *start, size_t len)
+{
+	NativeBlock	fn;
+
+	this->used += len;
+	if (mprotect(this->arena, JIT_ARENA_SIZE, PROT_READ|PROT_EXEC) != 0)
+		return NULL;
+	memcpy(&fn, &start, sizeof(fn));
+	return fn;
+}
+
+
+// reset discards all compiled code. The caller must have dropped every
+// reference to it first.
+void
+JIT::reset()
+{
+	this->used = 0;
+}
+
+
+/*
+ * jit_call is the glue between compiled code and the instruction
+ * handlers: it is called with the operand word and the address of the
+ * following instruction, exactly as the interpreter would dispatch it.
+ */
+template <bool (CPU::*F)(uint16_t)>
+bool
+CPU::jit_call(CPU *cpu, uint16_t arg, uint16_t next)
+{
+	cpu->pc = next;
+	return (cpu->*F)(arg);
+}
+
+
+#define THUNK_ENTRY(op, insn, mode, cycles)	\
+	&CPU::jit_call<&CPU::insn<MODE_##mode> >,
+const CPU::thunk CPU::thunks[256] = {
+	K6502_OPCODES(THUNK_ENTRY)
+};
+#undef THUNK_ENTRY
+
+
+#if defined(__x86_64__)
+
+
+/*
+ * A minimal x86-64 emitter. Compiled blocks keep the CPU pointer in
+ * rbx; guest registers are addressed as [rbx+disp32].
+ */
+
+
+struct Emitter {
+	uint8_t	*p;
+
+	void b(uint8_t v) { *p++ = v; }
+	void w(uint16_t v) { b(v & 0xff); b(v >> 8); }
+	void d(uint32_t v) { w(v & 0xffff); w(v >> 16); }
+	void q(uint64_t v) { d(v & 0xffffffff); d(v >> 32); }
+};
+
+
+// Offsets of the CPU fields touched by native code.
+struct Layout {
+	uint32_t	a;
+	uint32_t	x;
+	uint32_t	y;
+	uint32_t	p;
+	uint32_t	flag_n;
+	uint32_t	flag_z;
+	uint32_t	flag_c;
+	uint32_t	flag_v;
+	uint32_t	pc;
+	uint32_t	steps;
+	uint32_t	cycles;
+};
+
+
+// load8 emits movzx eax, byte [rbx+off].
+static void
+load8(Emitter &e, uint32_t off)
+{
+	e.b(0x0f); e.b(0xb6); e.b(0x83); e.d(off);
+}
+
+
+// store8 emits mov byte [rbx+off], al.
+static void
+store8(Emitter &e, uint32_t off)
+{
+	e.b(0x88); e.b(0x83); e.d(off);
+}
+
+
+// set_nz emits the equivalent of CPU::set_nz(al).
+static void
+set_nz(Emitter &e, const Layout &l)
+{
+	store8(e, l.flag_n);
+	store8(e, l.flag_z);
+}
+
+
+// set_pc emits mov word [rbx+pc], addr.
+static void
+set_pc(Emitter &e, const Layout &l, uint16_t addr)
+{
+	e.b(0x66); e.b(0xc7); e.b(0x83); e.d(l.pc); e.w(addr);
+}
+
+
+// add_count emits add qword [rbx+off], n.
+static void
+add_count(Emitter &e, uint32_t off, uint32_t n)
+{
+	if (n == 0)
+		return;
+	e.b(0x48); e.b(0x81); e.b(0x83); e.d(off); e.d(n);
+}
+
+
+// flag_op emits an and (clear) or or (set) of a flag kept in p.
+static void
+flag_op(Emitter &e, const Layout &l, bool set, uint8_t flag)
+{
+	e.b(0x80);
+	if (set) {
+		e.b(0x8b); e.d(l.p); e.b(flag);		// or byte [p], flag
+	} else {
+		e.b(0xa3); e.d(l.p); e.b(~flag);	// and byte [p], ~flag
+	}
+}
+
+
+// set_flag emits mov byte [rbx+off], v for one of the flag fields.
+static void
+set_flag(Emitter &e, uint32_t off, uint8_t v)
+{
+	e.b(0xc6); e.b(0x83); e.d(off); e.b(v);
+}
+
+
+// jump32 emits a jcc/jmp rel32 to be patched later and returns the
+// location of the displacement.
+static uint8_t *
+jump32(Emitter &e, uint8_t cc)
+{
+	uint8_t	*disp;
+
+	if (cc == 0) {
+		e.b(0xe9);
+	} else {
+		e.b(0x0f); e.b(cc);
+	}
+	disp = e.p;
+	e.d(0);
+	return disp;
+}
+
+
+static void
+patch32(uint8_t *disp, uint8_t *target)
+{
+	int32_t	rel = (int32_t)(target - (disp + 4));
+
+	memcpy(disp, &rel, sizeof(rel));
+}
+
+
+// emit_register_op emits natively the register-only instructions that
+// need no memory access. It returns false for anything else.
+static bool
+emit_register_op(Emitter &e, const Layout &l, const DecodedInsn &in)
+{
+	switch (in.op) {
+	case 0xa9: e.b(0xb0); e.b(in.arg & 0xff); store8(e, l.a); break;
+	case 0xa2: e.b(0xb0); e.b(in.arg & 0xff); store8(e, l.x); break;
+	case 0xa0: e.b(0xb0); e.b(in.arg & 0xff); store8(e, l.y); break;
+	case 0xaa: load8(e, l.a); store8(e, l.x); break;	// TAX
+	case 0xa8: load8(e, l.a); store8(e, l.y); break;	// TAY
+	case 0x8a: load8(e, l.x); store8(e, l.a); break;	// TXA
+	case 0x98: load8(e, l.y); store8(e, l.a); break;	// TYA
+	case 0xe8: load8(e, l.x); e.b(0xfe); e.b(0xc0); store8(e, l.x); break;
+	case 0xc8: load8(e, l.y); e.b(0xfe); e.b(0xc0); store8(e, l.y); break;
+	case 0xca: load8(e, l.x); e.b(0xfe); e.b(0xc8); store8(e, l.x); break;
+	case 0x88: load8(e, l.y); e.b(0xfe); e.b(0xc8); store8(e, l.y); break;
+	case 0x18: set_flag(e, l.flag_c, 0); return true;	// CLC
+	case 0x38: set_flag(e, l.flag_c, 1); return true;	// SEC
+	case 0x58: flag_op(e, l, false, FLAG_INT_DISABLE); return true;
+	case 0x78: flag_op(e, l, true, FLAG_INT_DISABLE); return true;
+	case 0xb8: set_flag(e, l.flag_v, 0); return true;	// CLV
+	case 0xd8: flag_op(e, l, false, FLAG_DECIMAL); return true;
+	case 0xf8: flag_op(e, l, true, FLAG_DECIMAL); return true;
+	case 0xea: return true;					// NOP
+	default:
+		return false;
+	}
+
+	// Everything that loaded or computed a register leaves the
+	// result in al for the flags.
+	set_nz(e, l);
+	return true;
+}
+
+
+// branch_flag returns the offset of the flag field a branch opcode
+// tests and the bits to test in it, and whether the branch is taken
+// when any of those bits is set.
+static uint32_t
+branch_flag(const Layout &l, uint8_t op, uint8_t *mask, bool *when_set)
+{
+	*when_set = (op & 0x20) != 0;
+	switch (op >> 6) {
+	case 0:
+		*mask = 0x80;
+		return l.flag_n;
+	case 1:
+		*mask = 0x80;
+		return l.flag_v;
+	case 2:
+		*mask = 0x01;
+		return l.flag_c;
+	default:
+		// Z is set when flag_z is zero.
+		*mask = 0xff;
+		*when_set = !*when_set;
+		return l.flag_z;
+	}
+}
+
+
+/*
+ * jit_compile translates a decoded block into native code. Register
+ * and flag instructions and the block-ending branch are emitted inline;
+ * everything else calls the opcode's handler through its thunk, after
+ * which the code checks for a halt and for the block having been
+ * overwritten. Returns NULL if the arena is full.
+ */
+NativeBlock
+CPU::jit_compile(CodeBlock *blk)
+{
+	Emitter		 e;
+	Layout		 l;
+	uint8_t		*start;
+	uint8_t		*exit_true[BLOCK_MAX_INSNS];
+	uint8_t		*exit_false[BLOCK_MAX_INSNS];
+	size_t		 ntrue = 0, nfalse = 0, i;
+	uint32_t	 pending = 0, pending_cycles = 0, taken;
+	uint16_t	 next = blk->start, target;
+	uint8_t		*exit_t, *exit_f, *skip;
+	bool		 when_set;
+	uint8_t		 mask;
+	DecodedInsn	*in;
+
+	start = this->jit->begin();
+	if (start == NULL)
+		return NULL;
+	e.p = start;
+
+	l.a = (uint32_t)((char *)&this->a - (char *)this);
+	l.x = (uint32_t)((char *)&this->x - (char *)this);
+	l.y = (uint32_t)((char *)&this->y - (char *)this);
+	l.p = (uint32_t)((char *)&this->p - (char *)this);
+	l.flag_n = (uint32_t)((char *)&this->flag_n - (char *)this);
+	l.flag_z = (uint32_t)((char *)&this->flag_z - (char *)this);
+	l.flag_c = (uint32_t)((char *)&this->flag_c - (char *)this);
+	l.flag_v = (uint32_t)((char *)&this->flag_v - (char *)this);
+	l.pc = (uint32_t)((char *)&this->pc - (char *)this);
+	l.steps = (uint32_t)((char *)&this->steps - (char *)this);
+	l.cycles = (uint32_t)((char *)&this->cycles - (char *)this);
+
+	e.b(0x53);					// push rbx
+	e.b(0x48); e.b(0x89); e.b(0xfb);		// mov rbx, rdi
+
+	for (i = 0; i < blk->count; ++i) {
+		in = &blk->insns[i];
+		next += in->length;
+
+		if (emit_register_op(e, l, *in)) {
+			pending++;
+			pending_cycles += in->cycles;
+			continue;
+		}
+
+		if ((in->op & 0x1f) == 0x10) {
+			// Conditional branch; always the last instruction.
+			// The taken-branch penalty is known at compile time.
+			add_count(e, l.steps, pending + 1);
+			add_count(e, l.cycles, pending_cycles + in->cycles);
+			pending = pending_cycles = 0;
+			target = next + (int8_t)(in->arg & 0xff);
+			taken = 1 + (((target ^ next) & 0xff00) != 0);
+			load8(e, branch_flag(l, in->op, &mask, &when_set));
+			e.b(0xa8); e.b(mask);			// test al, mask
+			set_pc(e, l, next);
+			e.b(when_set ? 0x74 : 0x75); e.b(0);	// jz/jnz over
+			skip = e.p;
+			set_pc(e, l, target);
+			add_count(e, l.cycles, taken);
+			skip[-1] = (uint8_t)(e.p - skip);
+			exit_true[ntrue++] = jump32(e, 0);
+			break;
+		}
+
+		// The handler adds its own page-crossing penalty.
+		add_count(e, l.steps, pending + 1);
+		add_count(e, l.cycles, pending_cycles + in->cycles);
+		pending = pending_cycles = 0;
+		e.b(0x48); e.b(0x89); e.b(0xdf);	// mov rdi, rbx
+		e.b(0xbe); e.d(in->arg);		// mov esi, arg
+		e.b(0xba); e.d(next);			// mov edx, next
+		e.b(0x48); e.b(0xb8);			// mov rax, thunk
+		e.q((uint64_t)(uintptr_t)thunks[in->op]);
+		e.b(0xff); e.b(0xd0);			// call rax
+		e.b(0x84); e.b(0xc0);			// test al, al
+		exit_false[nfalse++] = jump32(e, 0x84);	// jz exit_false
+		e.b(0x48); e.b(0xb9);			// mov rcx, &invalidated
+		e.q((uint64_t)(uintptr_t)&this->blocks->invalidated);
+		e.b(0x80); e.b(0x39); e.b(0x00);	// cmp byte [rcx], 0
+		exit_true[ntrue++] = jump32(e, 0x85);	// jne exit_true
+	}
+
+	// Falling off the end of the block after native instructions: the
+	// PC still has to be moved on.
+	if (pending > 0) {
+		add_count(e, l.steps, pending);
+		add_count(e, l.cycles, pending_cycles);
+		set_pc(e, l, next);
+	}
+
+	exit_t = e.p;
+	e.b(0xb8); e.d(1);				// mov eax, 1
+	e.b(0x5b);					// pop rbx
+	e.b(0xc3);					// ret
+	exit_f = e.p;
+	e.b(0x31); e.b(0xc0);				// xor eax, eax
+	e.b(0x5b);					// pop rbx
+	e.b(0xc3);					// ret
+
+	for (i = 0; i < ntrue; ++i)
+		patch32(exit_true[i], exit_t);
+	for (i = 0; i < nfalse; ++i)
+		patch32(exit_false[i], exit_f);
+
+	return this->jit->commit(start, (size_t)(e.p - start));
+}
+
+
+#endif
+
+
+/*
+ * run_jit is the JIT execution engine. It works like the cached engine,
+ * but counts how often each block runs; once a block gets hot it is
+ * compiled and from then on runs as native code. Hosts without JIT
+ * support just run the cached engine. Native blocks run as a whole, so
+ * near the end of the step budget the block is interpreted instead.
+ */
+bool
+CPU::run_jit(size_t limit)
+{
+	CodeBlock	*blk;
+	bool		 limited = false;
+
+#if defined(__x86_64__)
+	if (!this->jit->available())
+		return this->run_cached(limit);
+
+	for (;;) {
+		blk = this->blocks->lookup(this->pc);
+		if (blk->count == 0 || blk->start != this->pc)
+			this->decode_block(blk, this->pc);
+
+		this->blocks->invalidated = false;
+		if (blk->native != NULL && limit - this->steps >= blk->count) {
+			if (!blk->native(this))
+				return false;
+		} else {
+			if (++blk->hits == JIT_THRESHOLD) {
+				blk->native = this->jit_compile(blk);
+				if (blk->native == NULL) {
+					// The arena is full; start it over.
+					this->blocks->drop_native();
+					this->jit->reset();
+					blk->native = this->jit_compile(blk);
+				}
+				if (blk->native != NULL)
+					continue;
+			}
+
+			if (!this->run_block(blk, limit, &limited))
+				return false;
+			if (limited)
+				return true;
+		}
+
+		if (blk->idle != IDLE_NONE && this->pc == blk->start &&
+		    !this->blocks->invalidated)
+			this->skip_idle(blk, limit);
+	}
+#else
+	(void)blk;
+	(void)limited;
+	return this->run_cached(limit);
+#endif
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __6502_JIT_H
+#define __6502_JIT_H
+
+
+#include <cstdint>
+#include <cstdlib>
+
+
+class CPU;
+
+
+// A NativeBlock is a compiled block. It returns false if the CPU halted.
+typedef bool	(*NativeBlock)(CPU *);
+
+
+// A block is compiled once it has been run JIT_THRESHOLD times.
+const uint32_t	JIT_THRESHOLD = 16;
+
+// Size of the executable arena; when it fills up, all compiled code is
+// thrown away and the arena reused.
+const size_t	JIT_ARENA_SIZE = 256 * 1024;
+
+// Upper bound on the native code emitted for one block.
+const size_t	JIT_MAX_BLOCK = 2048;
+
+
+// A JIT owns the executable arena that compiled blocks live in. The
+// arena is only ever writable or executable, never both: begin makes it
+// writable for emitting and commit flips it back to executable.
+class JIT {
+	private:
+		uint8_t		*arena;
+		size_t		 used;
+
+		JIT(const JIT &) = delete;
+		JIT &operator=(const JIT &) = delete;
+	public:
+		JIT();
+		~JIT();
+
+		bool available(void);
+		uint8_t *begin(void);
+		NativeBlock commit(uint8_t *, size_t);
+		void reset(void);
+};
+
+
+#endif
@@ -0,0 +1,981 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <cstring>
+
+#include "lockstep.h"
+#include "opcodes.h"
+
+
+// The lane loops are cloned for AVX2 and for the baseline instruction
+// set; the dynamic loader picks one when the library is loaded. The
+// clones need GNU ifuncs, so elsewhere there is only the baseline. GCC
+// only vectorizes loops at -O2 when it needs no run-time checks, which
+// rules out most of these, so they are built with the full cost model;
+// the register arrays never overlap, and the loops say so.
+#if defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define LOCKSTEP_SIMD	__attribute__((target_clones("avx2", "default")))
+#elif defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define LOCKSTEP_SIMD	__attribute__((target_clones("avx2", "default"), \
+			    optimize("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define LOCKSTEP_SIMD
+#endif
+
+#if defined(__GNUC__)
+#define LANES	__restrict__
+#else
+#define LANES
+#endif
+
+
+/*
+ * Each opcode has a lane operation saying how to run it for all the
+ * lanes at once, or LANE_SCALAR if it has to run one lane at a time.
+ * Loads, stores, and the ALU instructions have lane versions for the
+ * addressing modes whose address does not depend on memory (immediate
+ * through absolute,Y); the register instructions, flag instructions,
+ * branches, and JMP absolute have them outright. Everything touching
+ * the stack, going through a pointer, or writing back to memory after
+ * reading it runs scalar, as does ADC/SBC if any lane is in decimal
+ * mode.
+ */
+enum lane_kind {
+	LANE_SCALAR = 0,
+	LANE_LOAD,
+	LANE_STORE,
+	LANE_TRANSFER,
+	LANE_STEP,
+	LANE_AND,
+	LANE_ORA,
+	LANE_EOR,
+	LANE_ADC,
+	LANE_SBC,
+	LANE_COMPARE,
+	LANE_BIT,
+	LANE_ASL,
+	LANE_LSR,
+	LANE_ROL,
+	LANE_ROR,
+	LANE_FLAG,
+	LANE_NOP,
+	LANE_JMP,
+	LANE_BRANCH
+};
+
+enum lane_register {
+	REG_A = 0,
+	REG_X,
+	REG_Y,
+	REG_S
+};
+
+enum lane_flag {
+	LANE_N = 0,
+	LANE_Z,
+	LANE_C,
+	LANE_V
+};
+
+
+// A LaneOp describes an opcode's lane operation. reg is the register
+// written, or the flag set or tested. src is the register read by a
+// transfer, or the bits of the flag field a branch tests. value is
+// the increment for INX and friends, the flag value for CLC and
+// friends, whether a transfer sets N and Z, and whether a branch is
+// taken when the tested bits are set.
+struct LaneOp {
+	lane_kind	kind;
+	addr_mode	mode;
+	uint8_t		reg;
+	uint8_t		src;
+	uint8_t		value;
+	uint8_t		length;
+	uint8_t		cycles;
+};
+
+
+constexpr bool
+same_name(const char *a, const char *b)
+{
+	return *a == *b && (*a == '\0' || same_name(a + 1, b + 1));
+}
+
+
+constexpr LaneOp
+lane(lane_kind kind, addr_mode mode, uint8_t cycles, uint8_t reg = 0,
+    uint8_t src = 0, uint8_t value = 0)
+{
+	return LaneOp{kind, mode, reg, src, value, mode_length(mode), cycles};
+}
+
+
+// lane_operand is lane for an instruction with a memory operand: only
+// the addressing modes without pointers get the lane version.
+constexpr LaneOp
+lane_operand(lane_kind kind, addr_mode mode, uint8_t cycles,
+    uint8_t reg = 0)
+{
+	return lane(mode >= MODE_IMM && mode <= MODE_ABSY ? kind : LANE_SCALAR,
+	    mode, cycles, reg);
+}
+
+
+constexpr LaneOp
+lane_op(const char *i, addr_mode m, uint8_t c)
+{
+	return
+	    same_name(i, "LDA") ? lane_operand(LANE_LOAD, m, c, REG_A) :
+	    same_name(i, "LDX") ? lane_operand(LANE_LOAD, m, c, REG_X) :
+	    same_name(i, "LDY") ? lane_operand(LANE_LOAD, m, c, REG_Y) :
+	    same_name(i, "STA") ? lane_operand(LANE_STORE, m, c, REG_A) :
+	    same_name(i, "STX") ? lane_operand(LANE_STORE, m, c, REG_X) :
+	    same_name(i, "STY") ? lane_operand(LANE_STORE, m, c, REG_Y) :
+	    same_name(i, "AND") ? lane_operand(LANE_AND, m, c) :
+	    same_name(i, "ORA") ? lane_operand(LANE_ORA, m, c) :
+	    same_name(i, "EOR") ? lane_operand(LANE_EOR, m, c) :
+	    same_name(i, "ADC") ? lane_operand(LANE_ADC, m, c) :
+	    same_name(i, "SBC") ? lane_operand(LANE_SBC, m, c) :
+	    same_name(i, "CMP") ? lane_operand(LANE_COMPARE, m, c, REG_A) :
+	    same_name(i, "CPX") ? lane_operand(LANE_COMPARE, m, c, REG_X) :
+	    same_name(i, "CPY") ? lane_operand(LANE_COMPARE, m, c, REG_Y) :
+	    same_name(i, "BIT") ? lane_operand(LANE_BIT, m, c) :
+	    same_name(i, "TAX") ? lane(LANE_TRANSFER, m, c, REG_X, REG_A, 1) :
+	    same_name(i, "TAY") ? lane(LANE_TRANSFER, m, c, REG_Y, REG_A, 1) :
+	    same_name(i, "TSX") ? lane(LANE_TRANSFER, m, c, REG_X, REG_S, 1) :
+	    same_name(i, "TXA") ? lane(LANE_TRANSFER, m, c, REG_A, REG_X, 1) :
+	    same_name(i, "TXS") ? lane(LANE_TRANSFER, m, c, REG_S, REG_X, 0) :
+	    same_name(i, "TYA") ? lane(LANE_TRANSFER, m, c, REG_A, REG_Y, 1) :
+	    same_name(i, "INX") ? lane(LANE_STEP, m, c, REG_X, 0, 1) :
+	    same_name(i, "INY") ? lane(LANE_STEP, m, c, REG_Y, 0, 1) :
+	    same_name(i, "DEX") ? lane(LANE_STEP, m, c, REG_X, 0, 0xff) :
+	    same_name(i, "DEY") ? lane(LANE_STEP, m, c, REG_Y, 0, 0xff) :
+	    same_name(i, "ASL") && m == MODE_ACC ? lane(LANE_ASL, m, c) :
+	    same_name(i, "LSR") && m == MODE_ACC ? lane(LANE_LSR, m, c) :
+	    same_name(i, "ROL") && m == MODE_ACC ? lane(LANE_ROL, m, c) :
+	    same_name(i, "ROR") && m == MODE_ACC ? lane(LANE_ROR, m, c) :
+	    same_name(i, "CLC") ? lane(LANE_FLAG, m, c, LANE_C, 0, 0) :
+	    same_name(i, "SEC") ? lane(LANE_FLAG, m, c, LANE_C, 0, 1) :
+	    same_name(i, "CLV") ? lane(LANE_FLAG, m, c, LANE_V, 0, 0) :
+	    same_name(i, "NOP") ? lane(LANE_NOP, m, c) :
+	    same_name(i, "JMP") && m == MODE_ABS ? lane(LANE_JMP, m, c) :
+	    same_name(i, "BCC") ? lane(LANE_BRANCH, m, c, LANE_C, 0x01, 0) :
+	    same_name(i, "BCS") ? lane(LANE_BRANCH, m, c, LANE_C, 0x01, 1) :
+	    same_name(i, "BEQ") ? lane(LANE_BRANCH, m, c, LANE_Z, 0xff, 0) :
+	    same_name(i, "BNE") ? lane(LANE_BRANCH, m, c, LANE_Z, 0xff, 1) :
+	    same_name(i, "BMI") ? lane(LANE_BRANCH, m, c, LANE_N, 0x80, 1) :
+	    same_name(i, "BPL") ? lane(LANE_BRANCH, m, c, LANE_N, 0x80, 0) :
+	    same_name(i, "BVS") ? lane(LANE_BRANCH, m, c, LANE_V, 0x80, 1) :
+	    same_name(i, "BVC") ? lane(LANE_BRANCH, m, c, LANE_V, 0x80, 0) :
+	    lane(LANE_SCALAR, m, c);
+}
+
+
+#define LANE_ENTRY(op, insn, mode, cycles)	\
+	lane_op(#insn, MODE_##mode, cycles),
+static const LaneOp	lane_ops[256] = {
+	K6502_OPCODES(LANE_ENTRY)
+};
+#undef LANE_ENTRY
+
+
+// Code pages are CODE_UNKNOWN until checked, then CODE_SAME or
+// CODE_DIFFERS until the next write to them in any lane.
+enum {
+	CODE_UNKNOWN = 0,
+	CODE_SAME,
+	CODE_DIFFERS
+};
+
+
+/*
+ * The lane loops. They run over every lane, stopped or not, since a
+ * stopped lane's registers are scratch; only the loops that count or
+ * look for something take the live mask.
+ */
+
+
+LOCKSTEP_SIMD static void
+lanes_load(uint8_t *LANES r, uint8_t *LANES fn, uint8_t *LANES fz,
+    const uint8_t *LANES v, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		r[i] = v[i];
+		fn[i] = v[i];
+		fz[i] = v[i];
+	}
+}
+
+
+LOCKSTEP_SIMD static void
+lanes_step(uint8_t *LANES r, uint8_t *LANES fn, uint8_t *LANES fz,
+    uint8_t delta, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		r[i] += delta;
+		fn[i] = r[i];
+		fz[i] = r[i];
+	}
+}
+
+
+LOCKSTEP_SIMD static void
+lanes_logic(lane_kind kind, uint8_t *LANES a, uint8_t *LANES fn,
+    uint8_t *LANES fz, const uint8_t *LANES v, size_t n)
+{
+	size_t	i;
+
+	switch (kind) {
+	case LANE_AND:
+		for (i = 0; i < n; ++i)
+			a[i] &= v[i];
+		break;
+	case LANE_ORA:
+		for (i = 0; i < n; ++i)
+			a[i] |= v[i];
+		break;
+	default:
+		for (i = 0; i < n; ++i)
+			a[i] ^= v[i];
+		break;
+	}
+	memcpy(fn, a, n);
+	memcpy(fz, a, n);
+}
+
+
+// lanes_add is CPU::add; SBC adds the complement of its operand, so it
+// passes 0xff as inv.
+LOCKSTEP_SIMD static void
+lanes_add(uint8_t *LANES a, uint8_t *LANES fn, uint8_t *LANES fz,
+    uint8_t *LANES fc, uint8_t *LANES fv, const uint8_t *LANES v, uint8_t inv,
+    size_t n)
+{
+	uint16_t	sum;
+	uint8_t		b;
+	size_t		i;
+
+	for (i = 0; i < n; ++i) {
+		b = v[i] ^ inv;
+		sum = a[i] + b + fc[i];
+		fc[i] = (uint8_t)(sum >> 8);
+		fv[i] = (uint8_t)(~(a[i] ^ b) & (a[i] ^ sum));
+		a[i] = (uint8_t)sum;
+		fn[i] = (uint8_t)sum;
+		fz[i] = (uint8_t)sum;
+	}
+}
+
+
+LOCKSTEP_SIMD static void
+lanes_compare(const uint8_t *LANES r, uint8_t *LANES fn, uint8_t *LANES fz,
+    uint8_t *LANES fc, const uint8_t *LANES v, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		fc[i] = r[i] >= v[i];
+		fn[i] = (uint8_t)(r[i] - v[i]);
+		fz[i] = (uint8_t)(r[i] - v[i]);
+	}
+}
+
+
+LOCKSTEP_SIMD static void
+lanes_bit(const uint8_t *LANES a, uint8_t *LANES fn, uint8_t *LANES fz,
+    uint8_t *LANES fv, const uint8_t *LANES v, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		fn[i] = v[i];
+		fv[i] = (uint8_t)(v[i] << 1);
+		fz[i] = a[i] & v[i];
+	}
+}
+
+
+LOCKSTEP_SIMD static void
+lanes_shift(lane_kind kind, uint8_t *LANES a, uint8_t *LANES fn,
+    uint8_t *LANES fz, uint8_t *LANES fc, size_t n)
+{
+	uint8_t	carry;
+	size_t	i;
+
+	switch (kind) {
+	case LANE_ASL:
+		for (i = 0; i < n; ++i) {
+			fc[i] = a[i] >> 7;
+			a[i] <<= 1;
+		}
+		break;
+	case LANE_LSR:
+		for (i = 0; i < n; ++i) {
+			fc[i] = a[i] & 1;
+			a[i] >>= 1;
+		}
+		break;
+	case LANE_ROL:
+		for (i = 0; i < n; ++i) {
+			carry = fc[i];
+			fc[i] = a[i] >> 7;
+			a[i] = (uint8_t)((a[i] << 1) | carry);
+		}
+		break;
+	default:
+		for (i = 0; i < n; ++i) {
+			carry = fc[i];
+			fc[i] = a[i] & 1;
+			a[i] = (uint8_t)((a[i] >> 1) | (carry << 7));
+		}
+		break;
+	}
+	memcpy(fn, a, n);
+	memcpy(fz, a, n);
+}
+
+
+// lanes_taken counts the running lanes that take a branch on the flag
+// field f.
+LOCKSTEP_SIMD static size_t
+lanes_taken(const uint8_t *LANES f, uint8_t bits, uint8_t want,
+    const uint8_t *LANES live, size_t n)
+{
+	size_t	i, taken = 0;
+
+	for (i = 0; i < n; ++i)
+		taken += (((f[i] & bits) != 0) == want) & live[i] & 1;
+	return taken;
+}
+
+
+// lanes_branch moves each lane to target or next, depending on whether
+// it takes the branch, charging the taken-branch penalty.
+LOCKSTEP_SIMD static void
+lanes_branch(uint16_t *LANES pc, size_t *LANES cycles,
+    const uint8_t *LANES f, uint8_t bits, uint8_t want, uint16_t next,
+    uint16_t target, uint8_t penalty, size_t n)
+{
+	bool	taken;
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		taken = ((f[i] & bits) != 0) == want;
+		pc[i] = taken ? target : next;
+		cycles[i] += taken ? penalty : 0;
+	}
+}
+
+
+LOCKSTEP_SIMD static void
+lanes_count(size_t *LANES steps, size_t *LANES cycles, uint8_t ncycles,
+    size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		steps[i]++;
+		cycles[i] += ncycles;
+	}
+}
+
+
+// lanes_any returns true if a running lane has any of bits set in p.
+LOCKSTEP_SIMD static bool
+lanes_any(const uint8_t *LANES p, const uint8_t *LANES live, uint8_t bits,
+    size_t n)
+{
+	uint8_t	any = 0;
+	size_t	i;
+
+	for (i = 0; i < n; ++i)
+		any |= p[i] & live[i];
+	return (any & bits) != 0;
+}
+
+
+// lane_address is CPU::address for the modes with lane versions.
+static inline uint16_t
+lane_address(addr_mode mode, uint16_t arg, uint8_t x, uint8_t y)
+{
+	switch (mode) {
+	case MODE_ZP:
+		return arg & 0xff;
+	case MODE_ZPX:
+		return (arg + x) & 0xff;
+	case MODE_ZPY:
+		return (arg + y) & 0xff;
+	case MODE_ABSX:
+		return (uint16_t)(arg + x);
+	case MODE_ABSY:
+		return (uint16_t)(arg + y);
+	default:
+		return arg;
+	}
+}
+
+
+// Lockstep creates lanes CPUs with the default memory size (128k).
+Lockstep::Lockstep(size_t lanes)
+{
+	this->init(lanes, DEFAULT_MEM);
+}
+
+
+// Lockstep creates lanes CPUs, each with the given amount of memory.
+Lockstep::Lockstep(size_t lanes, size_t memory)
+{
+	this->init(lanes, memory);
+}
+
+
+void
+Lockstep::init(size_t lanes, size_t memory)
+{
+	size_t	i;
+
+	this->n = lanes;
+	this->cpus = new CPU *[lanes];
+	for (i = 0; i < lanes; ++i) {
+		this->cpus[i] = new CPU(memory);
+		this->cpus[i]->ram.set_watcher(this);
+	}
+
+	this->a = new uint8_t[lanes]();
+	this->x = new uint8_t[lanes]();
+	this->y = new uint8_t[lanes]();
+	this->s = new uint8_t[lanes]();
+	this->p = new uint8_t[lanes]();
+	this->flag_n = new uint8_t[lanes]();
+	this->flag_z = new uint8_t[lanes]();
+	this->flag_c = new uint8_t[lanes]();
+	this->flag_v = new uint8_t[lanes]();
+	this->pc = new uint16_t[lanes]();
+	this->steps = new size_t[lanes]();
+	this->cycles = new size_t[lanes]();
+	this->limit = new size_t[lanes]();
+	this->live = new uint8_t[lanes]();
+	this->operand = new uint8_t[lanes]();
+	this->results = new RunResult[lanes]();
+
+	this->nlive = 0;
+	this->together = false;
+	this->at = 0;
+	this->pending_steps = 0;
+	this->pending_cycles = 0;
+	this->left = 0;
+	this->vector_steps = 0;
+	memset(this->code, CODE_UNKNOWN, sizeof(this->code));
+}
+
+
+Lockstep::~Lockstep()
+{
+	size_t	i;
+
+	for (i = 0; i < this->n; ++i)
+		delete this->cpus[i];
+	delete[] this->cpus;
+	delete[] this->a;
+	delete[] this->x;
+	delete[] this->y;
+	delete[] this->s;
+	delete[] this->p;
+	delete[] this->flag_n;
+	delete[] this->flag_z;
+	delete[] this->flag_c;
+	delete[] this->flag_v;
+	delete[] this->pc;
+	delete[] this->steps;
+	delete[] this->cycles;
+	delete[] this->limit;
+	delete[] this->live;
+	delete[] this->operand;
+	delete[] this->results;
+}
+
+
+size_t
+Lockstep::lanes()
+{
+	return this->n;
+}
+
+
+CPU &
+Lockstep::lane(size_t i)
+{
+	return *this->cpus[i];
+}
+
+
+void
+Lockstep::load(const void *src, uint16_t offset, uint16_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < this->n; ++i)
+		this->cpus[i]->load(src, offset, len);
+}
+
+
+void
+Lockstep::set_entry(uint16_t entry)
+{
+	size_t	i;
+
+	for (i = 0; i < this->n; ++i)
+		this->cpus[i]->set_entry(entry);
+}
+
+
+// load_lane copies a lane's CPU state into the register file.
+void
+Lockstep::load_lane(size_t i)
+{
+	CPU	*cpu = this->cpus[i];
+
+	this->a[i] = cpu->a;
+	this->x[i] = cpu->x;
+	this->y[i] = cpu->y;
+	this->s[i] = cpu->s;
+	this->p[i] = cpu->p;
+	this->flag_n[i] = cpu->flag_n;
+	this->flag_z[i] = cpu->flag_z;
+	this->flag_c[i] = cpu->flag_c;
+	this->flag_v[i] = cpu->flag_v;
+	this->pc[i] = cpu->pc;
+	this->steps[i] = cpu->steps;
+	this->cycles[i] = cpu->cycles;
+}
+
+
+// store_lane copies a lane's registers back into its CPU.
+void
+Lockstep::store_lane(size_t i)
+{
+	CPU	*cpu = this->cpus[i];
+
+	cpu->a = this->a[i];
+	cpu->x = this->x[i];
+	cpu->y = this->y[i];
+	cpu->s = this->s[i];
+	cpu->p = this->p[i];
+	cpu->flag_n = this->flag_n[i];
+	cpu->flag_z = this->flag_z[i];
+	cpu->flag_c = this->flag_c[i];
+	cpu->flag_v = this->flag_v[i];
+	cpu->pc = this->pc[i];
+	cpu->steps = this->steps[i];
+	cpu->cycles = this->cycles[i];
+}
+
+
+// stop takes a lane out of the run, leaving its state in its CPU. The
+// lane's registers must be up to date.
+void
+Lockstep::stop(size_t i, exit_reason reason)
+{
+	this->store_lane(i);
+	this->live[i] = 0;
+	this->nlive--;
+	this->results[i].reason = reason;
+	this->results[i].steps = this->steps[i] - this->results[i].steps;
+	this->results[i].cycles = this->cycles[i] - this->results[i].cycles;
+}
+
+
+// flush brings the registers of lanes that are together up to date.
+void
+Lockstep::flush()
+{
+	size_t	i;
+
+	if (!this->together)
+		return;
+	for (i = 0; i < this->n; ++i) {
+		if (!this->live[i])
+			continue;
+		this->pc[i] = this->at;
+		this->steps[i] += this->pending_steps;
+		this->cycles[i] += this->pending_cycles;
+	}
+	this->pending_steps = 0;
+	this->pending_cycles = 0;
+}
+
+
+// regroup looks at where the running lanes are, after their registers
+// have been brought up to date, to see if they are together again.
+void
+Lockstep::regroup()
+{
+	bool	first = true;
+	size_t	i;
+
+	this->together = this->nlive > 0;
+	this->left = SIZE_MAX;
+	for (i = 0; i < this->n; ++i) {
+		if (!this->live[i])
+			continue;
+		if (first)
+			this->at = this->pc[i];
+		first = false;
+		if (this->pc[i] != this->at)
+			this->together = false;
+		if (this->limit[i] - this->steps[i] < this->left)
+			this->left = this->limit[i] - this->steps[i];
+	}
+}
+
+
+// expire stops the lanes that have used up their budget.
+void
+Lockstep::expire()
+{
+	size_t	i;
+
+	this->flush();
+	for (i = 0; i < this->n; ++i) {
+		if (this->live[i] && this->steps[i] == this->limit[i])
+			this->stop(i, EXIT_BUDGET);
+	}
+	this->regroup();
+}
+
+
+// step_lane runs one instruction on one lane with the CPU's handlers.
+void
+Lockstep::step_lane(size_t i)
+{
+	CPU	*cpu = this->cpus[i];
+	bool	 running;
+
+	this->store_lane(i);
+	running = cpu->execute();
+	this->load_lane(i);
+	if (!running)
+		this->stop(i, cpu->halt_reason);
+	else if (this->steps[i] == this->limit[i])
+		this->stop(i, EXIT_BUDGET);
+}
+
+
+// step_all runs one instruction on every lane, one lane at a time.
+void
+Lockstep::step_all()
+{
+	size_t	i;
+
+	this->flush();
+	for (i = 0; i < this->n; ++i) {
+		if (this->live[i])
+			this->step_lane(i);
+	}
+	this->regroup();
+}
+
+
+// step_lowest runs one instruction on each of the lanes with the lowest
+// PC. Loops mostly branch backwards, so lanes that are behind catch up
+// with the ones that left a loop first.
+void
+Lockstep::step_lowest()
+{
+	uint16_t	lowest = 0xffff;
+	size_t		i;
+
+	for (i = 0; i < this->n; ++i) {
+		if (this->live[i] && this->pc[i] < lowest)
+			lowest = this->pc[i];
+	}
+	for (i = 0; i < this->n; ++i) {
+		if (this->live[i] && this->pc[i] == lowest)
+			this->step_lane(i);
+	}
+	this->regroup();
+}
+
+
+// same_page checks whether a page holds the same bytes in every lane.
+// The answer holds until the page is next written in any lane.
+bool
+Lockstep::same_page(uint8_t page)
+{
+	unsigned char	first[PAGE_SIZE], other[PAGE_SIZE];
+	size_t		i;
+
+	if (this->code[page] != CODE_UNKNOWN)
+		return this->code[page] == CODE_SAME;
+
+	this->code[page] = CODE_SAME;
+	this->cpus[0]->ram.read_page(page, first);
+	for (i = 1; i < this->n; ++i) {
+		this->cpus[i]->ram.read_page(page, other);
+		if (memcmp(first, other, PAGE_SIZE) != 0) {
+			this->code[page] = CODE_DIFFERS;
+			break;
+		}
+	}
+	for (i = 0; i < this->n; ++i)
+		this->cpus[i]->ram.watch(page);
+	return this->code[page] == CODE_SAME;
+}
+
+
+// same_code checks whether the instruction at pc is the same in every
+// lane.
+bool
+Lockstep::same_code(uint16_t addr)
+{
+	return this->same_page(addr >> 8) &&
+	    this->same_page((uint16_t)(addr + 2) >> 8);
+}
+
+
+void
+Lockstep::written(uint8_t page)
+{
+	this->code[page] = CODE_UNKNOWN;
+}
+
+
+// gather reads each running lane's operand for an instruction. Indexed
+// reads that cross a page cost the lane an extra cycle.
+void
+Lockstep::gather(addr_mode mode, uint16_t arg)
+{
+	uint8_t	index;
+	size_t	i;
+
+	if (mode == MODE_IMM) {
+		memset(this->operand, arg & 0xff, this->n);
+		return;
+	}
+
+	for (i = 0; i < this->n; ++i) {
+		if (!this->live[i])
+			continue;
+		index = mode == MODE_ABSX ? this->x[i] :
+		    mode == MODE_ABSY ? this->y[i] : 0;
+		this->cycles[i] += ((arg & 0xff) + index) >> 8;
+		this->operand[i] = this->cpus[i]->ram.peek(
+		    lane_address(mode, arg, this->x[i], this->y[i]));
+	}
+}
+
+
+// scatter writes each running lane's value of a register.
+void
+Lockstep::scatter(addr_mode mode, uint16_t arg, const uint8_t *r)
+{
+	size_t	i;
+
+	for (i = 0; i < this->n; ++i) {
+		if (!this->live[i])
+			continue;
+		this->cpus[i]->ram.poke(
+		    lane_address(mode, arg, this->x[i], this->y[i]), r[i]);
+	}
+}
+
+
+// step_lanes runs an instruction on every lane at once. It returns
+// false, having done nothing, if the instruction has to run one lane at
+// a time.
+bool
+Lockstep::step_lanes(uint32_t word)
+{
+	const LaneOp	&op = lane_ops[word & 0xff];
+	uint16_t	 arg = word >> 8;
+	uint16_t	 next = this->at + op.length;
+	uint16_t	 target;
+	uint8_t		*regs[] = {this->a, this->x, this->y, this->s};
+	uint8_t		*flags[] = {this->flag_n, this->flag_z, this->flag_c,
+			     this->flag_v};
+	uint8_t		 penalty;
+	size_t		 taken;
+
+	switch (op.kind) {
+	case LANE_SCALAR:
+		return false;
+	case LANE_ADC:
+	case LANE_SBC:
+		if (lanes_any(this->p, this->live, FLAG_DECIMAL, this->n))
+			return false;
+		break;
+	default:
+		break;
+	}
+
+	switch (op.kind) {
+	case LANE_LOAD:
+	case LANE_AND:
+	case LANE_ORA:
+	case LANE_EOR:
+	case LANE_ADC:
+	case LANE_SBC:
+	case LANE_COMPARE:
+	case LANE_BIT:
+		this->gather(op.mode, arg);
+		break;
+	default:
+		break;
+	}
+
+	switch (op.kind) {
+	case LANE_LOAD:
+		lanes_load(regs[op.reg], this->flag_n, this->flag_z,
+		    this->operand, this->n);
+		break;
+	case LANE_STORE:
+		this->scatter(op.mode, arg, regs[op.reg]);
+		break;
+	case LANE_TRANSFER:
+		if (op.value)
+			lanes_load(regs[op.reg], this->flag_n, this->flag_z,
+			    regs[op.src], this->n);
+		else
+			memcpy(regs[op.reg], regs[op.src], this->n);
+		break;
+	case LANE_STEP:
+		lanes_step(regs[op.reg], this->flag_n, this->flag_z, op.value,
+		    this->n);
+		break;
+	case LANE_AND:
+	case LANE_ORA:
+	case LANE_EOR:
+		lanes_logic(op.kind, this->a, this->flag_n, this->flag_z,
+		    this->operand, this->n);
+		break;
+	case LANE_ADC:
+	case LANE_SBC:
+		lanes_add(this->a, this->flag_n, this->flag_z, this->flag_c,
+		    this->flag_v, this->operand,
+		    op.kind == LANE_SBC ? 0xff : 0, this->n);
+		break;
+	case LANE_COMPARE:
+		lanes_compare(regs[op.reg], this->flag_n, this->flag_z,
+		    this->flag_c, this->operand, this->n);
+		break;
+	case LANE_BIT:
+		lanes_bit(this->a, this->flag_n, this->flag_z, this->flag_v,
+		    this->operand, this->n);
+		break;
+	case LANE_ASL:
+	case LANE_LSR:
+	case LANE_ROL:
+	case LANE_ROR:
+		lanes_shift(op.kind, this->a, this->flag_n, this->flag_z,
+		    this->flag_c, this->n);
+		break;
+	case LANE_FLAG:
+		memset(flags[op.reg], op.value, this->n);
+		break;
+	case LANE_JMP:
+		next = arg;
+		break;
+	case LANE_BRANCH:
+		target = next + (int8_t)(arg & 0xff);
+		penalty = 1 + ((target ^ next) >> 8 != 0);
+		taken = lanes_taken(flags[op.reg], op.src, op.value,
+		    this->live, this->n);
+		if (taken == this->nlive) {
+			next = target;
+			this->pending_cycles += penalty;
+		} else if (taken != 0) {
+			// The lanes split up here.
+			this->flush();
+			this->together = false;
+			lanes_branch(this->pc, this->cycles, flags[op.reg],
+			    op.src, op.value, next, target, penalty, this->n);
+			lanes_count(this->steps, this->cycles, op.cycles,
+			    this->n);
+			this->vector_steps += this->nlive;
+			this->expire();
+			return true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	this->at = next;
+	this->pending_steps++;
+	this->pending_cycles += op.cycles;
+	this->left--;
+	this->vector_steps += this->nlive;
+	return true;
+}
+
+
+size_t
+Lockstep::run_for(size_t budget)
+{
+	size_t	i, total = 0;
+
+	memset(this->code, CODE_UNKNOWN, sizeof(this->code));
+	for (i = 0; i < this->n; ++i) {
+		this->load_lane(i);
+		this->results[i].reason = EXIT_BUDGET;
+		this->results[i].steps = this->steps[i];
+		this->results[i].cycles = this->cycles[i];
+		this->limit[i] = this->steps[i] + budget;
+		if (this->limit[i] < this->steps[i])
+			this->limit[i] = SIZE_MAX;
+		this->live[i] = 0xff;
+	}
+	this->nlive = this->n;
+	this->together = false;
+	this->pending_steps = 0;
+	this->pending_cycles = 0;
+	this->expire();
+
+	while (this->nlive > 0) {
+		if (!this->together) {
+			this->step_lowest();
+		} else if (this->left == 0) {
+			this->expire();
+		} else if (!this->same_code(this->at) ||
+		    !this->step_lanes(this->cpus[0]->ram.fetch(this->at))) {
+			this->step_all();
+		}
+	}
+
+	for (i = 0; i < this->n; ++i)
+		total += this->results[i].steps;
+	return total;
+}
+
+
+RunResult
+Lockstep::result(size_t i)
+{
+	return this->results[i];
+}
+
+
+size_t
+Lockstep::get_lockstep_steps()
+{
+	return this->vector_steps;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#ifndef __6502_LOCKSTEP_H
+#define __6502_LOCKSTEP_H
+
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "cpu.h"
+#include "ram.h"
+
+
+/*
+ * A Lockstep runs many copies of a program side by side, one per lane,
+ * for sweeps and fuzzing over different inputs. Each lane is a CPU with
+ * its own memory, but while a run is in progress the registers of all
+ * the lanes are kept in arrays, one per register. As long as every
+ * running lane is at the same PC, and the code there is the same in all
+ * of them, an instruction is decoded once and executed for every lane
+ * by loops over those arrays, which are compiled for AVX2 as well as
+ * for the baseline instruction set and picked between at load time.
+ * Instructions without a lane version, and lanes whose branches went
+ * different ways, run one lane at a time through the CPU's own
+ * handlers, lowest PC first, until the lanes meet up again.
+ *
+ * Lanes run without trace sinks or breakpoints. Set up each lane's
+ * memory and registers through lane() between runs.
+ */
+class Lockstep : public PageWatcher {
+	private:
+		size_t		  n;
+		CPU		**cpus;
+
+		// The register file. Lanes that have stopped keep their
+		// state in their CPU; their entries here are scratch.
+		uint8_t		 *a;
+		uint8_t		 *x;
+		uint8_t		 *y;
+		uint8_t		 *s;
+		uint8_t		 *p;
+		uint8_t		 *flag_n;
+		uint8_t		 *flag_z;
+		uint8_t		 *flag_c;
+		uint8_t		 *flag_v;
+		uint16_t	 *pc;
+		size_t		 *steps;
+		size_t		 *cycles;
+		size_t		 *limit;
+		uint8_t		 *live;
+		uint8_t		 *operand;
+		RunResult	 *results;
+
+		// While the lanes are together, their PC is at and the
+		// steps and cycles they have all taken since their
+		// arrays were brought up to date are pending; left is
+		// how many more steps they can take before one of them
+		// reaches its limit.
+		size_t		  nlive;
+		bool		  together;
+		uint16_t	  at;
+		size_t		  pending_steps;
+		size_t		  pending_cycles;
+		size_t		  left;
+		size_t		  vector_steps;
+
+		// code says whether each page has been checked to be the
+		// same in every lane (and is watched for writes since).
+		uint8_t		  code[NPAGES];
+
+		Lockstep(const Lockstep &) = delete;
+		Lockstep &operator=(const Lockstep &) = delete;
+
+		void init(size_t, size_t);
+		void load_lane(size_t);
+		void store_lane(size_t);
+		void stop(size_t, exit_reason);
+		void flush(void);
+		void regroup(void);
+		void expire(void);
+		void step_lane(size_t);
+		void step_all(void);
+		void step_lowest(void);
+		bool same_page(uint8_t);
+		bool same_code(uint16_t);
+		bool step_lanes(uint32_t);
+		void gather(addr_mode, uint16_t);
+		void scatter(addr_mode, uint16_t, const uint8_t *);
+	public:
+		Lockstep(size_t);
+		Lockstep(size_t, size_t);
+		~Lockstep();
+
+		size_t lanes(void);
+		CPU &lane(size_t);
+
+		// load copies a memory image into every lane, and
+		// set_entry points every lane's PC at the same address.
+		void load(const void *, uint16_t, uint16_t);
+		void set_entry(uint16_t);
+
+		// run_for runs every lane for up to budget instructions
+		// and returns the number of instructions run, over all
+		// lanes. result says how each lane's run ended.
+		size_t run_for(size_t);
+		RunResult result(size_t);
+
+		// get_lockstep_steps counts the instructions, over all
+		// lanes, that were run together.
+		size_t get_lockstep_steps(void);
+
+		void written(uint8_t);
+};
+
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * microbench times each kind of instruction on its own, so that slow
+ * instruction classes stand out. Every case is a tight loop whose body
+ * is 16 copies of one instruction (or pair of instructions), run 4096
+ * times; the same loop with an empty body is timed too and subtracted,
+ * leaving the cost of the instruction alone. The cases are every
+ * documented opcode that can run straight through in a loop, all of
+ * their addressing modes included, plus the ones that cannot: branches
+ * taken and not taken, JMP, JSR/RTS, and the stack operations in push
+ * and pull pairs.
+ *
+ * Results are tab-separated under a header line:
+ *
+ *	case engine cycles ns_per_insn baseline_ns status
+ *
+ * cycles is the emulated cycles the instruction takes and ns_per_insn
+ * the best time per instruction over the samples. Given a baseline (a
+ * file of earlier results, as written with -o), each case is compared
+ * with it: status is "regressed" if the case got slower by more than
+ * the tolerance, and the exit status is then 1.
+ *
+ * usage: microbench [-b baseline] [-o output] [-e engine] [-n samples]
+ *                   [-m min_ms] [-t tolerance_pct]
+ */
+
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "disasm.h"
+#include "opcodes.h"
+
+
+// Copies of the body in each pass of the loop, and passes in a run.
+static const size_t	COPIES = 16;
+static const size_t	PASSES = 16 * 256;
+
+// Where the loop keeps its data: operands at $10 and $0200, a pointer
+// at $40 to $0400 for the indirect modes (X is 1 and Y is 2), pointers
+// for JMP ($nnnn) at $0280, and the loop counters at $F0 and $F1.
+static const uint16_t	PROGRAM = 0x300;
+static const uint16_t	JMP_POINTERS = 0x280;
+
+
+// How a case's body is laid out. Most bodies are the same bytes in
+// every copy; jumps and calls depend on where the copy is.
+enum body_kind {
+	BODY_PLAIN = 0,
+	BODY_JMP,
+	BODY_JMP_IND,
+	BODY_JSR
+};
+
+
+// A MicroCase is one row of the matrix.
+struct MicroCase {
+	std::string	name;
+	body_kind	kind;
+	unsigned char	body[4];
+	size_t		len;
+	size_t		insns;
+};
+
+
+// The operand bytes each addressing mode is given.
+static size_t
+operands(addr_mode mode, unsigned char *out)
+{
+	switch (mode) {
+	case MODE_IMM:
+		out[0] = 0x55;
+		return 1;
+	case MODE_ZP:
+	case MODE_ZPX:
+	case MODE_ZPY:
+		out[0] = 0x10;
+		return 1;
+	case MODE_ABS:
+	case MODE_ABSX:
+	case MODE_ABSY:
+		out[0] = 0x00;
+		out[1] = 0x02;
+		return 2;
+	case MODE_IIZPX:
+		out[0] = 0x3f;
+		return 1;
+	case MODE_IIZPY:
+		out[0] = 0x40;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+// straight returns true for instructions that run straight on to the
+// next one and leave the loop and the stack alone.
+static bool
+straight(const char *insn)
+{
+	static const char	*skip[] = {
+		"BRK", "ILL", "RTI", "RTS", "JSR", "JMP", "PHA", "PLA",
+		"PHP", "PLP", "BCC", "BCS", "BEQ", "BMI", "BNE", "BPL",
+		"BVC", "BVS"
+	};
+	size_t			 i;
+
+	for (i = 0; i < sizeof(skip) / sizeof(skip[0]); ++i) {
+		if (strcmp(insn, skip[i]) == 0)
+			return false;
+	}
+	return true;
+}
+
+
+static void
+add_case(std::vector<MicroCase> &cases, const char *name, body_kind kind,
+    const unsigned char *body, size_t len, size_t insns)
+{
+	MicroCase	c;
+
+	c.name = name;
+	c.kind = kind;
+	memcpy(c.body, body, len);
+	c.len = len;
+	c.insns = insns;
+	cases.push_back(c);
+}
+
+
+// build_cases lists the matrix: the straight-line opcodes from the
+// opcode table, named by their disassembly, then the special cases.
+// The loop leaves Z, C, and V clear for the branches.
+static void
+build_cases(std::vector<MicroCase> &cases)
+{
+#define MICRO_ENTRY(op, insn, mode, cycles)	{op, #insn, MODE_##mode},
+	static const struct {
+		uint8_t		 op;
+		const char	*insn;
+		addr_mode	 mode;
+	} table[256] = {
+		K6502_OPCODES(MICRO_ENTRY)
+	};
+#undef MICRO_ENTRY
+	static const unsigned char	bne[] = {0xd0, 0x00};
+	static const unsigned char	beq[] = {0xf0, 0x00};
+	static const unsigned char	bcc[] = {0x90, 0x00};
+	static const unsigned char	bcs[] = {0xb0, 0x00};
+	static const unsigned char	bvc[] = {0x50, 0x00};
+	static const unsigned char	bvs[] = {0x70, 0x00};
+	static const unsigned char	jmp[] = {0x4c, 0x00, 0x00};
+	static const unsigned char	jmp_ind[] = {0x6c, 0x00, 0x00};
+	static const unsigned char	jsr[] = {0x20, 0x00, 0x00};
+	static const unsigned char	pha_pla[] = {0x48, 0x68};
+	static const unsigned char	php_plp[] = {0x08, 0x28};
+	unsigned char			body[4];
+	char				name[DISASM_MAX];
+	size_t				i, len;
+
+	for (i = 0; i < 256; ++i) {
+		if (!straight(table[i].insn))
+			continue;
+		body[0] = table[i].op;
+		len = 1 + operands(table[i].mode, body + 1);
+		disassemble(PROGRAM, body, name, sizeof(name));
+		add_case(cases, name, BODY_PLAIN, body, len, 1);
+	}
+	add_case(cases, "BNE taken", BODY_PLAIN, bne, 2, 1);
+	add_case(cases, "BEQ not taken", BODY_PLAIN, beq, 2, 1);
+	add_case(cases, "BCC taken", BODY_PLAIN, bcc, 2, 1);
+	add_case(cases, "BCS not taken", BODY_PLAIN, bcs, 2, 1);
+	add_case(cases, "BVC taken", BODY_PLAIN, bvc, 2, 1);
+	add_case(cases, "BVS not taken", BODY_PLAIN, bvs, 2, 1);
+	add_case(cases, "JMP $nnnn", BODY_JMP, jmp, 3, 1);
+	add_case(cases, "JMP ($nnnn)", BODY_JMP_IND, jmp_ind, 3, 1);
+	add_case(cases, "JSR/RTS", BODY_JSR, jsr, 3, 2);
+	add_case(cases, "PHA/PLA", BODY_PLAIN, pha_pla, 2, 2);
+	add_case(cases, "PHP/PLP", BODY_PLAIN, php_plp, 2, 2);
+}
+
+
+// load_case builds the loop for the case (or the bare loop, if c is
+// NULL) into the CPU's memory. The loop leaves its counters at zero and
+// sets up everything else itself, so it can be run again and again.
+static void
+load_case(CPU &cpu, const MicroCase *c)
+{
+	static const unsigned char	setup[] = {
+		0xa2, 0x01,		// LDX #$01
+		0xa0, 0x02,		// LDY #$02
+		0xa9, 0x00,		// LDA #$00
+		0x85, 0x40,		// STA $40
+		0xa9, 0x04,		// LDA #$04
+		0x85, 0x41,		// STA $41
+		0xa9, 0x10,		// LDA #$10
+		0x85, 0xf1,		// STA $F1
+		0x18,			// CLC
+		0xb8,			// CLV
+		0xa9, 0x01		// LDA #$01
+	};
+	unsigned char	prog[256];
+	size_t		n, i, loop, sub;
+	uint16_t	next;
+
+	memcpy(prog, setup, sizeof(setup));
+	n = sizeof(setup);
+	loop = n;
+	sub = n + (c == NULL ? 0 : COPIES * c->len) + 9;
+	for (i = 0; c != NULL && i < COPIES; ++i) {
+		memcpy(prog + n, c->body, c->len);
+		next = (uint16_t)(PROGRAM + n + c->len);
+		switch (c->kind) {
+		case BODY_JMP:
+			prog[n + 1] = next & 0xff;
+			prog[n + 2] = next >> 8;
+			break;
+		case BODY_JMP_IND:
+			prog[n + 1] = (JMP_POINTERS + 2 * i) & 0xff;
+			prog[n + 2] = (JMP_POINTERS + 2 * i) >> 8;
+			cpu.DMA((uint16_t)(JMP_POINTERS + 2 * i), next & 0xff);
+			cpu.DMA((uint16_t)(JMP_POINTERS + 2 * i + 1), next >> 8);
+			break;
+		case BODY_JSR:
+			prog[n + 1] = (PROGRAM + sub) & 0xff;
+			prog[n + 2] = (PROGRAM + sub) >> 8;
+			break;
+		default:
+			break;
+		}
+		n += c->len;
+	}
+	prog[n++] = 0xc6;		// DEC $F0
+	prog[n++] = 0xf0;
+	prog[n++] = 0xd0;		// BNE loop
+	prog[n] = (uint8_t)(loop - (n + 1));
+	n++;
+	prog[n++] = 0xc6;		// DEC $F1
+	prog[n++] = 0xf1;
+	prog[n++] = 0xd0;		// BNE loop
+	prog[n] = (uint8_t)(loop - (n + 1));
+	n++;
+	prog[n++] = 0x00;		// BRK
+	prog[n++] = 0x60;		// RTS, for JSR
+
+	cpu.load(prog, PROGRAM, (uint16_t)n);
+}
+
+
+// A Timing is the best run of a case.
+struct Timing {
+	double	secs;
+	size_t	steps;
+	size_t	cycles;
+};
+
+
+// time_case runs the case until a sample lasts at least min_secs, and
+// returns the best time per run over the samples. The program is loaded
+// once, so the engines that compile code only do it in the warm-up.
+static Timing
+time_case(cpu_engine engine, const MicroCase *c, size_t samples,
+    double min_secs)
+{
+	std::chrono::steady_clock::time_point	start, stop;
+	CPU					cpu(0x10000, engine);
+	Timing					best;
+	size_t					runs = 1, i, s;
+	size_t					steps, cycles;
+	double					secs;
+
+	load_case(cpu, c);
+	best.secs = 0;
+	best.steps = 0;
+	best.cycles = 0;
+	for (s = 0; s <= samples; ++s) {
+		// The first sample is the warm-up; it doubles the runs
+		// until they take long enough.
+		do {
+			steps = cpu.get_steps();
+			cycles = cpu.get_cycles();
+			start = std::chrono::steady_clock::now();
+			for (i = 0; i < runs; ++i) {
+				cpu.set_entry(PROGRAM);
+				cpu.run(false);
+			}
+			stop = std::chrono::steady_clock::now();
+			secs = std::chrono::duration<double>(stop -
+			    start).count();
+		} while (s == 0 && secs < min_secs && (runs *= 2));
+		secs /= (double)runs;
+		if (s > 0 && (best.secs == 0 || secs < best.secs))
+			best.secs = secs;
+	}
+	best.steps = (cpu.get_steps() - steps) / runs;
+	best.cycles = (cpu.get_cycles() - cycles) / runs;
+	return best;
+}
+
+
+// read_baseline reads the ns_per_insn column of earlier results into
+// baseline, keyed by case and engine. It returns false if the file
+// cannot be read.
+static bool
+read_baseline(const char *path, std::map<std::string, double> &baseline)
+{
+	std::ifstream	in(path);
+	std::string	line, name, engine, cycles, ns;
+
+	if (!in)
+		return false;
+	std::getline(in, line);
+	while (std::getline(in, line)) {
+		std::istringstream	fields(line);
+
+		if (std::getline(fields, name, '\t') &&
+		    std::getline(fields, engine, '\t') &&
+		    std::getline(fields, cycles, '\t') &&
+		    std::getline(fields, ns, '\t'))
+			baseline[name + "\t" + engine] = atof(ns.c_str());
+	}
+	return true;
+}
+
+
+static const struct {
+	const char	*name;
+	cpu_engine	 engine;
+} engines[] = {
+	{"table", ENGINE_TABLE},
+	{"threaded", ENGINE_THREADED},
+	{"cached", ENGINE_CACHED},
+	{"jit", ENGINE_JIT}
+};
+static const size_t	nengines = sizeof(engines) / sizeof(engines[0]);
+
+
+static void
+usage()
+{
+	std::cerr << "usage: microbench [-b baseline] [-o output] "
+		  << "[-e engine] [-n samples]\n"
+		  << "                  [-m min_ms] [-t tolerance_pct]\n";
+	exit(2);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	std::map<std::string, double>	 baseline;
+	std::map<std::string, double>::iterator	 base;
+	std::vector<MicroCase>		 cases;
+	std::ostringstream		 out;
+	const char			*baseline_path = NULL;
+	const char			*output_path = NULL;
+	const char			*only = NULL;
+	const char			*status;
+	size_t				 samples = 3, i, eng;
+	double				 min_secs = 0.01, tolerance = 10;
+	double				 ns, cycles;
+	Timing				 bare, t;
+	bool				 regressed = false;
+	int				 ch;
+
+	while ((ch = getopt(argc, argv, "b:o:e:n:m:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'e':
+			only = optarg;
+			break;
+		case 'n':
+			samples = (size_t)atoi(optarg);
+			break;
+		case 'm':
+			min_secs = atof(optarg) / 1000.0;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (only != NULL) {
+		for (eng = 0; eng < nengines; ++eng) {
+			if (strcmp(only, engines[eng].name) == 0)
+				break;
+		}
+		if (eng == nengines)
+			usage();
+	}
+	if (samples == 0)
+		samples = 1;
+	if (baseline_path != NULL && !read_baseline(baseline_path,
+	    baseline)) {
+		perror(baseline_path);
+		return 2;
+	}
+
+	build_cases(cases);
+	out << "case\tengine\tcycles\tns_per_insn\tbaseline_ns\tstatus\n";
+	std::cout << out.str();
+	for (eng = 0; eng < nengines; ++eng) {
+		if (only != NULL && strcmp(only, engines[eng].name) != 0)
+			continue;
+		bare = time_case(engines[eng].engine, NULL, samples,
+		    min_secs);
+		for (i = 0; i < cases.size(); ++i) {
+			std::ostringstream	row;
+
+			t = time_case(engines[eng].engine, &cases[i], samples,
+			    min_secs);
+			ns = (t.secs - bare.secs) * 1e9 /
+			    (double)(t.steps - bare.steps);
+			cycles = (double)(t.cycles - bare.cycles) /
+			    (double)(t.steps - bare.steps);
+			row << cases[i].name << "\t" << engines[eng].name
+			    << "\t" << cycles << "\t" << ns << "\t";
+			base = baseline.find(cases[i].name + "\t" +
+			    engines[eng].name);
+			if (base == baseline.end()) {
+				row << "-\t-\n";
+			} else {
+				status = "ok";
+				if (ns > base->second *
+				    (1.0 + tolerance / 100.0)) {
+					status = "regressed";
+					regressed = true;
+				}
+				row << base->second << "\t" << status << "\n";
+			}
+			std::cout << row.str() << std::flush;
+			out << row.str();
+		}
+	}
+
+	if (output_path != NULL) {
+		std::ofstream	save(output_path);
+
+		save << out.str();
+		if (!save) {
+			perror(output_path);
+			return 2;
+		}
+	}
+	return regressed ? 1 : 0;
+}
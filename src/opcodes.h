@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __6502_OPCODES_H
+#define __6502_OPCODES_H
+
+
+#include <cstdint>
+
+
+/*
+ * K6502_OPCODES expands X(opcode, instruction, addressing mode, cycles)
+ * once for each of the 256 opcodes, in order. Opcodes that are not part
+ * of the documented NMOS 6502 instruction set map to ILL. The cycle
+ * count is the base count; page-crossing and taken-branch penalties are
+ * added by the handlers.
+ */
+#define K6502_OPCODES(X)	\
+	X(0x00, BRK, IMP, 7) \
+	X(0x01, ORA, IIZPX, 6) \
+	X(0x02, ILL, IMP, 2) \
+	X(0x03, ILL, IMP, 2) \
+	X(0x04, ILL, IMP, 2) \
+	X(0x05, ORA, ZP, 3) \
+	X(0x06, ASL, ZP, 5) \
+	X(0x07, ILL, IMP, 2) \
+	X(0x08, PHP, IMP, 3) \
+	X(0x09, ORA, IMM, 2) \
+	X(0x0A, ASL, ACC, 2) \
+	X(0x0B, ILL, IMP, 2) \
+	X(0x0C, ILL, IMP, 2) \
+	X(0x0D, ORA, ABS, 4) \
+	X(0x0E, ASL, ABS, 6) \
+	X(0x0F, ILL, IMP, 2) \
+	X(0x10, BPL, REL, 2) \
+	X(0x11, ORA, IIZPY, 5) \
+	X(0x12, ILL, IMP, 2) \
+	X(0x13, ILL, IMP, 2) \
+	X(0x14, ILL, IMP, 2) \
+	X(0x15, ORA, ZPX, 4) \
+	X(0x16, ASL, ZPX, 6) \
+	X(0x17, ILL, IMP, 2) \
+	X(0x18, CLC, IMP, 2) \
+	X(0x19, ORA, ABSY, 4) \
+	X(0x1A, ILL, IMP, 2) \
+	X(0x1B, ILL, IMP, 2) \
+	X(0x1C, ILL, IMP, 2) \
+	X(0x1D, ORA, ABSX, 4) \
+	X(0x1E, ASL, ABSX, 7) \
+	X(0x1F, ILL, IMP, 2) \
+	X(0x20, JSR, ABS, 6) \
+	X(0x21, AND, IIZPX, 6) \
+	X(0x22, ILL, IMP, 2) \
+	X(0x23, ILL, IMP, 2) \
+	X(0x24, BIT, ZP, 3) \
+	X(0x25, AND, ZP, 3) \
+	X(0x26, ROL, ZP, 5) \
+	X(0x27, ILL, IMP, 2) \
+	X(0x28, PLP, IMP, 4) \
+	X(0x29, AND, IMM, 2) \
+	X(0x2A, ROL, ACC, 2) \
+	X(0x2B, ILL, IMP, 2) \
+	X(0x2C, BIT, ABS, 4) \
+	X(0x2D, AND, ABS, 4) \
+	X(0x2E, ROL, ABS, 6) \
+	X(0x2F, ILL, IMP, 2) \
+	X(0x30, BMI, REL, 2) \
+	X(0x31, AND, IIZPY, 5) \
+	X(0x32, ILL, IMP, 2) \
+	X(0x33, ILL, IMP, 2) \
+	X(0x34, ILL, IMP, 2) \
+	X(0x35, AND, ZPX, 4) \
+	X(0x36, ROL, ZPX, 6) \
+	X(0x37, ILL, IMP, 2) \
+	X(0x38, SEC, IMP, 2) \
+	X(0x39, AND, ABSY, 4) \
+	X(0x3A, ILL, IMP, 2) \
+	X(0x3B, ILL, IMP, 2) \
+	X(0x3C, ILL, IMP, 2) \
+	X(0x3D, AND, ABSX, 4) \
+	X(0x3E, ROL, ABSX, 7) \
+	X(0x3F, ILL, IMP, 2) \
+	X(0x40, RTI, IMP, 6) \
+	X(0x41, EOR, IIZPX, 6) \
+	X(0x42, ILL, IMP, 2) \
+	X(0x43, ILL, IMP, 2) \
+	X(0x44, ILL, IMP, 2) \
+	X(0x45, EOR, ZP, 3) \
+	X(0x46, LSR, ZP, 5) \
+	X(0x47, ILL, IMP, 2) \
+	X(0x48, PHA, IMP, 3) \
+	X(0x49, EOR, IMM, 2) \
+	X(0x4A, LSR, ACC, 2) \
+	X(0x4B, ILL, IMP, 2) \
+	X(0x4C, JMP, ABS, 3) \
+	X(0x4D, EOR, ABS, 4) \
+	X(0x4E, LSR, ABS, 6) \
+	X(0x4F, ILL, IMP, 2) \
+	X(0x50, BVC, REL, 2) \
+	X(0x51, EOR, IIZPY, 5) \
+	X(0x52, ILL, IMP, 2) \
+	X(0x53, ILL, IMP, 2) \
+	X(0x54, ILL, IMP, 2) \
+	X(0x55, EOR, ZPX, 4) \
+	X(0x56, LSR, ZPX, 6) \
+	X(0x57, ILL, IMP, 2) \
+	X(0x58, CLI, IMP, 2) \
+	X(0x59, EOR, ABSY, 4) \
+	X(0x5A, ILL, IMP, 2) \
+	X(0x5B, ILL, IMP, 2) \
+	X(0x5C, ILL, IMP, 2) \
+	X(0x5D, EOR, ABSX, 4) \
+	X(0x5E, LSR, ABSX, 7) \
+	X(0x5F, ILL, IMP, 2) \
+	X(0x60, RTS, IMP, 6) \
+	X(0x61, ADC, IIZPX, 6) \
+	X(0x62, ILL, IMP, 2) \
+	X(0x63, ILL, IMP, 2) \
+	X(0x64, ILL, IMP, 2) \
+	X(0x65, ADC, ZP, 3) \
+	X(0x66, ROR, ZP, 5) \
+	X(0x67, ILL, IMP, 2) \
+	X(0x68, PLA, IMP, 4) \
+	X(0x69, ADC, IMM, 2) \
+	X(0x6A, ROR, ACC, 2) \
+	X(0x6B, ILL, IMP, 2) \
+	X(0x6C, JMP, IND, 5) \
+	X(0x6D, ADC, ABS, 4) \
+	X(0x6E, ROR, ABS, 6) \
+	X(0x6F, ILL, IMP, 2) \
+	X(0x70, BVS, REL, 2) \
+	X(0x71, ADC, IIZPY, 5) \
+	X(0x72, ILL, IMP, 2) \
+	X(0x73, ILL, IMP, 2) \
+	X(0x74, ILL, IMP, 2) \
+	X(0x75, ADC, ZPX, 4) \
+	X(0x76, ROR, ZPX, 6) \
+	X(0x77, ILL, IMP, 2) \
+	X(0x78, SEI, IMP, 2) \
+	X(0x79, ADC, ABSY, 4) \
+	X(0x7A, ILL, IMP, 2) \
+	X(0x7B, ILL, IMP, 2) \
+	X(0x7C, ILL, IMP, 2) \
+	X(0x7D, ADC, ABSX, 4) \
+	X(0x7E, ROR, ABSX, 7) \
+	X(0x7F, ILL, IMP, 2) \
+	X(0x80, ILL, IMP, 2) \
+	X(0x81, STA, IIZPX, 6) \
+	X(0x82, ILL, IMP, 2) \
+	X(0x83, ILL, IMP, 2) \
+	X(0x84, STY, ZP, 3) \
+	X(0x85, STA, ZP, 3) \
+	X(0x86, STX, ZP, 3) \
+	X(0x87, ILL, IMP, 2) \
+	X(0x88, DEY, IMP, 2) \
+	X(0x89, ILL, IMP, 2) \
+	X(0x8A, TXA, IMP, 2) \
+	X(0x8B, ILL, IMP, 2) \
+	X(0x8C, STY, ABS, 4) \
+	X(0x8D, STA, ABS, 4) \
+	X(0x8E, STX, ABS, 4) \
+	X(0x8F, ILL, IMP, 2) \
+	X(0x90, BCC, REL, 2) \
+	X(0x91, STA, IIZPY, 6) \
+	X(0x92, ILL, IMP, 2) \
+	X(0x93, ILL, IMP, 2) \
+	X(0x94, STY, ZPX, 4) \
+	X(0x95, STA, ZPX, 4) \
+	X(0x96, STX, ZPY, 4) \
+	X(0x97, ILL, IMP, 2) \
+	X(0x98, TYA, IMP, 2) \
+	X(0x99, STA, ABSY, 5) \
+	X(0x9A, TXS, IMP, 2) \
+	X(0x9B, ILL, IMP, 2) \
+	X(0x9C, ILL, IMP, 2) \
+	X(0x9D, STA, ABSX, 5) \
+	X(0x9E, ILL, IMP, 2) \
+	X(0x9F, ILL, IMP, 2) \
+	X(0xA0, LDY, IMM, 2) \
+	X(0xA1, LDA, IIZPX, 6) \
+	X(0xA2, LDX, IMM, 2) \
+	X(0xA3, ILL, IMP, 2) \
+	X(0xA4, LDY, ZP, 3) \
+	X(0xA5, LDA, ZP, 3) \
+	X(0xA6, LDX, ZP, 3) \
+	X(0xA7, ILL, IMP, 2) \
+	X(0xA8, TAY, IMP, 2) \
+	X(0xA9, LDA, IMM, 2) \
+	X(0xAA, TAX, IMP, 2) \
+	X(0xAB, ILL, IMP, 2) \
+	X(0xAC, LDY, ABS, 4) \
+	X(0xAD, LDA, ABS, 4) \
+	X(0xAE, LDX, ABS, 4) \
+	X(0xAF, ILL, IMP, 2) \
+	X(0xB0, BCS, REL, 2) \
+	X(0xB1, LDA, IIZPY, 5) \
+	X(0xB2, ILL, IMP, 2) \
+	X(0xB3, ILL, IMP, 2) \
+	X(0xB4, LDY, ZPX, 4) \
+	X(0xB5, LDA, ZPX, 4) \
+	X(0xB6, LDX, ZPY, 4) \
+	X(0xB7, ILL, IMP, 2) \
+	X(0xB8, CLV, IMP, 2) \
+	X(0xB9, LDA, ABSY, 4) \
+	X(0xBA, TSX, IMP, 2) \
+	X(0xBB, ILL, IMP, 2) \
+	X(0xBC, LDY, ABSX, 4) \
+	X(0xBD, LDA, ABSX, 4) \
+	X(0xBE, LDX, ABSY, 4) \
+	X(0xBF, ILL, IMP, 2) \
+	X(0xC0, CPY, IMM, 2) \
+	X(0xC1, CMP, IIZPX, 6) \
+	X(0xC2, ILL, IMP, 2) \
+	X(0xC3, ILL, IMP, 2) \
+	X(0xC4, CPY, ZP, 3) \
+	X(0xC5, CMP, ZP, 3) \
+	X(0xC6, DEC, ZP, 5) \
+	X(0xC7, ILL, IMP, 2) \
+	X(0xC8, INY, IMP, 2) \
+	X(0xC9, CMP, IMM, 2) \
+	X(0xCA, DEX, IMP, 2) \
+	X(0xCB, ILL, IMP, 2) \
+	X(0xCC, CPY, ABS, 4) \
+	X(0xCD, CMP, ABS, 4) \
+	X(0xCE, DEC, ABS, 6) \
+	X(0xCF, ILL, IMP, 2) \
+	X(0xD0, BNE, REL, 2) \
+	X(0xD1, CMP, IIZPY, 5) \
+	X(0xD2, ILL, IMP, 2) \
+	X(0xD3, ILL, IMP, 2) \
+	X(0xD4, ILL, IMP, 2) \
+	X(0xD5, CMP, ZPX, 4) \
+	X(0xD6, DEC, ZPX, 6) \
+	X(0xD7, ILL, IMP, 2) \
+	X(0xD8, CLD, IMP, 2) \
+	X(0xD9, CMP, ABSY, 4) \
+	X(0xDA, ILL, IMP, 2) \
+	X(0xDB, ILL, IMP, 2) \
+	X(0xDC, ILL, IMP, 2) \
+	X(0xDD, CMP, ABSX, 4) \
+	X(0xDE, DEC, ABSX, 7) \
+	X(0xDF, ILL, IMP, 2) \
+	X(0xE0, CPX, IMM, 2) \
+	X(0xE1, SBC, IIZPX, 6) \
+	X(0xE2, ILL, IMP, 2) \
+	X(0xE3, ILL, IMP, 2) \
+	X(0xE4, CPX, ZP, 3) \
+	X(0xE5, SBC, ZP, 3) \
+	X(0xE6, INC, ZP, 5) \
+	X(0xE7, ILL, IMP, 2) \
+	X(0xE8, INX, IMP, 2) \
+	X(0xE9, SBC, IMM, 2) \
+	X(0xEA, NOP, IMP, 2) \
+	X(0xEB, ILL, IMP, 2) \
+	X(0xEC, CPX, ABS, 4) \
+	X(0xED, SBC, ABS, 4) \
+	X(0xEE, INC, ABS, 6) \
+	X(0xEF, ILL, IMP, 2) \
+	X(0xF0, BEQ, REL, 2) \
+	X(0xF1, SBC, IIZPY, 5) \
+	X(0xF2, ILL, IMP, 2) \
+	X(0xF3, ILL, IMP, 2) \
+	X(0xF4, ILL, IMP, 2) \
+	X(0xF5, SBC, ZPX, 4) \
+	X(0xF6, INC, ZPX, 6) \
+	X(0xF7, ILL, IMP, 2) \
+	X(0xF8, SED, IMP, 2) \
+	X(0xF9, SBC, ABSY, 4) \
+	X(0xFA, ILL, IMP, 2) \
+	X(0xFB, ILL, IMP, 2) \
+	X(0xFC, ILL, IMP, 2) \
+	X(0xFD, SBC, ABSX, 4) \
+	X(0xFE, INC, ABSX, 7) \
+	X(0xFF, ILL, IMP, 2)
+
+
+// opcode_cycles holds the base cycle count of each opcode.
+#define CYCLES_ENTRY(op, insn, mode, cycles)	cycles,
+constexpr uint8_t	opcode_cycles[256] = {
+	K6502_OPCODES(CYCLES_ENTRY)
+};
+#undef CYCLES_ENTRY
+
+
+#endif
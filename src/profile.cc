@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include "profile.h"
+
+
+static const uint8_t	OP_JSR = 0x20;
+static const uint8_t	OP_RTS = 0x60;
+
+
+Profiler::Profiler() : pcs(new size_t[0x10000])
+{
+	this->clear();
+}
+
+
+Profiler::~Profiler()
+{
+	delete[] this->pcs;
+}
+
+
+// clear forgets everything counted so far. The next instruction
+// recorded becomes the root of the call tree.
+void
+Profiler::clear()
+{
+	memset(this->opcodes, 0, sizeof(this->opcodes));
+	memset(this->pcs, 0, 0x10000 * sizeof(size_t));
+	this->nodes.assign(1, Node());
+	this->nodes[0].addr = 0;
+	this->nodes[0].parent = 0;
+	this->nodes[0].depth = 0;
+	this->nodes[0].calls = 0;
+	this->nodes[0].cycles = 0;
+	this->current = 0;
+	this->overflow = 0;
+	this->started = false;
+}
+
+
+// record counts the instruction and charges its cycles to the routine
+// running it. A JSR is charged to the caller, and then enters the node
+// for its target; an RTS is charged to the routine it returns from. An
+// RTS at the root, from code entered before profiling began, is left
+// at the root. Calls past PROFILE_MAX_DEPTH stay in the deepest node,
+// and are counted so that their returns do not leave it.
+void
+Profiler::record(uint16_t pc, uint8_t op, size_t cycles, uint16_t next)
+{
+	std::map<uint16_t, size_t>::iterator	child;
+	Node					*node;
+	size_t					 id;
+
+	if (!this->started) {
+		this->nodes[0].addr = pc;
+		this->nodes[0].calls = 1;
+		this->started = true;
+	}
+	this->opcodes[op]++;
+	this->pcs[pc]++;
+	node = &this->nodes[this->current];
+	node->cycles += cycles;
+
+	if (op == OP_JSR && node->depth >= PROFILE_MAX_DEPTH) {
+		this->overflow++;
+	} else if (op == OP_JSR) {
+		child = node->children.find(next);
+		if (child == node->children.end()) {
+			id = this->nodes.size();
+			node->children[next] = id;
+			this->nodes.push_back(Node());
+			node = &this->nodes[this->current];
+			this->nodes[id].addr = next;
+			this->nodes[id].parent = this->current;
+			this->nodes[id].depth = node->depth + 1;
+			this->nodes[id].calls = 0;
+			this->nodes[id].cycles = 0;
+		} else {
+			id = child->second;
+		}
+		this->nodes[id].calls++;
+		this->current = id;
+	} else if (op == OP_RTS && this->overflow > 0) {
+		this->overflow--;
+	} else if (op == OP_RTS) {
+		this->current = node->parent;
+	}
+}
+
+
+size_t
+Profiler::opcode_count(uint8_t op)
+{
+	return this->opcodes[op];
+}
+
+
+size_t
+Profiler::pc_count(uint16_t pc)
+{
+	return this->pcs[pc];
+}
+
+
+// routine_calls returns the number of calls to the routine at addr,
+// from anywhere.
+size_t
+Profiler::routine_calls(uint16_t addr)
+{
+	size_t	i, calls = 0;
+
+	for (i = 0; i < this->nodes.size(); ++i) {
+		if (this->nodes[i].addr == addr)
+			calls += this->nodes[i].calls;
+	}
+	return calls;
+}
+
+
+// routine_cycles returns the cycles spent in the routine at addr, from
+// wherever it was called.
+size_t
+Profiler::routine_cycles(uint16_t addr)
+{
+	size_t	i, cycles = 0;
+
+	for (i = 0; i < this->nodes.size(); ++i) {
+		if (this->nodes[i].addr == addr)
+			cycles += this->nodes[i].cycles;
+	}
+	return cycles;
+}
+
+
+void
+Profiler::write_flat(std::ostream &out)
+{
+	std::map<uint16_t, std::pair<size_t, size_t> >			 flat;
+	std::map<uint16_t, std::pair<size_t, size_t> >::iterator	 it;
+	std::vector<std::pair<size_t, uint16_t> >			 order;
+	size_t								 i;
+
+	for (i = 0; i < this->nodes.size(); ++i) {
+		flat[this->nodes[i].addr].first += this->nodes[i].calls;
+		flat[this->nodes[i].addr].second += this->nodes[i].cycles;
+	}
+	for (it = flat.begin(); it != flat.end(); ++it) {
+		if (it->second.second == 0)
+			continue;
+		order.push_back(std::make_pair(it->second.second, it->first));
+	}
+	std::stable_sort(order.begin(), order.end(),
+	    std::greater<std::pair<size_t, uint16_t> >());
+
+	for (i = 0; i < order.size(); ++i) {
+		it = flat.find(order[i].second);
+		out << "$" << std::hex << std::uppercase << std::setfill('0')
+		    << std::setw(4) << it->first << std::dec
+		    << std::nouppercase << "\t" << it->second.first << "\t"
+		    << it->second.second << "\n";
+	}
+}
+
+
+// write_stack writes the chain of calls leading to a node, outermost
+// first.
+void
+Profiler::write_stack(std::ostream &out, size_t id)
+{
+	if (id != 0) {
+		this->write_stack(out, this->nodes[id].parent);
+		out << ";";
+	}
+	out << "$" << std::hex << std::uppercase << std::setfill('0')
+	    << std::setw(4) << this->nodes[id].addr << std::dec
+	    << std::nouppercase;
+}
+
+
+void
+Profiler::write_collapsed(std::ostream &out)
+{
+	size_t	i;
+
+	for (i = 0; i < this->nodes.size(); ++i) {
+		if (this->nodes[i].cycles == 0)
+			continue;
+		this->write_stack(out, i);
+		out << " " << this->nodes[i].cycles << "\n";
+	}
+}
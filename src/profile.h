@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#ifndef __6502_PROFILE_H
+#define __6502_PROFILE_H
+
+
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <ostream>
+#include <vector>
+
+
+// Calls nested deeper than this are attributed to the deepest routine.
+// The 6502 stack has room for 128 return addresses, so only code that
+// discards return addresses goes this deep.
+const size_t	PROFILE_MAX_DEPTH = 128;
+
+
+/*
+ * A Profiler counts where a guest program spends its time: how often
+ * each opcode and each address is executed, and how many cycles are
+ * spent in each subroutine. Subroutines are found by following JSR and
+ * RTS, so the profiler keeps a call tree, keyed by the targets of the
+ * JSRs, with the cycles spent directly in each node; a routine's cycles
+ * are those of its instructions, not of the routines it calls.
+ *
+ * A CPU with no profiler attached runs its engine's own loop, so the
+ * profiler costs nothing when it is off; with one attached, the CPU
+ * steps one instruction at a time.
+ */
+class Profiler {
+	private:
+		// A node in the call tree: a routine reached through a
+		// particular chain of calls. Node 0 is the root, which
+		// holds the code that was running when profiling began.
+		struct Node {
+			uint16_t			addr;
+			size_t				parent;
+			size_t				depth;
+			size_t				calls;
+			size_t				cycles;
+			std::map<uint16_t, size_t>	children;
+		};
+
+		size_t			opcodes[256];
+		size_t			*pcs;
+		std::vector<Node>	nodes;
+		size_t			current;
+		size_t			overflow;
+		bool			started;
+
+		void	write_stack(std::ostream &, size_t);
+
+		Profiler(const Profiler &) = delete;
+		Profiler &operator=(const Profiler &) = delete;
+	public:
+		Profiler();
+		~Profiler();
+
+		// record is called by the CPU after each instruction with
+		// its address, its opcode, the cycles it took, and the PC
+		// it left behind.
+		void	record(uint16_t, uint8_t, size_t, uint16_t);
+		void	clear(void);
+
+		size_t	opcode_count(uint8_t);
+		size_t	pc_count(uint16_t);
+		size_t	routine_calls(uint16_t);
+		size_t	routine_cycles(uint16_t);
+
+		// write_flat writes one line per routine, busiest first:
+		// its address, the number of calls, and its cycles.
+		void	write_flat(std::ostream &);
+
+		// write_collapsed writes the call tree in the collapsed
+		// stack format read by flamegraph.pl and its kin: one line
+		// per chain of calls, the routines' addresses separated by
+		// semicolons, followed by the cycles spent there.
+		void	write_collapsed(std::ostream &);
+};
+
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#ifndef __6502_PROGRAMS_H
+#define __6502_PROGRAMS_H
+
+
+/*
+ * The programs from http://skilldrick.github.io/easy6502/, as used by
+ * the easy6502 tests and as benchmark workloads. They are changed to
+ * start at $0300, so that they fit in 1K of memory.
+ */
+
+
+#include <cstdint>
+#include <cstdlib>
+
+
+static const unsigned char	easy_first[] = {
+	0xa9, 0x01, 0x8d, 0x01, 0x00
+};
+
+static const unsigned char	easy_store[] = {
+	0xa9, 0x01, 0x8d, 0x00, 0x02, 0xa9, 0x05, 0x8d,
+	0x01, 0x02, 0xa9, 0x08, 0x8d, 0x02, 0x02, 0x00
+};
+
+static const unsigned char	easy_add[] = {
+	0xa9, 0xc0, 0xaa, 0xe8, 0x69, 0xc4, 0x00
+};
+
+static const unsigned char	easy_carry[] = {
+	0xa9, 0x80, 0x85, 0x01, 0x65, 0x01
+};
+
+static const unsigned char	easy_branch[] = {
+	0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 0x03,
+	0xd0, 0xf8, 0x8e, 0x01, 0x02, 0x00
+};
+
+static const unsigned char	easy_indexed_indirect[] = {
+	0xa2, 0x01, 0xa9, 0x05, 0x85, 0x01, 0xa9, 0x03,
+	0x85, 0x02, 0xa0, 0x0a, 0x8c, 0x05, 0x03, 0xa1,
+	0x00
+};
+
+static const unsigned char	easy_indirect_indexed[] = {
+	0xa0, 0x01, 0xa9, 0x03, 0x85, 0x01, 0xa9, 0x01,
+	0x85, 0x02, 0xa2, 0x0a, 0x8e, 0x04, 0x01, 0xb1,
+	0x01, 0x00
+};
+
+static const unsigned char	easy_stack[] = {
+	0xa2, 0x00, 0xa0, 0x00, 0x8a, 0x99, 0x00, 0x02,
+	0x48, 0xe8, 0xc8, 0xc0, 0x10, 0xd0, 0xf5, 0x68,
+	0x99, 0x00, 0x02, 0xc8, 0xc0, 0x20, 0xd0, 0xf7,
+	0x00
+};
+
+static const unsigned char	easy_jump[] = {
+	0xa9, 0x03, 0x4c, 0x08, 0x03, 0x00, 0x00, 0x00,
+	0x8d, 0x00, 0x02, 0x00
+};
+
+static const unsigned char	easy_jsr[] = {
+	0x20, 0x09, 0x03, 0x20, 0x0c, 0x03, 0x20, 0x12,
+	0x03, 0xa2, 0x00, 0x60, 0xe8, 0xe0, 0x05, 0xd0,
+	0xfb, 0x60, 0x00, 0x00
+};
+
+
+// A GuestProgram names a program loaded at $0300 and run from there.
+struct GuestProgram {
+	const char		*name;
+	const unsigned char	*code;
+	size_t			 size;
+};
+
+#define EASY6502_PROGRAM(name)	{#name, name, sizeof(name)}
+static const GuestProgram	easy6502_programs[] = {
+	EASY6502_PROGRAM(easy_first),
+	EASY6502_PROGRAM(easy_store),
+	EASY6502_PROGRAM(easy_add),
+	EASY6502_PROGRAM(easy_carry),
+	EASY6502_PROGRAM(easy_branch),
+	EASY6502_PROGRAM(easy_indexed_indirect),
+	EASY6502_PROGRAM(easy_indirect_indexed),
+	EASY6502_PROGRAM(easy_stack),
+	EASY6502_PROGRAM(easy_jump),
+	EASY6502_PROGRAM(easy_jsr)
+};
+#undef EASY6502_PROGRAM
+
+static const size_t	neasy6502_programs =
+    sizeof(easy6502_programs) / sizeof(easy6502_programs[0]);
+
+
+#endif
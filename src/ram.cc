@@ -14,33 +14,327 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <new>
 #include "ram.h"
 
 
+// Arena chunks are 2M, the usual huge page size, and aligned to it.
+static const size_t	ARENA_CHUNK = 2 * 1024 * 1024;
+
+
+/*
+ * A PageStore is a retired memory mapping whose pages are shared by
+ * forked RAMs, or a ROM image. Nothing writes to it; it is freed once
+ * the last page using it has been copied out or dropped. A mapping
+ * that came from an arena goes back to it, and keeps the RAM's record
+ * of which pages were written and whether files were mapped over it so
+ * that it can be cleared on the way.
+ */
+struct PageStore {
+	unsigned char		*mem;
+	size_t			 len;
+	std::atomic<size_t>	 refs;
+	Arena			*arena;
+	bool			 mapped;
+	uint8_t			 touched[NPAGES];
+};
+
+
+// memory_size returns how much memory backs a bus: the whole address
+// space, in host pages. Memory past the top of the address space could
+// never be reached, so none is mapped whatever size a RAM asks for.
+static size_t
+memory_size()
+{
+	size_t	host = (size_t)sysconf(_SC_PAGESIZE);
+
+	return ((size_t)0x10000 + host - 1) & ~(host - 1);
+}
+
+
+// map_memory maps len bytes of zeroed memory.
+static unsigned char *
+map_memory(size_t len)
+{
+	void	*p;
+
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	    -1, 0);
+	if (p == MAP_FAILED)
+		throw std::bad_alloc();
+	return (unsigned char *)p;
+}
+
+
+// take_memory gets clear memory for a bus from the arena, or maps it
+// if there is no arena.
+static unsigned char *
+take_memory(Arena *arena)
+{
+	if (arena == NULL)
+		return map_memory(memory_size());
+	return arena->take();
+}
+
+
+// give_memory gives up the memory behind a bus. touched flags the pages
+// written to it; if files were mapped over it, it is mapped afresh
+// instead, before going back to the arena.
+static void
+give_memory(Arena *arena, unsigned char *mem, const uint8_t *touched,
+    bool mapped)
+{
+	void	*p;
+
+	if (arena == NULL) {
+		munmap(mem, memory_size());
+		return;
+	}
+	if (mapped) {
+		p = mmap(mem, memory_size(), PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+		if (p == MAP_FAILED)
+			return;
+		touched = NULL;
+	}
+	arena->give(mem, touched);
+}
+
+
+// drop_store gives up one hold on the store, freeing it after the
+// last one.
+static void
+drop_store(PageStore *store)
+{
+	if (store->refs.fetch_sub(1) != 1)
+		return;
+	if (store->arena != NULL)
+		give_memory(store->arena, store->mem, store->touched,
+		    store->mapped);
+	else
+		munmap(store->mem, store->len);
+	delete store;
+}
+
+
+Arena::Arena() : Arena(false)
+{
+}
+
+
+// Arena creates an arena whose chunks are backed by huge pages if huge
+// is true and the host supports them.
+Arena::Arena(bool huge_pages)
+{
+	this->huge = huge_pages;
+	this->chunks = NULL;
+	this->total = 0;
+	this->free_slabs = NULL;
+	this->fresh = NULL;
+	this->fresh_end = NULL;
+}
+
+
+Arena::~Arena()
+{
+	ArenaChunk	*chunk;
+
+	while (this->chunks != NULL) {
+		chunk = this->chunks;
+		this->chunks = chunk->next;
+		munmap(chunk->base, chunk->len);
+		delete chunk;
+	}
+}
+
+
+// grow maps another chunk, aligned to its size so that it can be made
+// of huge pages, and makes its slabs the fresh ones. The caller holds
+// the lock.
+void
+Arena::grow()
+{
+	size_t		 slab = memory_size();
+	size_t		 len = ARENA_CHUNK, head;
+	unsigned char	*p, *base;
+	ArenaChunk	*chunk;
+
+	p = map_memory(2 * len);
+	base = (unsigned char *)(((uintptr_t)p + len - 1) &
+	    ~(uintptr_t)(len - 1));
+	head = (size_t)(base - p);
+	if (head > 0)
+		munmap(p, head);
+	munmap(base + len, len - head);
+#ifdef MADV_HUGEPAGE
+	if (this->huge)
+		madvise(base, len, MADV_HUGEPAGE);
+#endif
+
+	chunk = new ArenaChunk;
+	chunk->base = base;
+	chunk->len = len;
+	chunk->next = this->chunks;
+	this->chunks = chunk;
+	this->total += len;
+	this->fresh = base;
+	this->fresh_end = base + len / slab * slab;
+}
+
+
+// take returns a clear slab, reusing one given back if it can. Fresh
+// slabs are handed out untouched, so their pages are only faulted in
+// as they are used.
+unsigned char *
+Arena::take()
+{
+	std::lock_guard<std::mutex>	 hold(this->lock);
+	unsigned char			*p;
+
+	if (this->free_slabs != NULL) {
+		p = this->free_slabs;
+		memcpy(&this->free_slabs, p, sizeof(this->free_slabs));
+		memset(p, 0, sizeof(uintptr_t));
+		return p;
+	}
+	if (this->fresh == this->fresh_end)
+		this->grow();
+	p = this->fresh;
+	this->fresh += memory_size();
+	return p;
+}
+
+
+// give takes a slab back, clearing the pages flagged in touched. A
+// NULL touched means the slab is already clear. Free slabs are kept on
+// a list threaded through their first bytes.
+void
+Arena::give(unsigned char *p, const uint8_t *touched)
+{
+	size_t	page;
+
+	if (touched != NULL) {
+		for (page = 0; page < NPAGES; ++page) {
+			if (touched[page])
+				memset(p + page * PAGE_SIZE, 0, PAGE_SIZE);
+		}
+	}
+
+	std::lock_guard<std::mutex>	hold(this->lock);
+
+	memcpy(p, &this->free_slabs, sizeof(this->free_slabs));
+	this->free_slabs = p;
+}
+
+
+size_t
+Arena::mapped()
+{
+	std::lock_guard<std::mutex>	hold(this->lock);
+
+	return this->total;
+}
+
+
 RAM::RAM()
 {
-	ram_size = DEFAULT_MEM;
-	ram = new unsigned char[DEFAULT_MEM];
+	this->init(DEFAULT_MEM, NULL);
 }
 
 
 RAM::RAM(size_t bytes)
 {
-	ram_size = bytes;
-	ram = new unsigned char[bytes];
+	this->init(bytes, NULL);
+}
+
+
+// RAM creates memory whose backing comes from the arena.
+RAM::RAM(size_t bytes, Arena *pool)
+{
+	this->init(bytes, pool);
+}
+
+
+RAM::~RAM()
+{
+	size_t	page;
+
+	for (page = 0; page < NPAGES; ++page)
+		this->release((uint8_t)page);
+	give_memory(this->arena, this->ram, this->touched,
+	    this->file_mapped);
+}
+
+
+// init gets the memory, enough for the whole address space, and puts
+// all of it on the bus. The memory is an anonymous mapping, or a slab
+// of one, so that files can later be mapped over parts of it. It
+// starts out clear, so every page is write-protected until it is first
+// written.
+void
+RAM::init(size_t bytes, Arena *pool)
+{
+	size_t	page;
+
+	this->ram_size = bytes;
+	this->arena = pool;
+	this->ram = take_memory(pool);
+	this->watcher = NULL;
+	this->tracking = false;
+	this->file_backed = false;
+	this->file_mapped = false;
+	for (page = 0; page < NPAGES; ++page) {
+		this->mem[page] = this->ram + page * PAGE_SIZE;
+		this->rd[page] = this->mem[page];
+		this->wr[page] = NULL;
+		this->shared[page] = NULL;
+		this->touched[page] = 0;
+		this->watched[page] = 0;
+		this->readonly[page] = 0;
+		this->dirty[page] = 1;
+		this->io_rd[page] = NULL;
+		this->io_wr[page] = NULL;
+		this->io_ctx[page] = NULL;
+	}
+}
+
+
+// alloc_size returns how much memory backs the bus.
+size_t
+RAM::alloc_size()
+{
+	return memory_size();
 }
 
 
+// reset clears memory, leaving ROM alone. Only pages written since the
+// last reset are cleared, and shared pages dropped; those count as
+// written, so watchers drop anything they cached from them. Every
+// other page is still clear.
 void
 RAM::reset()
 {
-	if (this->ram == NULL)
-		delete this->ram;
-	this->ram = new unsigned char[this->ram_size];
-	memset(this->ram, 0x0, this->ram_size);
+	size_t	page;
+
+	for (page = 0; page < NPAGES; ++page) {
+		if (this->readonly[page] || (this->shared[page] == NULL &&
+		    !this->touched[page]))
+			continue;
+		this->unshare((uint8_t)page, false);
+		if (this->touched[page])
+			memset(this->mem[page], 0x0, PAGE_SIZE);
+		this->touched[page] = 0;
+		this->changed((uint8_t)page);
+	}
 }
 
 
@@ -51,18 +345,27 @@ RAM::size()
 }
 
 
+// get_arena returns the arena the memory came from, or NULL.
+Arena *
+RAM::get_arena()
+{
+	return this->arena;
+}
+
+
 void
 RAM::dump()
 {
-	size_t	i;
+	size_t	i, len;
 	int	l = 0;
 
+	len = this->ram_size < 0x10000 ? this->ram_size : 0x10000;
 	std::cerr << "\nMEMORY DUMP:\n";
-	for (i = 0; i < this->ram_size; ++i) {
+	for (i = 0; i < len; ++i) {
 		if (l == 0)
 			std::cerr << std::setw(8) << std::hex << i << "| ";
 		std::cerr << std::hex << std::setw(2) << std::setfill('0')
-			  << (unsigned short)(this->ram[i] & 0xff);
+			  << (unsigned short)this->memory((uint16_t)i);
 		std::cerr << " ";
 		l++;
 		if (l == 8) {
@@ -76,29 +379,637 @@ RAM::dump()
 }
 
 
+// set_watcher sets the object notified of writes to watched pages.
+void
+RAM::set_watcher(PageWatcher *w)
+{
+	this->watcher = w;
+}
+
+
+// watch asks for the watcher to be told about the next write to the
+// page. The page is unwatched again once that happens. I/O and ROM
+// pages cannot be watched.
+void
+RAM::watch(uint8_t page)
+{
+	if (this->is_io(page) || this->readonly[page])
+		return;
+	this->watched[page] = 1;
+	this->wr[page] = NULL;
+}
+
+
+void
+RAM::unwatch(uint8_t page)
+{
+	if (!this->watched[page])
+		return;
+	this->watched[page] = 0;
+	this->set_write(page);
+}
+
+
+// set_write points the page's write pointer at its memory, unless
+// writes to it have to take the slow path: I/O pages, ROM, watched
+// pages, shared pages, pages not written since the last reset, and
+// clean pages while dirty pages are being tracked.
+void
+RAM::set_write(uint8_t page)
+{
+	if (this->is_io(page) || this->readonly[page] ||
+	    this->watched[page] || this->shared[page] != NULL ||
+	    !this->touched[page] || (this->tracking && !this->dirty[page]))
+		this->wr[page] = NULL;
+	else
+		this->wr[page] = this->mem[page];
+}
+
+
+// unshare gives a shared page back its own memory, copying the shared
+// contents over if keep is true. The caller sets the write pointer.
+void
+RAM::unshare(uint8_t page, bool keep)
+{
+	if (this->shared[page] == NULL)
+		return;
+	if (keep)
+		memcpy(this->ram + page * PAGE_SIZE, this->mem[page],
+		    PAGE_SIZE);
+	this->release(page);
+}
+
+
+// release drops the page's hold on its PageStore, freeing the store if
+// no page anywhere uses it any more, and points the page back at its
+// own memory.
+void
+RAM::release(uint8_t page)
+{
+	PageStore	*store = this->shared[page];
+
+	if (store == NULL)
+		return;
+	this->shared[page] = NULL;
+	this->mem[page] = this->ram + page * PAGE_SIZE;
+	if (!this->is_io(page))
+		this->rd[page] = this->mem[page];
+	drop_store(store);
+}
+
+
+// changed marks the page dirty and tells the watcher, if it was
+// watching, that the page was rewritten behind the guest's back.
+void
+RAM::changed(uint8_t page)
+{
+	this->dirty[page] = 1;
+	if (this->watched[page]) {
+		this->watched[page] = 0;
+		this->watcher->written(page);
+	}
+	this->set_write(page);
+}
+
+
+// map_io hands the page over to the I/O handlers. Either handler may be
+// NULL: reads then see zero and writes are dropped.
 void
-RAM::poke(uint16_t loc, uint8_t val)
+RAM::map_io(uint8_t page, io_read r, io_write w, void *ctx)
 {
-	this->ram[loc] = val;
+	this->changed(page);
+	this->io_rd[page] = r;
+	this->io_wr[page] = w;
+	this->io_ctx[page] = ctx;
+	this->rd[page] = NULL;
+	this->wr[page] = NULL;
 }
 
 
+// unmap_io gives the page back to memory.
+void
+RAM::unmap_io(uint8_t page)
+{
+	if (!this->is_io(page))
+		return;
+	this->io_rd[page] = NULL;
+	this->io_wr[page] = NULL;
+	this->io_ctx[page] = NULL;
+	this->rd[page] = this->mem[page];
+	this->set_write(page);
+}
+
+
+// peek_slow reads from a page with no read pointer, which is always an
+// I/O page.
 uint8_t
-RAM::peek(uint16_t loc)
+RAM::peek_slow(uint16_t loc)
+{
+	uint8_t	page = loc >> 8;
+
+	if (this->io_rd[page] == NULL)
+		return 0;
+	return this->io_rd[page](this->io_ctx[page], loc);
+}
+
+
+// poke_slow writes to a page with no write pointer: an I/O page, ROM
+// (where the write is dropped), or a memory page that is watched,
+// shared, not yet written since the last reset, or not yet dirty.
+void
+RAM::poke_slow(uint16_t loc, uint8_t val)
 {
-	return this->ram[loc];
+	uint8_t	page = loc >> 8;
+
+	if (this->is_io(page)) {
+		if (this->io_wr[page] != NULL)
+			this->io_wr[page](this->io_ctx[page], loc, val);
+		return;
+	}
+	if (this->readonly[page])
+		return;
+	this->unshare(page, true);
+	this->mem[page][loc & 0xff] = val;
+	this->touched[page] = 1;
+	this->changed(page);
 }
 
 
+// load copies len bytes into the address space at offset, a page at a
+// time. Memory pages are copied directly; I/O pages see one write per
+// byte. ROM, and anything past the top of the address space, is left
+// alone.
 void
 RAM::load(const void *src, uint16_t offset, uint16_t len)
 {
-	memcpy(this->ram+offset, src, len);
+	const unsigned char	*p = (const unsigned char *)src;
+	uint32_t		 addr = offset;
+	uint32_t		 end = (uint32_t)offset + len;
+	uint32_t		 n, i;
+	uint8_t			 page;
+
+	if (end > 0x10000)
+		end = 0x10000;
+	for (; addr < end; addr += n, p += n) {
+		page = addr >> 8;
+		n = PAGE_SIZE - (addr & 0xff);
+		if (n > end - addr)
+			n = end - addr;
+		if (this->readonly[page])
+			continue;
+		if (!this->is_io(page)) {
+			this->unshare(page, n < PAGE_SIZE);
+			memcpy(this->mem[page] + (addr & 0xff), p, n);
+			this->touched[page] = 1;
+			this->changed(page);
+			continue;
+		}
+		for (i = 0; i < n; ++i)
+			this->poke_slow((uint16_t)(addr + i), p[i]);
+	}
 }
 
 
+// store copies len bytes out of the address space at offset, stopping
+// at the top of the address space.
 void
 RAM::store(void *dest, uint16_t offset, uint16_t len)
 {
-	memcpy(dest, this->ram+offset, len);
+	unsigned char	*p = (unsigned char *)dest;
+	uint32_t	 addr = offset;
+	uint32_t	 end = (uint32_t)offset + len;
+	uint32_t	 n, i;
+	uint8_t		 page;
+
+	if (end > 0x10000)
+		end = 0x10000;
+	for (; addr < end; addr += n, p += n) {
+		page = addr >> 8;
+		n = PAGE_SIZE - (addr & 0xff);
+		if (n > end - addr)
+			n = end - addr;
+		if (this->rd[page] != NULL) {
+			memcpy(p, this->rd[page] + (addr & 0xff), n);
+			continue;
+		}
+		for (i = 0; i < n; ++i)
+			p[i] = this->peek_slow((uint16_t)(addr + i));
+	}
+}
+
+
+/*
+ * map_file maps the file into the address space at addr. The part of
+ * the file that starts on a host page boundary is mapped in place, so
+ * it costs page faults rather than a copy; whatever is left over (all
+ * of it if addr is not host-page aligned) is read in. A ROM is mapped
+ * read-only and its pages dropped from the write side of the bus;
+ * otherwise the mapping is private, so guest writes never reach the
+ * file. Returns false, with errno set, if the file could not be read.
+ */
+bool
+RAM::map_file(const char *path, uint16_t addr, bool rom)
+{
+	struct stat	 st;
+	size_t		 host = (size_t)sysconf(_SC_PAGESIZE);
+	size_t		 len, mapped = 0, page, start;
+	ssize_t		 n;
+	int		 fd, prot = PROT_READ;
+	void		*p;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return false;
+	}
+	len = (size_t)st.st_size;
+	if (len > 0x10000 - (size_t)addr)
+		len = 0x10000 - (size_t)addr;
+	if (len == 0) {
+		close(fd);
+		return true;
+	}
+
+	for (page = addr >> 8; page <= (addr + len - 1) >> 8; ++page) {
+		this->unshare((uint8_t)page, true);
+		this->touched[page] = 1;
+		this->changed((uint8_t)page);
+	}
+	this->file_mapped = true;
+
+	if (!rom)
+		prot |= PROT_WRITE;
+	if (addr % host == 0 && len >= host) {
+		mapped = len & ~(host - 1);
+		p = mmap(this->ram + addr, mapped, prot,
+		    MAP_PRIVATE|MAP_FIXED, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+	}
+	if (mapped < len) {
+		start = (addr + mapped) & ~(host - 1);
+		if (mprotect(this->ram + start, addr + len - start,
+		    PROT_READ|PROT_WRITE) == -1) {
+			close(fd);
+			return false;
+		}
+	}
+	while (mapped < len) {
+		n = pread(fd, this->ram + addr + mapped, len - mapped,
+		    (off_t)mapped);
+		if (n <= 0) {
+			close(fd);
+			return false;
+		}
+		mapped += (size_t)n;
+	}
+	close(fd);
+
+	for (page = addr >> 8; page <= (addr + len - 1) >> 8; ++page) {
+		this->readonly[page] = rom;
+		this->set_write((uint8_t)page);
+	}
+	return true;
+}
+
+
+// map_rom maps a ROM image read-only into the address space at addr.
+bool
+RAM::map_rom(const char *path, uint16_t addr)
+{
+	return this->map_file(path, addr, true);
+}
+
+
+/*
+ * map_rom maps a shared ROM image read-only into the address space at
+ * addr, which must start a page. Every whole page of the image is
+ * shared rather than copied; a partial last page is copied in, the
+ * rest of it keeping what was there. Returns false, with errno set, if
+ * the image is empty or addr is not page aligned.
+ */
+bool
+RAM::map_rom(RomImage &rom, uint16_t addr)
+{
+	size_t	len = rom.len;
+	size_t	off;
+	uint8_t	page;
+
+	if (rom.store == NULL || (addr & 0xff) != 0) {
+		errno = EINVAL;
+		return false;
+	}
+	if (len > 0x10000 - (size_t)addr)
+		len = 0x10000 - (size_t)addr;
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		page = (uint8_t)((addr + off) >> 8);
+		if (len - off < PAGE_SIZE) {
+			this->unshare(page, true);
+			memcpy(this->mem[page], rom.store->mem + off,
+			    len - off);
+			this->touched[page] = 1;
+		} else {
+			this->unshare(page, false);
+			this->shared[page] = rom.store;
+			rom.store->refs.fetch_add(1);
+			this->mem[page] = rom.store->mem + off;
+			if (!this->is_io(page))
+				this->rd[page] = this->mem[page];
+		}
+		this->readonly[page] = 1;
+		this->changed(page);
+	}
+	return true;
+}
+
+
+// map_image maps a memory image into the address space at addr. The
+// guest can write to it; the file is never modified.
+bool
+RAM::map_image(const char *path, uint16_t addr)
+{
+	return this->map_file(path, addr, false);
+}
+
+
+/*
+ * map_ram backs all of memory with the file, which is grown to size if
+ * it is shorter: the guest's memory is the file's contents, and guest
+ * writes go to the file. ROMs and images should be mapped after this.
+ * Returns false, with errno set, if the file could not be mapped.
+ */
+bool
+RAM::map_ram(const char *path)
+{
+	struct stat	 st;
+	size_t		 len = this->alloc_size();
+	size_t		 page;
+	int		 fd;
+	void		*p;
+
+	fd = open(path, O_RDWR|O_CREAT, 0644);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) == -1 ||
+	    ((size_t)st.st_size < len && ftruncate(fd, (off_t)len) == -1)) {
+		close(fd);
+		return false;
+	}
+	p = mmap(this->ram, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+	    fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	this->file_backed = true;
+	this->file_mapped = true;
+	for (page = 0; page < NPAGES; ++page) {
+		this->unshare((uint8_t)page, false);
+		this->touched[page] = 1;
+		this->readonly[page] = 0;
+		this->changed((uint8_t)page);
+	}
+	return true;
+}
+
+
+// track_dirty starts (or restarts) dirty page tracking: every page is
+// marked clean, and the first write to each one afterwards marks it
+// dirty again.
+void
+RAM::track_dirty()
+{
+	size_t	page;
+
+	this->tracking = true;
+	for (page = 0; page < NPAGES; ++page) {
+		this->dirty[page] = 0;
+		this->set_write((uint8_t)page);
+	}
+}
+
+
+// is_dirty returns true if the page may have been written since
+// track_dirty was last called. Every page is dirty until then.
+bool
+RAM::is_dirty(uint8_t page)
+{
+	return this->dirty[page] != 0;
+}
+
+
+// is_rom returns true if the page is mapped from a ROM image.
+bool
+RAM::is_rom(uint8_t page)
+{
+	return this->readonly[page] != 0;
+}
+
+
+// read_page copies the memory behind the page, bypassing any I/O
+// handlers.
+void
+RAM::read_page(uint8_t page, unsigned char *dest)
+{
+	memcpy(dest, this->mem[page], PAGE_SIZE);
+}
+
+
+// write_page replaces the memory behind the page, bypassing any I/O
+// handlers. ROM pages are left alone.
+void
+RAM::write_page(uint8_t page, const unsigned char *src)
+{
+	if (this->readonly[page])
+		return;
+	this->unshare(page, false);
+	memcpy(this->mem[page], src, PAGE_SIZE);
+	this->touched[page] = 1;
+	this->changed(page);
+}
+
+
+/*
+ * fork makes child a copy of this memory, I/O pages, ROM, and dirty
+ * page state included, without copying any of it. Pages this RAM owns
+ * are retired to a PageStore, along with the mapping they live in, and
+ * a fresh mapping takes its place for later copies; then both sides
+ * share every page until they write to it. Whatever the child held
+ * before is dropped, and its watcher is told; if files were mapped into
+ * it, its memory is replaced with fresh memory, since copies of shared
+ * pages are made there. A fork cannot be taken of
+ * memory backed by a file with map_ram, since the parent would stop
+ * writing to the file.
+ */
+bool
+RAM::fork(RAM &child)
+{
+	PageStore	*store = NULL;
+	unsigned char	*fresh;
+	size_t		 page;
+
+	if (this->file_backed) {
+		errno = ENOTSUP;
+		return false;
+	}
+
+	for (page = 0; page < NPAGES; ++page) {
+		if (this->shared[page] != NULL)
+			continue;
+		if (store == NULL) {
+			store = new PageStore;
+			store->len = this->alloc_size();
+			store->refs = 0;
+			try {
+				store->mem = this->ram;
+				this->ram = take_memory(this->arena);
+			} catch (...) {
+				delete store;
+				throw;
+			}
+			store->arena = this->arena;
+			store->mapped = this->file_mapped;
+			memcpy(store->touched, this->touched, NPAGES);
+			memset(this->touched, 0, NPAGES);
+			this->file_mapped = false;
+		}
+		this->shared[page] = store;
+		store->refs.fetch_add(1);
+		this->set_write((uint8_t)page);
+	}
+
+	if (child.file_mapped) {
+		fresh = take_memory(child.arena);
+		for (page = 0; page < NPAGES; ++page)
+			child.release((uint8_t)page);
+		give_memory(child.arena, child.ram, child.touched, true);
+		child.ram = fresh;
+		memset(child.touched, 0, NPAGES);
+		child.file_mapped = false;
+		child.file_backed = false;
+	}
+
+	child.tracking = this->tracking;
+	for (page = 0; page < NPAGES; ++page) {
+		child.release((uint8_t)page);
+		child.shared[page] = this->shared[page];
+		this->shared[page]->refs.fetch_add(1);
+		child.mem[page] = this->mem[page];
+		child.rd[page] = this->rd[page];
+		child.io_rd[page] = this->io_rd[page];
+		child.io_wr[page] = this->io_wr[page];
+		child.io_ctx[page] = this->io_ctx[page];
+		child.readonly[page] = this->readonly[page];
+		child.changed((uint8_t)page);
+		child.dirty[page] = this->dirty[page];
+		child.set_write((uint8_t)page);
+	}
+	return true;
+}
+
+
+RomImage::RomImage()
+{
+	this->store = NULL;
+	this->len = 0;
+}
+
+
+RomImage::~RomImage()
+{
+	if (this->store != NULL)
+		drop_store(this->store);
+}
+
+
+// load copies len bytes from src into the image.
+bool
+RomImage::load(const void *src, size_t n)
+{
+	size_t		 host = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char	*p;
+
+	if (this->store != NULL) {
+		errno = EBUSY;
+		return false;
+	}
+	if (n > 0x10000)
+		n = 0x10000;
+	if (n == 0) {
+		errno = EINVAL;
+		return false;
+	}
+	this->store = new PageStore;
+	this->store->len = (n + host - 1) & ~(host - 1);
+	this->store->refs = 1;
+	this->store->arena = NULL;
+	try {
+		p = map_memory(this->store->len);
+	} catch (...) {
+		delete this->store;
+		this->store = NULL;
+		throw;
+	}
+	memcpy(p, src, n);
+	mprotect(p, this->store->len, PROT_READ);
+	this->store->mem = p;
+	this->len = n;
+	return true;
+}
+
+
+// load maps the file into the image, so that its pages come straight
+// from the page cache.
+bool
+RomImage::load(const char *path)
+{
+	struct stat	 st;
+	size_t		 host = (size_t)sysconf(_SC_PAGESIZE);
+	size_t		 n;
+	int		 fd;
+	void		*p;
+
+	if (this->store != NULL) {
+		errno = EBUSY;
+		return false;
+	}
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return false;
+	}
+	n = (size_t)st.st_size;
+	if (n > 0x10000)
+		n = 0x10000;
+	if (n == 0) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	p = mmap(NULL, (n + host - 1) & ~(host - 1), PROT_READ, MAP_PRIVATE,
+	    fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	this->store = new PageStore;
+	this->store->mem = (unsigned char *)p;
+	this->store->len = (n + host - 1) & ~(host - 1);
+	this->store->refs = 1;
+	this->store->arena = NULL;
+	this->len = n;
+	return true;
+}
+
+
+// size returns the length of the image in bytes.
+size_t
+RomImage::size()
+{
+	return this->len;
 }
@@ -19,33 +19,286 @@
 #define __6502_RAM_H
 
 
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+
 // 131072 bytes is 128k of RAM.
 const size_t	DEFAULT_MEM = 131072;
 
 
+// Pages are 256 bytes; the 6502 address space has 256 of them.
+const size_t	PAGE_SIZE = 256;
+const size_t	NPAGES = 256;
+
+
+// A PageWatcher is told when the guest writes to a watched page.
+class PageWatcher {
+	public:
+		virtual ~PageWatcher() {}
+		virtual void written(uint8_t) = 0;
+};
+
+
+// I/O handlers service accesses to a page registered with map_io. They
+// get the context pointer given to map_io and the full address.
+typedef uint8_t	(*io_read)(void *, uint16_t);
+typedef void	(*io_write)(void *, uint16_t, uint8_t);
+
+
+// A PageStore holds memory pages shared between RAMs; see ram.cc.
+struct PageStore;
+
+
+/*
+ * A RomImage is a ROM loaded once and mapped read-only into the bus of
+ * any number of RAMs, which all read the same memory instead of each
+ * holding a copy. Once loaded it never changes. The memory lives as
+ * long as any RAM still maps it, so the image can be deleted as soon as
+ * it has been mapped everywhere it is needed.
+ */
+class RomImage {
+	private:
+		PageStore	*store;
+		size_t		 len;
+
+		friend class RAM;
+
+		RomImage(const RomImage &) = delete;
+		RomImage &operator=(const RomImage &) = delete;
+	public:
+		RomImage();
+		~RomImage();
+
+		// load fills the image from memory or from a file, up
+		// to 64K. It returns false, with errno set, if the file
+		// cannot be read or the image is already loaded.
+		bool load(const void *, size_t);
+		bool load(const char *);
+		size_t size(void);
+};
+
+
+/*
+ * An Arena hands out the memory behind RAMs as aligned slabs carved
+ * from large chunks, instead of mapping memory for every RAM, and takes
+ * the slabs back when the RAMs are done with them. Slabs always come
+ * back clear: a RAM clears only the pages it wrote before returning
+ * its slab, so recycling one costs a memset per page used instead of a
+ * fresh mapping and a page fault per page. Chunks can be backed by
+ * transparent huge pages where the host has them. An Arena can be
+ * shared between threads, and must outlive every RAM using it.
+ */
+class Arena {
+	private:
+		// An ArenaChunk records one mapping for the destructor.
+		struct ArenaChunk {
+			unsigned char	*base;
+			size_t		 len;
+			ArenaChunk	*next;
+		};
+
+		std::mutex	 lock;
+		bool		 huge;
+		ArenaChunk	*chunks;
+		size_t		 total;
+		unsigned char	*free_slabs;
+		unsigned char	*fresh;
+		unsigned char	*fresh_end;
+
+		void grow(void);
+
+		Arena(const Arena &) = delete;
+		Arena &operator=(const Arena &) = delete;
+	public:
+		Arena();
+		Arena(bool);
+		~Arena();
+
+		// take returns a clear slab; give returns one, first
+		// clearing the pages flagged in the page map, if any.
+		unsigned char *take(void);
+		void give(unsigned char *, const uint8_t *);
+
+		// mapped returns how much memory the arena has mapped.
+		size_t mapped(void);
+};
+
+
+/*
+ * RAM is the memory bus. Memory always backs the whole 64K address
+ * space, even if less was asked for, and nothing past it; individual
+ * pages can be handed to I/O handlers. Reads and writes go through a table of per-page
+ * pointers: a memory page is accessed directly, and a NULL entry sends
+ * the access down the slow path to the I/O handlers or the page
+ * watcher. Watching a page just clears its write pointer, so unwatched
+ * writes pay nothing for it. Instructions are always fetched straight
+ * from memory; the I/O handlers only see data accesses.
+ *
+ * The memory is one mapping, so ROM and memory images can be mapped
+ * from files straight over the pages they load into, and all of it can
+ * be backed by a file. ROM pages are read-only: guest writes to them
+ * are dropped.
+ *
+ * Once track_dirty has been called, clean pages are write-protected the
+ * same way, so the first write to each page since then marks it dirty
+ * and later writes go at full speed. Pages not written since the last
+ * reset are always write-protected, so that reset only has to clear
+ * the pages that were written.
+ *
+ * A RomImage's pages are shared the same way, except that they are
+ * ROM and never written to.
+ *
+ * fork shares every page with another RAM copy-on-write: the pages move
+ * to a PageStore that neither side writes to, and the first write to a
+ * shared page copies it back into the writer's own memory. mem holds
+ * where each page currently lives, whether it is on the bus or not.
+ */
 class RAM {
 	private:
 		unsigned char	*ram;
 		size_t		 ram_size;
+		PageWatcher	*watcher;
+		unsigned char	*mem[NPAGES];
+		unsigned char	*rd[NPAGES];
+		unsigned char	*wr[NPAGES];
+		PageStore	*shared[NPAGES];
+		uint8_t		 watched[NPAGES];
+		uint8_t		 readonly[NPAGES];
+		uint8_t		 dirty[NPAGES];
+		uint8_t		 touched[NPAGES];
+		bool		 tracking;
+		bool		 file_backed;
+		bool		 file_mapped;
+		Arena		*arena;
+		io_read		 io_rd[NPAGES];
+		io_write	 io_wr[NPAGES];
+		void		*io_ctx[NPAGES];
+
+		void init(size_t, Arena *);
+		size_t alloc_size(void);
+		uint8_t peek_slow(uint16_t);
+		void poke_slow(uint16_t, uint8_t);
+		void changed(uint8_t);
+		void set_write(uint8_t);
+		void unshare(uint8_t, bool);
+		void release(uint8_t);
+		uint8_t memory(uint16_t);
+		bool map_file(const char *, uint16_t, bool);
+
+		RAM(const RAM &) = delete;
+		RAM &operator=(const RAM &) = delete;
 	public:
 		RAM();
 		RAM(size_t);
+		RAM(size_t, Arena *);
+		~RAM();
 
 		// Control.
 		size_t size();
+		Arena *get_arena(void);
 		void reset(void);
 
 		// Debug.
 		void dump(void);
 
+		// Page watching.
+		void set_watcher(PageWatcher *);
+		void watch(uint8_t);
+		void unwatch(uint8_t);
+
+		// I/O pages: accesses to the page call the handlers
+		// instead of touching memory, until unmap_io is called.
+		void map_io(uint8_t, io_read, io_write, void *);
+		void unmap_io(uint8_t);
+		bool is_io(uint8_t);
+
 		// Memory location access and store.
 		void poke(uint16_t, uint8_t);
 		uint8_t peek(uint16_t);
 
+		// fetch reads an instruction: the opcode is returned in
+		// the low byte, and the two bytes after it above that.
+		uint32_t fetch(uint16_t);
+
 		// Memory load and store.
 		void load(const void *, uint16_t, uint16_t);
 		void store(void *, uint16_t, uint16_t);
+
+		// File-backed memory: ROM and memory images mapped at an
+		// address, and memory backed by a file. They return false
+		// with errno set on failure.
+		bool map_rom(const char *, uint16_t);
+		bool map_rom(RomImage &, uint16_t);
+		bool map_image(const char *, uint16_t);
+		bool map_ram(const char *);
+
+		// Dirty page tracking and raw page access, for snapshots.
+		void track_dirty(void);
+		bool is_dirty(uint8_t);
+		bool is_rom(uint8_t);
+		void read_page(uint8_t, unsigned char *);
+		void write_page(uint8_t, const unsigned char *);
+
+		// fork makes the other RAM a copy-on-write copy of this
+		// one. It returns false, with errno set, if the memory is
+		// backed by a file.
+		bool fork(RAM &);
 };
 
 
+inline uint8_t
+RAM::peek(uint16_t loc)
+{
+	unsigned char	*page = this->rd[loc >> 8];
+
+	if (page != NULL)
+		return page[loc & 0xff];
+	return this->peek_slow(loc);
+}
+
+
+inline void
+RAM::poke(uint16_t loc, uint8_t val)
+{
+	unsigned char	*page = this->wr[loc >> 8];
+
+	if (page != NULL)
+		page[loc & 0xff] = val;
+	else
+		this->poke_slow(loc, val);
+}
+
+
+// memory reads the memory behind an address, bypassing any I/O
+// handlers.
+inline uint8_t
+RAM::memory(uint16_t loc)
+{
+	return this->mem[loc >> 8][loc & 0xff];
+}
+
+
+inline uint32_t
+RAM::fetch(uint16_t loc)
+{
+	const unsigned char	*page = this->mem[loc >> 8];
+	unsigned		 off = loc & 0xff;
+
+	if (off < PAGE_SIZE - 2)
+		return page[off] | (page[off + 1] << 8) |
+		    (page[off + 2] << 16);
+	return this->memory(loc) | (this->memory((uint16_t)(loc + 1)) << 8) |
+	    (this->memory((uint16_t)(loc + 2)) << 16);
+}
+
+
+inline bool
+RAM::is_io(uint8_t page)
+{
+	return this->rd[page] == NULL;
+}
+
+
 #endif
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+#include "cpu.h"
+
+
+/*
+ * A snapshot is a header followed by memory pages, all little-endian:
+ *
+ *	 0	"K65S"
+ *	 4	version (2 bytes), SNAPSHOT_VERSION
+ *	 6	kind, SNAPSHOT_FULL or SNAPSHOT_DELTA
+ *	 7	reserved, zero
+ *	 8	steps (8 bytes)
+ *	16	cycles (8 bytes)
+ *	24	PC (2 bytes)
+ *	26	A, X, Y, P, S
+ *	31	reserved, zero
+ *	32	page count (2 bytes)
+ *	34	pages: page number, then its 256 bytes
+ *
+ * A full snapshot holds every page but ROM; a delta holds the pages
+ * written since the previous snapshot of either kind.
+ */
+static const char	snapshot_magic[4] = {'K', '6', '5', 'S'};
+static const size_t	SNAPSHOT_HEADER = 34;
+
+
+static void
+put_le(unsigned char *buf, uint64_t v, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i)
+		buf[i] = (unsigned char)(v >> (8 * i));
+}
+
+
+static uint64_t
+get_le(const unsigned char *buf, size_t n)
+{
+	uint64_t	v = 0;
+	size_t		i;
+
+	for (i = n; i > 0; --i)
+		v = (v << 8) | buf[i - 1];
+	return v;
+}
+
+
+// save writes a snapshot. After it, all pages count as clean, so the
+// next delta holds only what changed from here. It returns false if
+// the stream fails.
+bool
+CPU::save(std::ostream &out, snapshot_kind kind)
+{
+	unsigned char	hdr[SNAPSHOT_HEADER];
+	unsigned char	page[PAGE_SIZE + 1];
+	size_t		n, i;
+
+	for (n = 0, i = 0; i < NPAGES; ++i) {
+		if (this->snapshot_page((uint8_t)i, kind))
+			n++;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, snapshot_magic, sizeof(snapshot_magic));
+	put_le(hdr + 4, SNAPSHOT_VERSION, 2);
+	hdr[6] = (unsigned char)kind;
+	put_le(hdr + 8, this->steps, 8);
+	put_le(hdr + 16, this->cycles, 8);
+	put_le(hdr + 24, this->pc, 2);
+	hdr[26] = this->a;
+	hdr[27] = this->x;
+	hdr[28] = this->y;
+	hdr[29] = this->status();
+	hdr[30] = this->s;
+	put_le(hdr + 32, n, 2);
+	out.write((const char *)hdr, SNAPSHOT_HEADER);
+
+	for (i = 0; i < NPAGES; ++i) {
+		if (!this->snapshot_page((uint8_t)i, kind))
+			continue;
+		page[0] = (unsigned char)i;
+		this->ram.read_page((uint8_t)i, page + 1);
+		out.write((const char *)page, sizeof(page));
+	}
+
+	this->ram.track_dirty();
+	return out.good();
+}
+
+
+// snapshot_page returns true if the page belongs in a snapshot.
+bool
+CPU::snapshot_page(uint8_t page, snapshot_kind kind)
+{
+	if (this->ram.is_rom(page))
+		return false;
+	return kind == SNAPSHOT_FULL || this->ram.is_dirty(page);
+}
+
+
+// restore loads a snapshot written by save. A delta is applied on top
+// of the current state, which should be the one it was taken from.
+// Restored memory is clean for the next delta. It returns false if the
+// stream does not hold a valid snapshot; memory may then have been
+// partly restored, but the registers are untouched.
+bool
+CPU::restore(std::istream &in)
+{
+	unsigned char	hdr[SNAPSHOT_HEADER];
+	unsigned char	page[PAGE_SIZE + 1];
+	size_t		n, i;
+
+	if (!in.read((char *)hdr, SNAPSHOT_HEADER))
+		return false;
+	if (memcmp(hdr, snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+	    get_le(hdr + 4, 2) != SNAPSHOT_VERSION ||
+	    (hdr[6] != SNAPSHOT_FULL && hdr[6] != SNAPSHOT_DELTA))
+		return false;
+	n = (size_t)get_le(hdr + 32, 2);
+	if (n > NPAGES)
+		return false;
+
+	for (i = 0; i < n; ++i) {
+		if (!in.read((char *)page, sizeof(page)))
+			return false;
+		this->ram.write_page(page[0], page + 1);
+	}
+
+	this->steps = (size_t)get_le(hdr + 8, 8);
+	this->cycles = (size_t)get_le(hdr + 16, 8);
+	this->pc = (cpu_register16)get_le(hdr + 24, 2);
+	this->a = hdr[26];
+	this->x = hdr[27];
+	this->y = hdr[28];
+	this->set_status(hdr[29]);
+	this->s = hdr[30];
+	this->ram.track_dirty();
+	return true;
+}
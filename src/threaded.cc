@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "cpu.h"
+#include "instructions.h"
+#include "opcodes.h"
+
+
+// Labels as values and computed goto are GNU extensions. The engine is
+// one very large function, so it is flattened: otherwise the compiler
+// runs out of inlining budget partway through the handlers.
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define THREADED_FLATTEN	__attribute__((flatten))
+#else
+#define THREADED_FLATTEN
+#endif
+
+
+/*
+ * run_threaded is the threaded-code execution engine. Every opcode has
+ * its own label holding the inlined handler followed by its own copy of
+ * the fetch-and-dispatch sequence, so the host branch predictor sees one
+ * indirect jump per guest opcode rather than one shared jump for all of
+ * them. It shares all state with the table engine. It runs until the
+ * CPU halts (returning false) or the step count reaches limit
+ * (returning true).
+ */
+THREADED_FLATTEN bool
+CPU::run_threaded(size_t limit)
+{
+#if defined(__GNUC__)
+#define THREADED_LABEL(op, insn, mode, cycles)	&&op_##op,
+	static void *const	labels[256] = {
+		K6502_OPCODES(THREADED_LABEL)
+	};
+#undef THREADED_LABEL
+	uint32_t	word;
+	uint8_t		op;
+	uint16_t	arg;
+
+#define THREADED_NEXT()						\
+	do {							\
+		if (this->steps == limit)			\
+			return true;				\
+		word = this->ram.fetch(this->pc);		\
+		op = word & 0xff;				\
+		arg = word >> 8;				\
+		this->pc += length[op];				\
+		this->steps++;					\
+		goto *labels[op];				\
+	} while (0)
+
+#define THREADED_HANDLER(op, insn, mode, ncycles)		\
+	op_##op:						\
+		this->cycles += ncycles;			\
+		if (!this->insn<MODE_##mode>(arg))		\
+			return false;				\
+		THREADED_NEXT();
+
+	THREADED_NEXT();
+	K6502_OPCODES(THREADED_HANDLER)
+#undef THREADED_HANDLER
+#undef THREADED_NEXT
+#else
+	return this->run_table(limit);
+#endif
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * throughput measures how fast each execution engine runs a set of
+ * guest programs: the easy6502 programs and a long, loop-heavy one.
+ * Every pairing of program and engine is warmed up first, which also
+ * finds how many runs make a sample last at least the minimum time,
+ * and then timed over several samples on the steady clock. Each run
+ * starts from a reset CPU with the program freshly loaded, so the
+ * short programs measure the cost of starting a run as much as of
+ * running it.
+ *
+ * The results are tab-separated, one line per program and engine under
+ * a header line, so that runs from different releases can be compared:
+ *
+ *	version program engine insns runs seconds mips ns_per_insn
+ *
+ * insns is the instructions in one run and runs the runs in a sample;
+ * seconds is the median sample's time, and mips and ns_per_insn are
+ * worked out from it.
+ *
+ * usage: throughput [samples [min_ms]]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include "cpu.h"
+#include "programs.h"
+
+#ifndef VERSION
+#define VERSION	"unknown"
+#endif
+
+
+// Three nested counted loops around a load, add, and store: 256 * 256
+// * 8 passes, a little over 3 million instructions.
+static const unsigned char	long_loop[] = {
+	0xa9, 0x00,		// LDA #$00
+	0x85, 0x20,		// STA $20
+	0xa0, 0x00,		// LDY #$00
+	0xa2, 0x00,		// LDX #$00
+	0xbd, 0x00, 0x02,	// LDA $0200,X
+	0x18,			// CLC
+	0x65, 0x20,		// ADC $20
+	0x9d, 0x00, 0x02,	// STA $0200,X
+	0xca,			// DEX
+	0xd0, 0xf4,		// BNE -12
+	0xc8,			// INY
+	0xd0, 0xef,		// BNE -17
+	0xe6, 0x20,		// INC $20
+	0xa5, 0x20,		// LDA $20
+	0xc9, 0x08,		// CMP #$08
+	0xd0, 0xe5,		// BNE -27
+	0x00			// BRK
+};
+
+static const GuestProgram	long_loop_program = {
+	"long_loop", long_loop, sizeof(long_loop)
+};
+
+
+static const struct {
+	const char	*name;
+	cpu_engine	 engine;
+} engines[] = {
+	{"table", ENGINE_TABLE},
+	{"threaded", ENGINE_THREADED},
+	{"cached", ENGINE_CACHED},
+	{"jit", ENGINE_JIT}
+};
+static const size_t	nengines = sizeof(engines) / sizeof(engines[0]);
+
+
+// time_runs runs the program runs times and returns how long that took
+// in seconds. insns is set to the instructions in the last run.
+static double
+time_runs(CPU &cpu, const GuestProgram &prog, size_t runs, size_t *insns)
+{
+	std::chrono::steady_clock::time_point	start, stop;
+	size_t					i;
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < runs; ++i) {
+		cpu.reset();
+		cpu.load(prog.code, 0x300, prog.size);
+		cpu.set_entry(0x300);
+		cpu.run(false);
+	}
+	stop = std::chrono::steady_clock::now();
+
+	*insns = cpu.get_steps();
+	return std::chrono::duration<double>(stop - start).count();
+}
+
+
+// measure warms up and times the program on the engine, printing one
+// line of results.
+static void
+measure(const GuestProgram &prog, size_t eng, size_t samples,
+    double min_secs)
+{
+	CPU	 cpu(0x400, engines[eng].engine);
+	double	*secs = new double[samples];
+	double	 median;
+	size_t	 runs = 1, insns, i;
+
+	// Warm up, doubling the runs until a batch takes long enough.
+	while (time_runs(cpu, prog, runs, &insns) < min_secs)
+		runs *= 2;
+
+	for (i = 0; i < samples; ++i)
+		secs[i] = time_runs(cpu, prog, runs, &insns);
+	std::sort(secs, secs + samples);
+	median = secs[samples / 2];
+	delete[] secs;
+
+	std::cout << VERSION << "\t" << prog.name << "\t"
+		  << engines[eng].name << "\t" << insns << "\t" << runs
+		  << "\t" << median << "\t"
+		  << (double)(insns * runs) / median / 1000000.0 << "\t"
+		  << median * 1e9 / (double)(insns * runs) << "\n";
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t	samples = 5;
+	double	min_secs = 0.05;
+	size_t	i, eng;
+
+	if (argc > 1)
+		samples = (size_t)atoi(argv[1]);
+	if (argc > 2)
+		min_secs = atof(argv[2]) / 1000.0;
+	if (samples == 0)
+		samples = 1;
+
+	std::cout << "version\tprogram\tengine\tinsns\truns\tseconds\tmips"
+		  << "\tns_per_insn\n";
+	for (eng = 0; eng < nengines; ++eng) {
+		for (i = 0; i < neasy6502_programs; ++i)
+			measure(easy6502_programs[i], eng, samples, min_secs);
+		measure(long_loop_program, eng, samples, min_secs);
+	}
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include "disasm.h"
+#include "trace.h"
+
+
+// pack_record packs a trace record as: PC (2 bytes), opcode, two
+// operand bytes, A, X, Y, P, S, the effective address (2 bytes), and
+// the low 48 bits of the step and cycle counts, all little-endian.
+static void
+pack_record(const TraceRecord &rec, uint8_t *buf)
+{
+	int	i;
+
+	buf[0] = (uint8_t)(rec.pc & 0xff);
+	buf[1] = (uint8_t)(rec.pc >> 8);
+	buf[2] = rec.op;
+	buf[3] = rec.arg[0];
+	buf[4] = rec.arg[1];
+	buf[5] = rec.a;
+	buf[6] = rec.x;
+	buf[7] = rec.y;
+	buf[8] = rec.p;
+	buf[9] = rec.s;
+	buf[10] = (uint8_t)(rec.ea & 0xff);
+	buf[11] = (uint8_t)(rec.ea >> 8);
+	for (i = 0; i < 6; ++i) {
+		buf[12+i] = (uint8_t)((uint64_t)rec.step >> (8 * i));
+		buf[18+i] = (uint8_t)((uint64_t)rec.cycle >> (8 * i));
+	}
+}
+
+
+// unpack_record is the inverse of pack_record.
+static void
+unpack_record(const uint8_t *buf, TraceRecord &rec)
+{
+	int	i;
+
+	rec.pc = (uint16_t)(buf[0] | (buf[1] << 8));
+	rec.op = buf[2];
+	rec.arg[0] = buf[3];
+	rec.arg[1] = buf[4];
+	rec.a = buf[5];
+	rec.x = buf[6];
+	rec.y = buf[7];
+	rec.p = buf[8];
+	rec.s = buf[9];
+	rec.ea = (uint16_t)(buf[10] | (buf[11] << 8));
+	rec.step = 0;
+	rec.cycle = 0;
+	for (i = 0; i < 6; ++i) {
+		rec.step |= (size_t)((uint64_t)buf[12+i] << (8 * i));
+		rec.cycle |= (size_t)((uint64_t)buf[18+i] << (8 * i));
+	}
+}
+
+
+TextTrace::TextTrace(std::ostream &dest) : out(dest)
+{
+}
+
+
+// record writes the PC, the instruction bytes and their disassembly,
+// the registers as they were before the instruction ran, the effective
+// address, and the step and cycle counts.
+void
+TextTrace::record(const TraceRecord &rec)
+{
+	const uint8_t	insn[3] = {rec.op, rec.arg[0], rec.arg[1]};
+	char		text[DISASM_MAX];
+
+	disassemble(rec.pc, insn, text, sizeof(text));
+	this->out << std::hex << std::setfill('0')
+		  << std::setw(4) << rec.pc << "  "
+		  << std::setw(2) << (unsigned int)rec.op << " "
+		  << std::setw(2) << (unsigned int)rec.arg[0] << " "
+		  << std::setw(2) << (unsigned int)rec.arg[1] << "  "
+		  << std::left << std::setfill(' ') << std::setw(12) << text
+		  << std::right << std::setfill('0')
+		  << "A:" << std::setw(2) << (unsigned int)rec.a
+		  << " X:" << std::setw(2) << (unsigned int)rec.x
+		  << " Y:" << std::setw(2) << (unsigned int)rec.y
+		  << " P:" << std::setw(2) << (unsigned int)rec.p
+		  << " S:" << std::setw(2) << (unsigned int)rec.s
+		  << " EA:" << std::setw(4) << rec.ea
+		  << std::dec << "  #" << rec.step << " @" << rec.cycle
+		  << "\n";
+}
+
+
+void
+TextTrace::flush()
+{
+	this->out.flush();
+}
+
+
+BinaryTrace::BinaryTrace(std::ostream &dest) : out(dest)
+{
+}
+
+
+// record writes the record packed as described at pack_record.
+void
+BinaryTrace::record(const TraceRecord &rec)
+{
+	uint8_t	buf[TRACE_RECORD_SIZE];
+
+	pack_record(rec, buf);
+	this->out.write((const char *)buf, TRACE_RECORD_SIZE);
+}
+
+
+void
+BinaryTrace::flush()
+{
+	this->out.flush();
+}
+
+
+// TraceRing keeps the last records (at least one) and passes them on
+// to out when flushed.
+TraceRing::TraceRing(size_t records, TraceSink *sink) :
+    capacity(records > 0 ? records : 1), slot(0), count(0), out(sink),
+    nbatch(0), stopping(false)
+{
+	this->ring = new uint8_t[this->capacity * TRACE_RECORD_SIZE];
+	this->batch = new uint8_t[this->capacity * TRACE_RECORD_SIZE];
+	this->writer = std::thread(&TraceRing::write_batches, this);
+}
+
+
+// The destructor waits for the writer to pass on what it has been
+// given; records not yet flushed are dropped.
+TraceRing::~TraceRing()
+{
+	{
+		std::lock_guard<std::mutex>	hold(this->lock);
+
+		this->stopping = true;
+	}
+	this->ready.notify_all();
+	this->writer.join();
+	delete[] this->batch;
+	delete[] this->ring;
+}
+
+
+void
+TraceRing::record(const TraceRecord &rec)
+{
+	pack_record(rec, this->ring + this->slot * TRACE_RECORD_SIZE);
+	if (++this->slot == this->capacity)
+		this->slot = 0;
+	if (this->count < this->capacity)
+		this->count++;
+}
+
+
+// flush copies the records gathered since the last flush, oldest
+// first, into the writer's batch. It only blocks if the writer is
+// still busy with the previous batch.
+void
+TraceRing::flush()
+{
+	std::unique_lock<std::mutex>	hold(this->lock);
+	size_t				first, head;
+
+	while (this->nbatch > 0)
+		this->ready.wait(hold);
+	if (this->count == 0)
+		return;
+
+	first = (this->slot + this->capacity - this->count) % this->capacity;
+	head = this->capacity - first;
+	if (head > this->count)
+		head = this->count;
+	memcpy(this->batch, this->ring + first * TRACE_RECORD_SIZE,
+	    head * TRACE_RECORD_SIZE);
+	memcpy(this->batch + head * TRACE_RECORD_SIZE, this->ring,
+	    (this->count - head) * TRACE_RECORD_SIZE);
+	this->nbatch = this->count;
+	this->count = 0;
+	hold.unlock();
+	this->ready.notify_all();
+}
+
+
+void
+TraceRing::fault()
+{
+	this->flush();
+}
+
+
+void
+TraceRing::wait()
+{
+	std::unique_lock<std::mutex>	hold(this->lock);
+
+	while (this->nbatch > 0)
+		this->ready.wait(hold);
+}
+
+
+// write_batches runs in the writer thread, passing each batch on to
+// the output sink until the ring is destroyed.
+void
+TraceRing::write_batches()
+{
+	std::unique_lock<std::mutex>	hold(this->lock);
+	TraceRecord			rec;
+	size_t				i;
+
+	for (;;) {
+		while (this->nbatch == 0 && !this->stopping)
+			this->ready.wait(hold);
+		if (this->nbatch == 0)
+			return;
+
+		hold.unlock();
+		for (i = 0; i < this->nbatch; ++i) {
+			unpack_record(this->batch + i * TRACE_RECORD_SIZE, rec);
+			this->out->record(rec);
+		}
+		this->out->flush();
+		hold.lock();
+		this->nbatch = 0;
+		this->ready.notify_all();
+	}
+}
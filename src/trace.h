@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2014 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __6502_TRACE_H
+#define __6502_TRACE_H
+
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+
+// A TraceRecord captures the state of the CPU immediately before an
+// instruction is executed. ea is the address the instruction reads or
+// writes (or jumps to, for JMP), and zero for instructions without one.
+struct TraceRecord {
+	uint16_t	pc;
+	uint8_t		op;
+	uint8_t		arg[2];
+	uint8_t		a;
+	uint8_t		x;
+	uint8_t		y;
+	uint8_t		p;
+	uint8_t		s;
+	uint16_t	ea;
+	size_t		step;
+	size_t		cycle;
+};
+
+
+// Size of a TraceRecord as written by a BinaryTrace.
+const size_t	TRACE_RECORD_SIZE = 24;
+
+
+// A TraceSink receives one record per executed instruction. A CPU with
+// no sink attached runs an uninstrumented loop, so the null sink costs
+// nothing; NullTrace exists for code that wants an object to pass around.
+// fault is called when an instruction stops the CPU abnormally, after
+// that instruction has been recorded.
+class TraceSink {
+	public:
+		virtual ~TraceSink() {}
+		virtual void record(const TraceRecord &) = 0;
+		virtual void flush(void) {}
+		virtual void fault(void) {}
+};
+
+
+class NullTrace : public TraceSink {
+	public:
+		void record(const TraceRecord &) {}
+};
+
+
+// TextTrace writes one human-readable line per instruction.
+class TextTrace : public TraceSink {
+	private:
+		std::ostream	&out;
+	public:
+		TextTrace(std::ostream &);
+
+		void record(const TraceRecord &);
+		void flush(void);
+};
+
+
+// BinaryTrace writes fixed-size little-endian records; see
+// TRACE_RECORD_SIZE for the record length.
+class BinaryTrace : public TraceSink {
+	private:
+		std::ostream	&out;
+	public:
+		BinaryTrace(std::ostream &);
+
+		void record(const TraceRecord &);
+		void flush(void);
+};
+
+
+/*
+ * TraceRing keeps the last records in a fixed-size ring of packed
+ * records, in the BinaryTrace format, so that recording an instruction
+ * is a copy into memory: nothing is allocated or written out. flush
+ * hands the records gathered since the last flush to a writer thread,
+ * which passes them on to the output sink, and returns without waiting
+ * for it; records that were overwritten before a flush are lost. A
+ * fault flushes the ring, so the instructions leading up to it are
+ * kept. The output sink is only used by the writer thread.
+ */
+class TraceRing : public TraceSink {
+	private:
+		uint8_t			*ring;
+		size_t			 capacity;
+		size_t			 slot;
+		size_t			 count;
+		TraceSink		*out;
+
+		// The writer thread's batch and its state.
+		uint8_t			*batch;
+		size_t			 nbatch;
+		bool			 stopping;
+		std::mutex		 lock;
+		std::condition_variable	 ready;
+		std::thread		 writer;
+
+		void	write_batches(void);
+	public:
+		TraceRing(size_t, TraceSink *);
+		~TraceRing();
+
+		void record(const TraceRecord &);
+		void flush(void);
+		void fault(void);
+
+		// wait blocks until the writer has passed on everything
+		// flushed so far.
+		void wait(void);
+};
+
+
+#endif